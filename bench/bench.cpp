@@ -0,0 +1,596 @@
+// Microbenchmarks for the kernels in search.cpp, run over synthetic corpora
+// that are generated deterministically so numbers are comparable between
+// runs and machines.
+//
+//     make bench DEBUG=0
+//     make bench DEBUG=0 BENCH_ARGS="--json bench.json"
+//     make bench DEBUG=0 BENCH_ARGS="--baseline bench.json --threshold 10"
+//
+// With --baseline, exits 1 if any kernel got more than --threshold percent
+// slower. --regex-engine pcre2 makes the regex_search_* kernels use PCRE2
+// instead of the DFA, so runs with each can be compared that way too.
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <optional>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "FieldIndex.h"
+#include "Worker.h"
+#include "search.h"
+
+namespace {
+
+// splitmix64, so the corpora come out byte for byte the same everywhere
+struct Rng {
+    uint64_t m_state;
+
+    explicit Rng(uint64_t seed) : m_state(seed) {
+    }
+
+    uint64_t next() {
+        uint64_t z = (m_state += 0x9e3779b97f4a7c15);
+        z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+        z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+        return z ^ (z >> 31);
+    }
+
+    size_t below(size_t n) {
+        return (size_t)(next() % n);
+    }
+
+    template <typename T> T const &pick(std::vector<T> const &v) {
+        return v[below(v.size())];
+    }
+};
+
+struct Corpus {
+    std::string name;
+    std::string contents;
+    // what the literal kernels look for, what the regex kernels look for,
+    // and what the field kernels look for. only the json corpus is json,
+    // in the rest the field kernels are skipping lines without the key.
+    std::string literal;
+    std::string regex;
+    std::string field;
+    // occurrences of literal, counted up front outside of any timing
+    size_t num_literal_matches;
+};
+
+size_t count_literal_matches(std::string_view contents,
+                             std::string_view literal) {
+    size_t matches = 0;
+    for (size_t offset = contents.find(literal); offset != std::string::npos;
+         offset = contents.find(literal, offset + 1)) {
+        ++matches;
+    }
+    return matches;
+}
+
+std::vector<std::string> const words = {
+    "the",     "request", "handler", "cache",   "miss",   "upstream",
+    "timeout", "retry",   "user",    "session", "token",  "expired",
+    "queue",   "drained", "worker",  "shard",   "commit", "rollback",
+    "index",   "rebuild", "socket",  "closed",  "buffer", "flushed",
+};
+
+// timestamped lines that look like a service log. one in every few hundred
+// is a 503, about half of which are slow.
+Corpus make_log_corpus(size_t size) {
+    Rng rng(1);
+    std::vector<std::string> const levels = {"INFO", "INFO", "INFO", "DEBUG",
+                                             "WARN", "ERROR"};
+    Corpus corpus{"log", "", "status=503",
+                  "status=5[0-9][0-9] latency=[0-9]{4}ms", ".status=503", 0};
+    std::string &out = corpus.contents;
+    out.reserve(size + 256);
+    char line[256];
+    while (out.size() < size) {
+        bool failed = rng.below(300) == 0;
+        int status = failed ? 503 : (rng.below(10) == 0 ? 404 : 200);
+        size_t latency = failed && rng.below(2) == 0 ? 1000 + rng.below(9000)
+                                                     : rng.below(900);
+        snprintf(line, sizeof(line),
+                 "2024-03-%02zu %02zu:%02zu:%02zu.%03zu %s [worker-%zu] %s %s "
+                 "id=%016lx status=%d latency=%zums\n",
+                 1 + rng.below(28), rng.below(24), rng.below(60),
+                 rng.below(60), rng.below(1000), rng.pick(levels).c_str(),
+                 rng.below(16), rng.pick(words).c_str(),
+                 rng.pick(words).c_str(), (unsigned long)rng.next(), status,
+                 latency);
+        out += line;
+    }
+    return corpus;
+}
+
+// the same sort of thing as a JSON object per line, with the status nested
+// in a request about half the time
+Corpus make_json_corpus(size_t size) {
+    Rng rng(5);
+    std::vector<std::string> const levels = {"info", "info", "info", "debug",
+                                             "warn", "error"};
+    Corpus corpus{"json", "", "\"status\":503", "\"status\":5[0-9][0-9]",
+                  ".status=503", 0};
+    std::string &out = corpus.contents;
+    out.reserve(size + 512);
+    char line[512];
+    while (out.size() < size) {
+        bool failed = rng.below(300) == 0;
+        int status = failed ? 503 : (rng.below(10) == 0 ? 404 : 200);
+        snprintf(line, sizeof(line),
+                 "{\"ts\":\"2024-03-%02zuT%02zu:%02zu:%02zu.%03zuZ\","
+                 "\"level\":\"%s\",\"worker\":%zu,\"msg\":\"%s %s\","
+                 "\"id\":\"%016lx\",\"status\":%d,\"latency_ms\":%zu,"
+                 "\"tags\":[\"%s\",\"%s\"]}\n",
+                 1 + rng.below(28), rng.below(24), rng.below(60),
+                 rng.below(60), rng.below(1000), rng.pick(levels).c_str(),
+                 rng.below(16), rng.pick(words).c_str(),
+                 rng.pick(words).c_str(), (unsigned long)rng.next(), status,
+                 rng.below(900), rng.pick(words).c_str(),
+                 rng.pick(words).c_str());
+        out += line;
+    }
+    return corpus;
+}
+
+// a handful of very long lines, the kind that come out of minified json
+Corpus make_long_line_corpus(size_t size) {
+    Rng rng(2);
+    Corpus corpus{"long_line", "", "QUUXZ", "QU+XZ", ".id=QUUXZ", 0};
+    std::string &out = corpus.contents;
+    out.reserve(size + 256);
+    while (out.size() < size) {
+        size_t line_length = 64 * 1024 + rng.below(1024 * 1024);
+        size_t line_end = out.size() + line_length;
+        while (out.size() < line_end) {
+            if (rng.below(20000) == 0) {
+                out += rng.below(2) ? "QUUXZ " : "QUUUXZ ";
+            }
+            out += rng.pick(words);
+            out += ' ';
+        }
+        out += '\n';
+    }
+    return corpus;
+}
+
+// mostly multibyte text, with plenty of partial matches on the first word
+Corpus make_utf8_corpus(size_t size) {
+    Rng rng(3);
+    std::vector<std::string> const utf8_words = {
+        "Привет", "данные", "мир",    "日本語", "東京",  "検索",
+        "héllo",  "naïve",  "façade", "😀",     "🚀",    "Ωμέγα",
+        "straße", "ß",      "Привет", "مرحبا",  "שלום", "世界",
+    };
+    Corpus corpus{"utf8", "", "Привет мир", "Привет (мир|world)",
+                  ".word=мир", 0};
+    std::string &out = corpus.contents;
+    out.reserve(size + 256);
+    while (out.size() < size) {
+        size_t num_words = 4 + rng.below(16);
+        for (size_t i = 0; i < num_words; ++i) {
+            out += rng.pick(utf8_words);
+            out += ' ';
+        }
+        if (rng.below(200) == 0) {
+            out += rng.below(2) ? "Привет мир" : "Привет world";
+        }
+        out += '\n';
+    }
+    return corpus;
+}
+
+// runs of a that almost make the pattern, so every position is a near miss
+Corpus make_pathological_corpus(size_t size) {
+    Rng rng(4);
+    Corpus corpus{"pathological", "", "aaaaaaaaab", "a{9}b", ".a=b", 0};
+    std::string &out = corpus.contents;
+    out.reserve(size + 256);
+    while (out.size() < size) {
+        size_t run = 1 + rng.below(40);
+        out.append(run, 'a');
+        out += rng.below(500) == 0 ? 'b' : 'c';
+        if (rng.below(4) == 0) {
+            out += '\n';
+        }
+    }
+    out += '\n';
+    return corpus;
+}
+
+using Searcher = std::optional<size_t> (*)(std::string_view, std::string_view,
+                                           size_t, size_t, bool,
+                                           std::stop_token);
+
+// One full pass of a kernel over a corpus. Returns how many bytes it got
+// through and how many matches it found along the way.
+struct PassResult {
+    size_t bytes;
+    size_t matches;
+};
+using Pass = std::function<PassResult(Corpus const &)>;
+
+// finds every match with repeated calls to a forward kernel, same as n
+PassResult forward_pass(Searcher searcher, std::string_view contents,
+                        std::string_view pattern, bool caseless) {
+    size_t matches = 0;
+    size_t offset = 0;
+    while (offset < contents.size()) {
+        std::optional<size_t> result = searcher(
+            contents, pattern, offset, contents.size(), caseless, {});
+        if (!result || *result >= contents.size()) {
+            break;
+        }
+        ++matches;
+        offset = *result + 1;
+    }
+    return {contents.size(), matches};
+}
+
+// finds every match with repeated calls to a backward kernel, same as N
+PassResult backward_pass(Searcher searcher, std::string_view contents,
+                         std::string_view pattern, bool caseless) {
+    size_t matches = 0;
+    size_t end = contents.size();
+    while (end > 0) {
+        std::optional<size_t> result =
+            searcher(contents, pattern, 0, end, caseless, {});
+        if (!result || *result >= end) {
+            break;
+        }
+        ++matches;
+        end = *result;
+    }
+    return {contents.size(), matches};
+}
+
+// highlights every line for the first num_pins of the corpus's literal, its
+// regex and then some words, the way the screen gets them for pinned
+// patterns. should cost about the same however many there are.
+PassResult pinned_pass(Corpus const &corpus, size_t num_pins) {
+    std::vector<PinnedPattern> pins = {{corpus.literal, false},
+                                       {corpus.regex, false}};
+    for (size_t i = 0; pins.size() < num_pins; ++i) {
+        pins.push_back({words[i * 5 % words.size()], false});
+    }
+    pins.resize(num_pins);
+    std::string_view contents = corpus.contents;
+    size_t matches = 0;
+    for (size_t line_start = 0; line_start < contents.size();) {
+        size_t line_end = contents.find('\n', line_start);
+        if (line_end == std::string_view::npos) {
+            line_end = contents.size();
+        }
+        std::optional<std::vector<PinnedMatch>> found = pinned_matches(
+            contents.substr(line_start, line_end - line_start), pins);
+        matches += found ? found->size() : 0;
+        line_start = line_end + 1;
+    }
+    return {contents.size(), matches};
+}
+
+struct Kernel {
+    std::string name;
+    Pass pass;
+};
+
+std::vector<Kernel> make_kernels() {
+    std::vector<Kernel> kernels;
+    kernels.push_back({"basic_search_first", [](Corpus const &corpus) {
+                           return forward_pass(basic_search_first,
+                                               corpus.contents, corpus.literal,
+                                               false);
+                       }});
+    kernels.push_back({"basic_search_first_caseless", [](Corpus const &corpus) {
+                           return forward_pass(basic_search_first,
+                                               corpus.contents, corpus.literal,
+                                               true);
+                       }});
+    kernels.push_back({"basic_search_last", [](Corpus const &corpus) {
+                           return backward_pass(basic_search_last,
+                                                corpus.contents,
+                                                corpus.literal, false);
+                       }});
+    kernels.push_back({"basic_search_last_caseless", [](Corpus const &corpus) {
+                           return backward_pass(basic_search_last,
+                                                corpus.contents,
+                                                corpus.literal, true);
+                       }});
+    kernels.push_back({"regex_search_first", [](Corpus const &corpus) {
+                           return forward_pass(regex_search_first,
+                                               corpus.contents, corpus.regex,
+                                               false);
+                       }});
+    kernels.push_back({"regex_search_first_caseless", [](Corpus const &corpus) {
+                           return forward_pass(regex_search_first,
+                                               corpus.contents, corpus.regex,
+                                               true);
+                       }});
+    kernels.push_back({"regex_search_last", [](Corpus const &corpus) {
+                           return backward_pass(regex_search_last,
+                                                corpus.contents, corpus.regex,
+                                                false);
+                       }});
+    // the same through the pool, as N does it
+    kernels.push_back({"parallel_search_last", [](Corpus const &corpus) {
+                           static WorkerPool pool;
+                           return backward_pass(
+                               [](std::string_view contents,
+                                  std::string_view pattern, size_t begin,
+                                  size_t end, bool caseless,
+                                  std::stop_token stop) {
+                                   return parallel_search_last(
+                                       pool, regex_search_last, contents,
+                                       pattern, begin, end, caseless,
+                                       std::move(stop));
+                               },
+                               corpus.contents, corpus.regex, false);
+                       }});
+    // what regex_search_first falls back on, to compare against the DFA
+    kernels.push_back({"pcre2_search_first", [](Corpus const &corpus) {
+                           return forward_pass(pcre2_search_first,
+                                               corpus.contents, corpus.regex,
+                                               false);
+                       }});
+    kernels.push_back({"search_all", [](Corpus const &corpus) {
+                           std::optional<std::vector<size_t>> offsets =
+                               search_all(regex_search_first, corpus.contents,
+                                          corpus.regex, 0,
+                                          corpus.contents.size(), false, {});
+                           return PassResult{corpus.contents.size(),
+                                             offsets ? offsets->size() : 0};
+                       }});
+    // the same through the pool in sampled order, as ESC-c does it
+    kernels.push_back({"count_matches", [](Corpus const &corpus) {
+                           static WorkerPool pool;
+                           MatchCounter counter(256 * 1024, 64);
+                           count_matches(pool, regex_search_first, counter,
+                                         corpus.contents, corpus.regex, false,
+                                         {});
+                           return PassResult{
+                               corpus.contents.size(),
+                               (size_t)counter.estimate()->count};
+                       }});
+    kernels.push_back({"field_search_first", [](Corpus const &corpus) {
+                           return forward_pass(field_search_first,
+                                               corpus.contents, corpus.field,
+                                               false);
+                       }});
+    kernels.push_back({"field_search_last", [](Corpus const &corpus) {
+                           return backward_pass(field_search_last,
+                                                corpus.contents, corpus.field,
+                                                false);
+                       }});
+    // what --field-index builds in the background, after which n and N on
+    // that field don't need the kernels above
+    kernels.push_back({"field_index", [](Corpus const &corpus) {
+                           static WorkerPool pool;
+                           std::shared_ptr<FieldIndex> index =
+                               FieldIndex::extend(
+                                   pool, nullptr,
+                                   *FieldQuery::parse(corpus.field),
+                                   corpus.contents, {});
+                           size_t keys = 0;
+                           for (auto const &values : index->m_values) {
+                               if (!values) {
+                                   continue;
+                               }
+                               for (auto const &[value, offsets] : *values) {
+                                   keys += offsets.size();
+                               }
+                           }
+                           return PassResult{corpus.contents.size(), keys};
+                       }});
+    kernels.push_back({"pinned_matches_1", [](Corpus const &corpus) {
+                           return pinned_pass(corpus, 1);
+                       }});
+    kernels.push_back({"pinned_matches_6", [](Corpus const &corpus) {
+                           return pinned_pass(corpus, max_pins);
+                       }});
+    kernels.push_back({"search_forward_n", [](Corpus const &corpus) {
+                           // as if someone typed 1000n
+                           std::optional<size_t> offset = search_forward_n(
+                               basic_search_first, 1000, corpus.contents,
+                               corpus.literal, 0, corpus.contents.size(),
+                               false, {});
+                           size_t bytes = corpus.contents.size();
+                           if (offset && *offset < bytes) {
+                               bytes = *offset;
+                           }
+                           return PassResult{
+                               bytes,
+                               std::min((size_t)1000,
+                                        corpus.num_literal_matches)};
+                       }});
+    return kernels;
+}
+
+struct Result {
+    std::string name;
+    size_t bytes;
+    size_t matches;
+    double seconds;
+
+    double gbps() const {
+        return (double)bytes / seconds / 1e9;
+    }
+    double ns_per_match() const {
+        return matches == 0 ? 0 : seconds * 1e9 / (double)matches;
+    }
+};
+
+void write_json(FILE *f, std::vector<Result> const &results) {
+    // one result per line, which is what read_baseline() expects back
+    fprintf(f, "{\"results\": [\n");
+    for (size_t i = 0; i < results.size(); ++i) {
+        Result const &result = results[i];
+        fprintf(f,
+                "{\"name\": \"%s\", \"bytes\": %zu, \"matches\": %zu, "
+                "\"seconds\": %.6f, \"gbps\": %.4f, "
+                "\"ns_per_match\": %.1f}%s\n",
+                result.name.c_str(), result.bytes, result.matches,
+                result.seconds, result.gbps(), result.ns_per_match(),
+                i + 1 == results.size() ? "" : ",");
+    }
+    fprintf(f, "]}\n");
+}
+
+// name -> GB/s, from a file written by --json
+std::map<std::string, double> read_baseline(const char *path) {
+    std::map<std::string, double> baseline;
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    char line[1024];
+    while (fgets(line, sizeof(line), f)) {
+        const char *name = strstr(line, "\"name\": \"");
+        const char *gbps = strstr(line, "\"gbps\": ");
+        if (!name || !gbps) {
+            continue;
+        }
+        name += strlen("\"name\": \"");
+        const char *name_end = strchr(name, '"');
+        if (!name_end) {
+            continue;
+        }
+        baseline[std::string(name, name_end)] =
+            strtod(gbps + strlen("\"gbps\": "), nullptr);
+    }
+    fclose(f);
+    return baseline;
+}
+
+void usage(const char *argv0) {
+    fprintf(stderr,
+            "usage: %s [--size MiB] [--iterations N] [--filter SUBSTRING]\n"
+            "          [--json FILE] [--baseline FILE] [--threshold PERCENT]\n"
+            "          [--regex-engine auto|pcre2]\n",
+            argv0);
+    exit(1);
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    size_t size_mib = 64;
+    size_t iterations = 3;
+    std::string filter;
+    const char *json_path = nullptr;
+    const char *baseline_path = nullptr;
+    double threshold = 10;
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+        }
+        if (arg == "--size") {
+            size_mib = strtoul(argv[++i], nullptr, 10);
+        } else if (arg == "--iterations") {
+            iterations = std::max(1ul, strtoul(argv[++i], nullptr, 10));
+        } else if (arg == "--filter") {
+            filter = argv[++i];
+        } else if (arg == "--json") {
+            json_path = argv[++i];
+        } else if (arg == "--baseline") {
+            baseline_path = argv[++i];
+        } else if (arg == "--threshold") {
+            threshold = strtod(argv[++i], nullptr);
+        } else if (arg == "--regex-engine") {
+            std::optional<RegexEngine> engine = parse_regex_engine(argv[++i]);
+            if (!engine) {
+                usage(argv[0]);
+            }
+            set_regex_engine(*engine);
+        } else {
+            usage(argv[0]);
+        }
+    }
+
+#ifndef __OPTIMIZE__
+    fprintf(stderr, "warning: not an optimised build, use make bench DEBUG=0 "
+                    "for numbers that mean anything\n");
+#endif
+
+    size_t size = size_mib * 1024 * 1024;
+    std::vector<Corpus> corpora;
+    corpora.push_back(make_log_corpus(size));
+    corpora.push_back(make_json_corpus(size));
+    corpora.push_back(make_long_line_corpus(size));
+    corpora.push_back(make_utf8_corpus(size));
+    corpora.push_back(make_pathological_corpus(size));
+    for (Corpus &corpus : corpora) {
+        corpus.num_literal_matches =
+            count_literal_matches(corpus.contents, corpus.literal);
+    }
+
+    std::vector<Result> results;
+    printf("%-44s %10s %12s %10s\n", "kernel/corpus", "GB/s", "ns/match",
+           "matches");
+    for (Kernel const &kernel : make_kernels()) {
+        for (Corpus const &corpus : corpora) {
+            std::string name = kernel.name + "/" + corpus.name;
+            if (name.find(filter) == std::string::npos) {
+                continue;
+            }
+            // best of n, the slower runs are mostly noise from elsewhere
+            Result result{name, 0, 0, 0};
+            for (size_t i = 0; i < iterations; ++i) {
+                auto start = std::chrono::steady_clock::now();
+                PassResult pass = kernel.pass(corpus);
+                double seconds = std::chrono::duration<double>(
+                                     std::chrono::steady_clock::now() - start)
+                                     .count();
+                if (i == 0 || seconds < result.seconds) {
+                    result = {name, pass.bytes, pass.matches, seconds};
+                }
+            }
+            printf("%-44s %10.3f %12.1f %10zu\n", name.c_str(), result.gbps(),
+                   result.ns_per_match(), result.matches);
+            fflush(stdout);
+            results.push_back(std::move(result));
+        }
+    }
+
+    if (json_path) {
+        FILE *f = fopen(json_path, "w");
+        if (!f) {
+            fprintf(stderr, "%s: %s\n", json_path, strerror(errno));
+            return 1;
+        }
+        write_json(f, results);
+        fclose(f);
+    }
+
+    if (baseline_path) {
+        std::map<std::string, double> baseline = read_baseline(baseline_path);
+        bool regressed = false;
+        printf("\n%-44s %10s %10s %8s\n", "kernel/corpus", "baseline", "now",
+               "change");
+        for (Result const &result : results) {
+            auto it = baseline.find(result.name);
+            if (it == baseline.end() || it->second <= 0) {
+                continue;
+            }
+            double change = (result.gbps() - it->second) / it->second * 100;
+            bool slower = change < -threshold;
+            regressed |= slower;
+            printf("%-44s %10.3f %10.3f %+7.1f%%%s\n", result.name.c_str(),
+                   it->second, result.gbps(), change,
+                   slower ? "  REGRESSED" : "");
+        }
+        if (regressed) {
+            return 1;
+        }
+    }
+    return 0;
+}
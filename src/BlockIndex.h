@@ -0,0 +1,538 @@
+#pragma once
+
+#include <algorithm>
+#include <iterator>
+#include <memory>
+#include <optional>
+#include <stddef.h>
+#include <stdint.h>
+#include <stop_token>
+#include <string.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "JsonFields.h"
+#include "LazyDfa.h"
+#include "SearchProgress.h"
+#include "Trace.h"
+
+// Which trigrams a match has to contain. ALL means it could be anything.
+struct TrigramQuery {
+    enum Kind {
+        ALL,
+        TRIGRAM,
+        // a whole token, when the pattern has something that isn't a token
+        // byte either side of it. not case folded.
+        TOKEN,
+        AND,
+        OR,
+        // a FieldQuery's path in token and its value in value, only a
+        // FieldIndex knows anything about those
+        FIELD,
+    };
+
+    Kind kind = ALL;
+    uint32_t trigram = 0;
+    std::string token;
+    std::string value;
+    std::vector<TrigramQuery> children;
+
+    // trigrams are ASCII case folded, so caseless searches can use them
+    static uint32_t fold(unsigned char c) {
+        return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+    }
+
+    // tokens are runs of letters, digits, _ and anything non-ASCII
+    static bool is_token_byte(unsigned char c) {
+        return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+               (c >= 'A' && c <= 'Z') || c == '_' || c >= 0x80;
+    }
+
+    static TrigramQuery literal(std::string_view pattern);
+    // Works from the same parse the lazy DFA uses, so anything it can't
+    // parse (anchors, backreferences...) doesn't narrow anything down. A
+    // field query needs its last key and its value, and the FIELD itself.
+    static TrigramQuery regex(std::string_view pattern);
+};
+
+// Works out the TrigramQuery for a regex, after Russ Cox's "Regular
+// Expression Matching with a Trigram Index", minus the prefix and suffix
+// tracking.
+struct TrigramAnalysis {
+    using enum TrigramQuery::Kind;
+
+    // shorter tokens are in every block anyway
+    constexpr static size_t min_token = 3;
+    // more strings than this and it stops keeping track of them
+    constexpr static size_t max_exact = 64;
+    constexpr static size_t max_exact_bytes = 16;
+    constexpr static size_t max_exact_repeat = 8;
+
+    using Strings = std::vector<std::string>;
+
+    // exact is every string the node can match, when there aren't too many
+    struct Info {
+        std::optional<Strings> exact;
+        TrigramQuery query;
+    };
+
+    static TrigramQuery all_of(std::vector<TrigramQuery> queries) {
+        std::erase_if(queries,
+                      [](TrigramQuery const &q) { return q.kind == ALL; });
+        if (queries.size() == 1) {
+            return std::move(queries[0]);
+        }
+        TrigramQuery out;
+        if (!queries.empty()) {
+            out.kind = AND;
+            out.children = std::move(queries);
+        }
+        return out;
+    }
+
+    static TrigramQuery any_of(std::vector<TrigramQuery> queries) {
+        for (TrigramQuery const &q : queries) {
+            if (q.kind == ALL) {
+                return {};
+            }
+        }
+        if (queries.size() == 1) {
+            return std::move(queries[0]);
+        }
+        TrigramQuery out;
+        out.kind = OR;
+        out.children = std::move(queries);
+        return out;
+    }
+
+    // a match is one of strings
+    static TrigramQuery strings(Strings const &strings) {
+        std::vector<TrigramQuery> alternatives;
+        for (std::string const &s : strings) {
+            std::vector<TrigramQuery> parts;
+            for (size_t i = 0; i + 2 < s.size(); ++i) {
+                TrigramQuery q;
+                q.kind = TRIGRAM;
+                q.trigram = TrigramQuery::fold((unsigned char)s[i]) << 16 |
+                            TrigramQuery::fold((unsigned char)s[i + 1]) << 8 |
+                            TrigramQuery::fold((unsigned char)s[i + 2]);
+                parts.push_back(std::move(q));
+            }
+            // the runs at either end might carry on into more of a token
+            // in the text, the ones in between can't
+            size_t i = 0;
+            while (i < s.size() &&
+                   TrigramQuery::is_token_byte((unsigned char)s[i])) {
+                ++i;
+            }
+            while (i < s.size()) {
+                size_t begin = i;
+                while (begin < s.size() &&
+                       !TrigramQuery::is_token_byte((unsigned char)s[begin])) {
+                    ++begin;
+                }
+                size_t end = begin;
+                while (end < s.size() &&
+                       TrigramQuery::is_token_byte((unsigned char)s[end])) {
+                    ++end;
+                }
+                if (end < s.size() && end - begin >= min_token) {
+                    TrigramQuery q;
+                    q.kind = TOKEN;
+                    q.token = s.substr(begin, end - begin);
+                    parts.push_back(std::move(q));
+                }
+                i = end;
+            }
+            alternatives.push_back(all_of(std::move(parts)));
+        }
+        return any_of(std::move(alternatives));
+    }
+
+    static Strings cross(Strings const &a, Strings const &b) {
+        Strings out;
+        for (std::string const &x : a) {
+            for (std::string const &y : b) {
+                out.push_back(x + y);
+            }
+        }
+        std::sort(out.begin(), out.end());
+        out.erase(std::unique(out.begin(), out.end()), out.end());
+        return out;
+    }
+
+    static bool can_match_newline(RegexNode const &node) {
+        if (node.kind == RegexNode::BYTES) {
+            return node.bytes['\n'];
+        }
+        return std::any_of(node.children.begin(), node.children.end(),
+                           [](auto const &child) {
+                               return can_match_newline(*child);
+                           });
+    }
+
+    static Info analyse(RegexNode const &node) {
+        switch (node.kind) {
+        case RegexNode::BYTES: {
+            Strings bytes;
+            for (size_t c = 0; c < 256; ++c) {
+                if (node.bytes[c]) {
+                    uint32_t folded = TrigramQuery::fold((unsigned char)c);
+                    bytes.push_back(std::string(1, (char)folded));
+                }
+            }
+            std::sort(bytes.begin(), bytes.end());
+            bytes.erase(std::unique(bytes.begin(), bytes.end()), bytes.end());
+            if (bytes.size() > max_exact_bytes) {
+                return {};
+            }
+            return {std::move(bytes), {}};
+        }
+        case RegexNode::CONCAT: {
+            // runs of children with exact strings get glued together, so
+            // that "foo" is one string rather than three letters
+            std::vector<TrigramQuery> parts;
+            Strings run = {""};
+            bool all_exact = true;
+            for (auto const &child : node.children) {
+                Info info = analyse(*child);
+                if (info.exact &&
+                    run.size() * info.exact->size() <= max_exact) {
+                    run = cross(run, *info.exact);
+                    continue;
+                }
+                all_exact = false;
+                parts.push_back(strings(run));
+                if (info.exact) {
+                    run = std::move(*info.exact);
+                } else {
+                    parts.push_back(std::move(info.query));
+                    run = {""};
+                }
+            }
+            if (all_exact) {
+                TrigramQuery query = strings(run);
+                return {std::move(run), std::move(query)};
+            }
+            parts.push_back(strings(run));
+            return {std::nullopt, all_of(std::move(parts))};
+        }
+        case RegexNode::ALTERNATE: {
+            std::optional<Strings> exact = Strings{};
+            std::vector<TrigramQuery> queries;
+            for (auto const &child : node.children) {
+                Info info = analyse(*child);
+                if (exact && info.exact &&
+                    exact->size() + info.exact->size() <= max_exact) {
+                    exact->insert(exact->end(), info.exact->begin(),
+                                  info.exact->end());
+                } else {
+                    exact.reset();
+                }
+                queries.push_back(std::move(info.query));
+            }
+            if (exact) {
+                std::sort(exact->begin(), exact->end());
+                exact->erase(std::unique(exact->begin(), exact->end()),
+                             exact->end());
+                TrigramQuery query = strings(*exact);
+                return {std::move(exact), std::move(query)};
+            }
+            return {std::nullopt, any_of(std::move(queries))};
+        }
+        case RegexNode::REPEAT: {
+            Info child = analyse(*node.children[0]);
+            if (child.exact && node.max <= max_exact_repeat) {
+                // x{1,3} is x, xx or xxx
+                Strings out;
+                Strings power = {""};
+                for (size_t k = 0; k <= node.max; ++k) {
+                    if (k >= node.min) {
+                        out.insert(out.end(), power.begin(), power.end());
+                    }
+                    if (k == node.max || out.size() > max_exact) {
+                        break;
+                    }
+                    power = cross(power, *child.exact);
+                }
+                if (out.size() <= max_exact) {
+                    std::sort(out.begin(), out.end());
+                    out.erase(std::unique(out.begin(), out.end()), out.end());
+                    TrigramQuery query = strings(out);
+                    return {std::move(out), std::move(query)};
+                }
+            }
+            if (node.min == 0) {
+                return {};
+            }
+            // at least one of them is in there somewhere
+            return {std::nullopt, std::move(child.query)};
+        }
+        }
+        return {};
+    }
+};
+
+inline TrigramQuery TrigramQuery::literal(std::string_view pattern) {
+    if (pattern.find('\n') != std::string_view::npos) {
+        return {};
+    }
+    return TrigramAnalysis::strings({std::string(pattern)});
+}
+
+inline TrigramQuery TrigramQuery::regex(std::string_view pattern) {
+    if (std::optional<FieldQuery> field = FieldQuery::from_pattern(pattern)) {
+        TrigramQuery query;
+        query.kind = FIELD;
+        query.token = field->path;
+        query.value = field->value;
+        return TrigramAnalysis::all_of({literal(field->needle()),
+                                        literal(field->value),
+                                        std::move(query)});
+    }
+    std::unique_ptr<RegexNode> root = RegexParser(pattern, false).parse();
+    // the index only promises a match is within one block if it's within
+    // one line
+    if (!root || TrigramAnalysis::can_match_newline(*root)) {
+        return {};
+    }
+    return TrigramAnalysis::analyse(*root).query;
+}
+
+// A file split into blocks of about block_size, each ending just after a
+// newline, so anything that matches within a line matches within one block.
+// Whatever comes after the last newline isn't covered. What's known about
+// each block is up to the subclass.
+struct BlockIndex {
+    constexpr static size_t block_size = 1 << 20;
+
+    std::vector<uint64_t> m_block_starts = {0};
+
+    // block numbers in order, nullopt if it could be any of them
+    using Blocks = std::optional<std::vector<uint32_t>>;
+
+    // mark dtor as virtual
+    virtual ~BlockIndex() {
+    }
+
+    size_t num_blocks() const {
+        return m_block_starts.size() - 1;
+    }
+    size_t indexed_size() const {
+        return m_block_starts.back();
+    }
+    size_t block_begin(uint32_t block) const {
+        return m_block_starts[block];
+    }
+    size_t block_end(uint32_t block) const {
+        return m_block_starts[block + 1];
+    }
+
+    // the blocks that could have a match for query
+    Blocks candidates(TrigramQuery const &query) const {
+        switch (query.kind) {
+        case TrigramQuery::ALL:
+            return std::nullopt;
+        case TrigramQuery::TRIGRAM:
+        case TrigramQuery::TOKEN:
+        case TrigramQuery::FIELD:
+            return blocks_with(query);
+        case TrigramQuery::AND: {
+            Blocks out;
+            for (TrigramQuery const &child : query.children) {
+                Blocks blocks = candidates(child);
+                if (!blocks) {
+                    continue;
+                }
+                if (!out) {
+                    out = std::move(blocks);
+                } else {
+                    std::vector<uint32_t> both;
+                    std::set_intersection(out->begin(), out->end(),
+                                          blocks->begin(), blocks->end(),
+                                          std::back_inserter(both));
+                    out = std::move(both);
+                }
+                if (out->empty()) {
+                    break;
+                }
+            }
+            return out;
+        }
+        case TrigramQuery::OR: {
+            std::vector<uint32_t> out;
+            for (TrigramQuery const &child : query.children) {
+                Blocks blocks = candidates(child);
+                if (!blocks) {
+                    return std::nullopt;
+                }
+                std::vector<uint32_t> either;
+                std::set_union(out.begin(), out.end(), blocks->begin(),
+                               blocks->end(), std::back_inserter(either));
+                out = std::move(either);
+            }
+            return out;
+        }
+        }
+        return std::nullopt;
+    }
+
+    // For an index that knows exactly where query matches in a block, not
+    // just that it might: the first match in [begin, end) or the last one
+    // if backward, npos if there isn't one. [begin, end) is within one of
+    // the blocks candidates() came up with. nullopt if it can't tell.
+    virtual std::optional<size_t> find(TrigramQuery const & /*query*/,
+                                       size_t /*begin*/, size_t /*end*/,
+                                       bool /*caseless*/,
+                                       bool /*backward*/) const {
+        return std::nullopt;
+    }
+
+  protected:
+    // the blocks a TRIGRAM, TOKEN or FIELD query could turn up in, nullopt
+    // if there's no telling
+    virtual Blocks blocks_with(TrigramQuery const &query) const = 0;
+
+    // splits contents from the end of the last block up to its last newline
+    void add_blocks(std::string_view contents) {
+        const char *last_newline =
+            (const char *)memrchr(contents.data(), '\n', contents.size());
+        size_t limit =
+            last_newline ? (size_t)(last_newline - contents.data()) + 1 : 0;
+        for (size_t begin = indexed_size(); begin < limit;) {
+            size_t end = std::min(begin + block_size, limit);
+            if (end < limit) {
+                // there's always one, contents[limit - 1] is a newline
+                end = (size_t)((const char *)memchr(contents.data() + end - 1,
+                                                    '\n', limit - end + 1) -
+                               contents.data()) +
+                      1;
+            }
+            m_block_starts.push_back(end);
+            begin = end;
+        }
+    }
+};
+
+// Wraps a search kernel so that it only looks at the blocks the index can't
+// rule out, and whatever's been appended past the end of the index. With no
+// index, or a query the index can't narrow down, it's just the kernel.
+template <typename Searcher>
+struct IndexedSearcher {
+    Searcher m_searcher;
+    std::shared_ptr<const BlockIndex> m_index;
+    bool m_backward;
+    TrigramQuery m_query;
+    BlockIndex::Blocks m_blocks;
+
+    IndexedSearcher(Searcher searcher,
+                    std::shared_ptr<const BlockIndex> index,
+                    TrigramQuery const &query, bool backward)
+        : m_searcher(searcher), m_index(std::move(index)),
+          m_backward(backward), m_query(query) {
+        if (m_index) {
+            TRACE_SPAN("index", "query");
+            m_blocks = m_index->candidates(query);
+        }
+    }
+
+    std::optional<size_t> operator()(std::string_view contents,
+                                     std::string_view pattern, size_t begin,
+                                     size_t end, bool caseless,
+                                     std::stop_token stop) const {
+        if (!m_blocks) {
+            return m_searcher(contents, pattern, begin, end, caseless, stop);
+        }
+        return m_backward
+                   ? search_last(contents, pattern, begin, end, caseless, stop)
+                   : search_first(contents, pattern, begin, end, caseless,
+                                  stop);
+    }
+
+  private:
+    // straight from the index if it can say, otherwise the kernel
+    std::optional<size_t> search_block(std::string_view contents,
+                                       std::string_view pattern, size_t begin,
+                                       size_t end, bool caseless,
+                                       std::stop_token stop) const {
+        if (std::optional<size_t> result =
+                m_index->find(m_query, begin, end, caseless, m_backward)) {
+            SearchProgress::skipped(end - begin);
+            return result;
+        }
+        return m_searcher(contents, pattern, begin, end, caseless, stop);
+    }
+
+    std::optional<size_t> search_first(std::string_view contents,
+                                       std::string_view pattern, size_t begin,
+                                       size_t end, bool caseless,
+                                       std::stop_token stop) const {
+        size_t indexed = std::min(end, m_index->indexed_size());
+        size_t pos = begin;
+        auto it = std::partition_point(
+            m_blocks->begin(), m_blocks->end(),
+            [&](uint32_t block) { return m_index->block_end(block) <= begin; });
+        for (; it != m_blocks->end(); ++it) {
+            size_t block_begin = std::max(begin, m_index->block_begin(*it));
+            size_t block_end = std::min(indexed, m_index->block_end(*it));
+            if (block_begin >= block_end) {
+                break;
+            }
+            SearchProgress::skipped(block_begin - pos);
+            std::optional<size_t> result = search_block(
+                contents, pattern, block_begin, block_end, caseless, stop);
+            if (!result || *result != std::string::npos) {
+                return result;
+            }
+            pos = block_end;
+        }
+        if (pos < indexed) {
+            SearchProgress::skipped(indexed - pos);
+            pos = indexed;
+        }
+        if (pos < end) {
+            return m_searcher(contents, pattern, pos, end, caseless, stop);
+        }
+        return std::string::npos;
+    }
+
+    std::optional<size_t> search_last(std::string_view contents,
+                                      std::string_view pattern, size_t begin,
+                                      size_t end, bool caseless,
+                                      std::stop_token stop) const {
+        size_t indexed = std::max(begin, m_index->indexed_size());
+        size_t pos = end;
+        if (indexed < end) {
+            std::optional<size_t> result =
+                m_searcher(contents, pattern, indexed, end, caseless, stop);
+            if (!result || *result != std::string::npos) {
+                return result;
+            }
+            pos = indexed;
+        }
+        // one past the last block that starts before pos
+        auto it = std::partition_point(
+            m_blocks->begin(), m_blocks->end(),
+            [&](uint32_t block) { return m_index->block_begin(block) < pos; });
+        while (it != m_blocks->begin()) {
+            --it;
+            size_t block_begin = std::max(begin, m_index->block_begin(*it));
+            size_t block_end = std::min(pos, m_index->block_end(*it));
+            if (block_begin >= block_end) {
+                break;
+            }
+            SearchProgress::skipped(pos - block_end);
+            std::optional<size_t> result = search_block(
+                contents, pattern, block_begin, block_end, caseless, stop);
+            if (!result || *result != std::string::npos) {
+                return result;
+            }
+            pos = block_begin;
+        }
+        if (pos > begin) {
+            SearchProgress::skipped(pos - begin);
+        }
+        return std::string::npos;
+    }
+};
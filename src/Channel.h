@@ -1,98 +1,157 @@
 #pragma once
 
 #include <atomic>
-#include <condition_variable>
-#include <mutex>
+#include <memory>
 #include <optional>
-#include <queue>
-
-template <typename T> struct Channel {
-    bool closed = false;
-    std::queue<T> que;
-    // for signal handlers to send into channel
-    // we need something "lock free" but i'm too lazy to copy my lecture notes
-    // from last semester
-    // state: OR of the following:
-    //   - 0x1: intent to set
-    //   - 0x2: setting complete, ready to read
-    std::atomic<char> sig_que_state;
-    T sig_que;
-
-    mutable std::mutex mut;
-    std::condition_variable cond;
+#include <stdint.h>
+#include <thread>
+#include <vector>
 
-    void push(T v) {
-        {
-            std::scoped_lock lock(mut);
-            que.push(std::move(v));
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+// Bounded lock-free multi-producer single-consumer queue. Every slot carries
+// a sequence number saying whose turn it is (Vyukov's bounded queue), so
+// producers only contend on a single fetch of the tail.
+//
+// Wakeups go through an eventfd, so the consumer can either block in pop()
+// or put get_fd() in its own poll/epoll set and drain with pop_all().
+template <typename T, size_t Capacity = 1024> struct Channel {
+    static_assert((Capacity & (Capacity - 1)) == 0,
+                  "Channel capacity must be a power of 2");
+
+    struct Slot {
+        std::atomic<size_t> seq;
+        T value;
+    };
+
+    std::unique_ptr<Slot[]> m_slots;
+    std::atomic<size_t> m_tail;
+    // only ever touched by the consumer
+    size_t m_head;
+
+    std::atomic<bool> m_closed;
+    int m_event_fd;
+
+    Channel()
+        : m_slots(new Slot[Capacity]), m_tail(0), m_head(0), m_closed(false),
+          m_event_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {
+        if (m_event_fd == -1) {
+            fprintf(stderr, "Channel: could not create eventfd. %s\n",
+                    strerror(errno));
+            exit(1);
         }
-        cond.notify_one();
+        for (size_t i = 0; i < Capacity; ++i) {
+            m_slots[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+    Channel(Channel const &) = delete;
+    Channel &operator=(Channel const &) = delete;
+    Channel(Channel &&) = delete;
+    Channel &operator=(Channel &&) = delete;
+    ~Channel() {
+        ::close(m_event_fd);
     }
 
-    void push_signal(T v) {
-        if (sig_que_state.fetch_or(0x1) & 0x1) {
-            // We didn't get the intent to set, return
-            return;
+    void push(T v) {
+        size_t pos = m_tail.load(std::memory_order_relaxed);
+        Slot *slot;
+        while (true) {
+            slot = &m_slots[pos & (Capacity - 1)];
+            size_t seq = slot->seq.load(std::memory_order_acquire);
+            if (seq == pos) {
+                if (m_tail.compare_exchange_weak(pos, pos + 1,
+                                                 std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (seq < pos) {
+                // full, wait for the consumer to catch up
+                std::this_thread::yield();
+                pos = m_tail.load(std::memory_order_relaxed);
+            } else {
+                pos = m_tail.load(std::memory_order_relaxed);
+            }
         }
-        // We were the ones to set the intent, go ahead and set it now.
-        sig_que = std::move(v);
-        sig_que_state.fetch_or(0x2); // Indicate that it's been set
-        cond.notify_one();
+        slot->value = std::move(v);
+        slot->seq.store(pos + 1, std::memory_order_release);
+        notify();
     }
 
     std::optional<T> try_pop() {
-        std::unique_lock lock(mut);
-
-        if (sig_que_state & 0x2) {
-            T val = std::move(sig_que);
-            sig_que_state = 0;
-            return val;
+        Slot &slot = m_slots[m_head & (Capacity - 1)];
+        if (slot.seq.load(std::memory_order_acquire) != m_head + 1) {
+            // queue is empty
+            return std::nullopt;
         }
+        T top = std::move(slot.value);
+        slot.seq.store(m_head + Capacity, std::memory_order_release);
+        ++m_head;
+        return top;
+    }
 
-        if (!que.empty()) {
-            T top = std::move(que.front());
-            que.pop();
-            return top;
+    // Drains everything that's ready without blocking. Returns the number of
+    // values appended to out.
+    template <typename Container> size_t pop_all(Container &out) {
+        size_t num_popped = 0;
+        while (std::optional<T> v = try_pop()) {
+            out.push_back(std::move(*v));
+            ++num_popped;
         }
-
-        // queue is empty
-        return std::nullopt;
+        return num_popped;
     }
 
     std::optional<T> pop() {
-        std::unique_lock lock(mut);
-        cond.wait(lock, [this]() {
-            return !que.empty() || (sig_que_state & 0x2) || closed;
-        });
-
-        if (sig_que_state & 0x2) {
-            T val = std::move(sig_que);
-            sig_que_state = 0;
-            return val;
+        while (true) {
+            if (std::optional<T> v = try_pop()) {
+                return v;
+            }
+            if (m_closed) {
+                // queue is empty, so channel is closed
+                return std::nullopt;
+            }
+            wait();
         }
-
-        if (!que.empty()) {
-            T top = std::move(que.front());
-            que.pop();
-            return top;
-        }
-
-        // queue is empty, so channel is closed
-        return std::nullopt;
     }
 
     bool empty() const {
-        std::unique_lock lock(mut);
         // either the queue is empty
-        // or it isn't but it's not for us to read
-        return que.empty() && !(sig_que_state & 0x2);
+        // or it isn't but the slot isn't done being written to
+        Slot const &slot = m_slots[m_head & (Capacity - 1)];
+        return slot.seq.load(std::memory_order_acquire) != m_head + 1;
     }
 
     void close() {
-        {
-            std::scoped_lock lock(mut);
-            closed = true;
-        }
-        cond.notify_one();
+        m_closed = true;
+        notify();
+    }
+
+    // polls readable whenever there might be something to pop
+    int get_fd() const {
+        return m_event_fd;
+    }
+
+    // blocks until there might be something to pop
+    void wait() {
+        struct pollfd pollfd = {m_event_fd, POLLIN, 0};
+        ::poll(&pollfd, 1, -1);
+        clear_fd();
+    }
+
+    // resets the eventfd once it's been seen as readable. anything pushed
+    // after this sets it again.
+    void clear_fd() {
+        uint64_t count;
+        read(m_event_fd, &count, sizeof(count));
+    }
+
+  private:
+    void notify() {
+        uint64_t one = 1;
+        write(m_event_fd, &one, sizeof(one));
     }
 };
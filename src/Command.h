@@ -36,6 +36,15 @@ struct Command {
         INTERRUPT,
         FOLLOW_EOF,
         TOGGLE_LONG_LINES,
+        COUNT_MATCHES,
+        TOGGLE_MINIMAP,
+        JUMP_TO_DENSEST,
+        RUN_COMMAND_LINE,
+        PIN_PATTERN,
+        CLEAR_PINS,
+        PIN_NEXT,
+        PIN_PREV,
+        REPLAY_SYNC,
     };
     Type type;
     std::string payload_str;
@@ -50,4 +59,88 @@ struct Command {
         : type(type), payload_str(payload_str), payload_nums(payload_nums),
           payload_num(payload_num), start(start) {
     }
+
+    static const char *type_name(Type type) {
+        switch (type) {
+        case INVALID:
+            return "INVALID";
+        case QUIT:
+            return "QUIT";
+        case VIEW_DOWN:
+            return "VIEW_DOWN";
+        case VIEW_UP:
+            return "VIEW_UP";
+        case VIEW_LEFT:
+            return "VIEW_LEFT";
+        case VIEW_RIGHT:
+            return "VIEW_RIGHT";
+        case VIEW_DOWN_HALF_PAGE:
+            return "VIEW_DOWN_HALF_PAGE";
+        case VIEW_UP_HALF_PAGE:
+            return "VIEW_UP_HALF_PAGE";
+        case VIEW_DOWN_PAGE:
+            return "VIEW_DOWN_PAGE";
+        case VIEW_UP_PAGE:
+            return "VIEW_UP_PAGE";
+        case SET_HALF_PAGE_SIZE:
+            return "SET_HALF_PAGE_SIZE";
+        case SET_PAGE_SIZE:
+            return "SET_PAGE_SIZE";
+        case VIEW_BOF:
+            return "VIEW_BOF";
+        case VIEW_EOF:
+            return "VIEW_EOF";
+        case SEARCH_START:
+            return "SEARCH_START";
+        case SEARCH_QUIT:
+            return "SEARCH_QUIT";
+        case SEARCH_EXEC:
+            return "SEARCH_EXEC";
+        case SEARCH_NEXT:
+            return "SEARCH_NEXT";
+        case SEARCH_PREV:
+            return "SEARCH_PREV";
+        case RESIZE:
+            return "RESIZE";
+        case DISPLAY_COMMAND:
+            return "DISPLAY_COMMAND";
+        case DISPLAY_STATUS:
+            return "DISPLAY_STATUS";
+        case TOGGLE_CASELESS:
+            return "TOGGLE_CASELESS";
+        case TOGGLE_CONDITIONALLY_CASELESS:
+            return "TOGGLE_CONDITIONALLY_CASELESS";
+        case UPDATE_LINE_IDXS:
+            return "UPDATE_LINE_IDXS";
+        case SEARCH_CLEAR:
+            return "SEARCH_CLEAR";
+        case TOGGLE_HIGHLIGHTING:
+            return "TOGGLE_HIGHLIGHTING";
+        case INTERRUPT:
+            return "INTERRUPT";
+        case FOLLOW_EOF:
+            return "FOLLOW_EOF";
+        case TOGGLE_LONG_LINES:
+            return "TOGGLE_LONG_LINES";
+        case COUNT_MATCHES:
+            return "COUNT_MATCHES";
+        case TOGGLE_MINIMAP:
+            return "TOGGLE_MINIMAP";
+        case JUMP_TO_DENSEST:
+            return "JUMP_TO_DENSEST";
+        case RUN_COMMAND_LINE:
+            return "RUN_COMMAND_LINE";
+        case PIN_PATTERN:
+            return "PIN_PATTERN";
+        case CLEAR_PINS:
+            return "CLEAR_PINS";
+        case PIN_NEXT:
+            return "PIN_NEXT";
+        case PIN_PREV:
+            return "PIN_PREV";
+        case REPLAY_SYNC:
+            return "REPLAY_SYNC";
+        }
+        return "UNKNOWN";
+    }
 };
@@ -1,30 +1,77 @@
 #pragma once
 
+#include <atomic>
+#include <memory>
 #include <mutex>
-#include <shared_mutex>
+#include <stdint.h>
 #include <string_view>
 
 #include <fcntl.h>
 #include <sys/mman.h>
 
+// Owns an mmap'd region. It can be grown in place, and gets unmapped once
+// the last snapshot pointing into it goes away.
+struct Mapping {
+    void *m_ptr;
+    size_t m_size;
+
+    Mapping(void *ptr, size_t size) : m_ptr(ptr), m_size(size) {
+    }
+    Mapping(Mapping const &) = delete;
+    Mapping &operator=(Mapping const &) = delete;
+    ~Mapping() {
+        munmap(m_ptr, m_size);
+    }
+};
+
+// An immutable view of the contents at some point in time.
+struct ContentSnapshot {
+    std::shared_ptr<Mapping> mapping;
+    std::string_view contents;
+    uint64_t generation;
+    // the generation the contents were last replaced (rather than appended
+    // to) at. offsets computed against older generations are meaningless.
+    uint64_t base_generation;
+};
+
 struct ContentGuard {
-    std::shared_lock<std::shared_mutex> lock;
+    std::shared_ptr<const ContentSnapshot> snapshot;
     std::string_view contents;
+    uint64_t generation;
 };
 
 class ContentHandle {
   protected:
-    std::string_view m_contents;
-    mutable std::shared_mutex m_mutex;
+    // readers only ever do an atomic load of this, writers build a new
+    // snapshot and swap it in. the old mapping lives on until the last guard
+    // holding it is dropped.
+    std::atomic<std::shared_ptr<const ContentSnapshot>> m_snapshot;
+    // serialises the writers
+    mutable std::mutex m_mutex;
+
+    void publish(std::shared_ptr<Mapping> mapping, std::string_view contents,
+                 bool replaced) {
+        auto prev = m_snapshot.load(std::memory_order_relaxed);
+        uint64_t generation = prev->generation + 1;
+        uint64_t base_generation =
+            replaced ? generation : prev->base_generation;
+        m_snapshot.store(
+            std::make_shared<const ContentSnapshot>(ContentSnapshot{
+                std::move(mapping), contents, generation, base_generation}),
+            std::memory_order_release);
+    }
+
+    std::shared_ptr<const ContentSnapshot> current_snapshot() const {
+        return m_snapshot.load(std::memory_order_acquire);
+    }
 
   public:
-    ContentHandle() {
+    ContentHandle()
+        : m_snapshot(std::make_shared<const ContentSnapshot>(
+              ContentSnapshot{nullptr, {}, 0, 0})) {
     }
     // mark dtor as virtual
     virtual ~ContentHandle() {
-        if (!m_contents.data()) {
-            munmap((void *)m_contents.data(), m_contents.size());
-        }
     }
     ContentHandle(ContentHandle const &) = delete;
     ContentHandle(ContentHandle &&) = delete;
@@ -32,13 +79,20 @@ class ContentHandle {
     ContentHandle &operator=(ContentHandle &&) = delete;
 
     ContentGuard get_contents() const {
-        std::shared_lock lock(m_mutex);
-        return {std::move(lock), m_contents};
+        auto snapshot = current_snapshot();
+        std::string_view contents = snapshot->contents;
+        uint64_t generation = snapshot->generation;
+        return {std::move(snapshot), contents, generation};
     }
 
     size_t size() const {
-        std::shared_lock lock(m_mutex);
-        return m_contents.size();
+        return current_snapshot()->contents.size();
+    }
+
+    // true if offsets computed against generation no longer line up with
+    // the current contents
+    bool is_stale(uint64_t generation) const {
+        return generation < current_snapshot()->base_generation;
     }
 
     // implemented by the inheriting classes
@@ -46,4 +100,15 @@ class ContentHandle {
     virtual bool read_to_eof() = 0;
     virtual bool has_changed() const = 0;
     virtual std::string_view get_path() const = 0;
+
+    // an fd that polls readable when there might be more content, so follow
+    // mode can block instead of polling has_changed()
+    virtual int get_notify_fd() const = 0;
+    // drains whatever made the notify fd readable, returns false if none of
+    // it was relevant to the contents
+    virtual bool consume_notifications() = 0;
+    // a new fd for the file the current contents are mapped from, which
+    // has them at the same offsets, so ranges of them can be copied
+    // somewhere without reading them in. -1 with errno set if it can't.
+    virtual int dup_content_fd() const = 0;
 };
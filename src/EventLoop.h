@@ -0,0 +1,66 @@
+#pragma once
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <vector>
+
+// Thin wrapper around epoll. Every fd is registered with an id of the
+// caller's choosing, which is what comes back out of wait().
+struct EventLoop {
+    struct Event {
+        uint64_t id;
+        uint32_t events;
+    };
+
+    int m_epoll_fd;
+
+    EventLoop() : m_epoll_fd(epoll_create1(EPOLL_CLOEXEC)) {
+        if (m_epoll_fd == -1) {
+            fprintf(stderr, "EventLoop: could not create epoll fd. %s\n",
+                    strerror(errno));
+            exit(1);
+        }
+    }
+    EventLoop(EventLoop const &) = delete;
+    EventLoop &operator=(EventLoop const &) = delete;
+    EventLoop(EventLoop &&) = delete;
+    EventLoop &operator=(EventLoop &&) = delete;
+    ~EventLoop() {
+        close(m_epoll_fd);
+    }
+
+    void add(int fd, uint64_t id, uint32_t events = EPOLLIN) {
+        struct epoll_event event = {};
+        event.events = events;
+        event.data.u64 = id;
+        if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+            fprintf(stderr, "EventLoop: could not watch fd %d. %s\n", fd,
+                    strerror(errno));
+            exit(1);
+        }
+    }
+
+    void remove(int fd) {
+        epoll_ctl(m_epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    }
+
+    // Blocks until at least one fd is ready or timeout_ms passes (-1 waits
+    // forever). Overwrites out with whatever's ready.
+    void wait(std::vector<Event> &out, int timeout_ms = -1) {
+        struct epoll_event events[16];
+        int num_ready;
+        do {
+            num_ready = epoll_wait(m_epoll_fd, events, 16, timeout_ms);
+        } while (num_ready == -1 && errno == EINTR);
+
+        out.clear();
+        for (int i = 0; i < num_ready; ++i) {
+            out.push_back({events[i].data.u64, events[i].events});
+        }
+    }
+};
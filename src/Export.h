@@ -0,0 +1,279 @@
+#pragma once
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stddef.h>
+#include <stop_token>
+#include <string.h>
+#include <string>
+#include <string_view>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "Trace.h"
+
+// Copies byte ranges of the file the contents are mapped from (the file
+// itself, or a PipeHandle's temp file) to another fd, without them coming
+// through user space: copy_file_range() into a file, which can share the
+// blocks on filesystems that reflink, splice() into a pipe, and sendfile()
+// into anything else. Whatever the kernel won't do falls through to the
+// next of those, and in the end to write() from the mapping. Ranges that
+// touch get merged before they're copied, so a run of matching lines is
+// one call however many lines there are.
+//
+// A stop token only gets looked at between calls, and a call into a pipe
+// nobody's reading from never comes back. With a wake fd the output has
+// to be non-blocking instead: whenever it's full, the two get polled
+// together, and the wake fd turning readable stops it there and then.
+struct RangeWriter {
+    enum Method {
+        COPY_FILE_RANGE,
+        SPLICE,
+        SENDFILE,
+        WRITE,
+    };
+    // per call, so a stop gets noticed in between
+    constexpr static size_t max_call_size = 64 * 1024 * 1024;
+
+    int m_in_fd;
+    int m_out_fd;
+    // the same bytes as m_in_fd, for WRITE. can be left empty if there's
+    // no mapping of them to hand.
+    std::string_view m_contents;
+    std::stop_token m_stop;
+    // -1 for none
+    int m_wake_fd;
+    Method m_method;
+    size_t m_pending_begin = 0;
+    size_t m_pending_end = 0;
+    size_t m_bytes = 0;
+    size_t m_calls = 0;
+
+    RangeWriter(int in_fd, int out_fd, std::string_view contents,
+                std::stop_token stop, int wake_fd = -1)
+        : m_in_fd(in_fd), m_out_fd(out_fd), m_contents(contents),
+          m_stop(std::move(stop)), m_wake_fd(wake_fd), m_method(SENDFILE) {
+        struct stat statbuf;
+        if (fstat(out_fd, &statbuf) == 0) {
+            if (S_ISREG(statbuf.st_mode)) {
+                m_method = COPY_FILE_RANGE;
+            } else if (S_ISFIFO(statbuf.st_mode)) {
+                m_method = SPLICE;
+            }
+        }
+    }
+
+    // Copies [begin, end) after whatever came before, or holds on to it if
+    // more might carry on from it. false with errno set if it couldn't, or
+    // ECANCELED once stop is requested or the wake fd is readable.
+    bool add(size_t begin, size_t end) {
+        if (begin == m_pending_end && m_pending_end != m_pending_begin) {
+            m_pending_end = end;
+            return true;
+        }
+        if (!flush()) {
+            return false;
+        }
+        m_pending_begin = begin;
+        m_pending_end = end;
+        return true;
+    }
+
+    bool flush() {
+        size_t begin = m_pending_begin;
+        size_t end = m_pending_end;
+        m_pending_begin = m_pending_end = 0;
+        TRACE_SPAN("export", "copy", end - begin);
+        while (begin < end) {
+            if (m_stop.stop_requested()) {
+                errno = ECANCELED;
+                return false;
+            }
+            ssize_t copied = copy(begin, std::min(end - begin, max_call_size));
+            if (copied > 0) {
+                begin += (size_t)copied;
+                m_bytes += (size_t)copied;
+                ++m_calls;
+                continue;
+            }
+            if (copied == 0) {
+                // the file got shorter than the contents
+                errno = EIO;
+                return false;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN && m_wake_fd != -1) {
+                if (!wait_for_output()) {
+                    errno = ECANCELED;
+                    return false;
+                }
+                continue;
+            }
+            // write() needs the contents, there's no falling back to it
+            // without them
+            if (m_method == WRITE || !unsupported(errno) ||
+                (m_method == SENDFILE && m_contents.size() < end)) {
+                return false;
+            }
+            m_method = m_method == COPY_FILE_RANGE ? SENDFILE
+                       : m_method == SPLICE        ? SENDFILE
+                                                   : WRITE;
+        }
+        return true;
+    }
+
+    static const char *method_name(Method method) {
+        switch (method) {
+        case COPY_FILE_RANGE:
+            return "copy_file_range";
+        case SPLICE:
+            return "splice";
+        case SENDFILE:
+            return "sendfile";
+        case WRITE:
+            return "write";
+        }
+        return "?";
+    }
+
+  private:
+    // false if the wake fd turned readable first
+    bool wait_for_output() {
+        pollfd fds[2] = {{m_out_fd, POLLOUT, 0}, {m_wake_fd, POLLIN, 0}};
+        while (poll(fds, 2, -1) == -1 && errno == EINTR) {
+        }
+        return fds[1].revents == 0;
+    }
+
+    ssize_t copy(size_t begin, size_t length) {
+        switch (m_method) {
+        case COPY_FILE_RANGE: {
+            loff_t in_offset = (loff_t)begin;
+            return copy_file_range(m_in_fd, &in_offset, m_out_fd, nullptr,
+                                   length, 0);
+        }
+        case SPLICE: {
+            loff_t in_offset = (loff_t)begin;
+            return splice(m_in_fd, &in_offset, m_out_fd, nullptr, length,
+                          SPLICE_F_MORE |
+                              (m_wake_fd != -1 ? SPLICE_F_NONBLOCK : 0));
+        }
+        case SENDFILE: {
+            off_t in_offset = (off_t)begin;
+            return sendfile(m_out_fd, m_in_fd, &in_offset, length);
+        }
+        case WRITE:
+            return write(m_out_fd, m_contents.data() + begin, length);
+        }
+        return -1;
+    }
+
+    // the kernel can't do it that way for these fds, rather than it failing
+    static bool unsupported(int error) {
+        return error == EXDEV || error == EINVAL || error == ENOSYS ||
+               error == EOPNOTSUPP || error == EBADF;
+    }
+};
+
+// What :w or :| writes into: a file, or the stdin of a shell command whose
+// output goes nowhere, since the screen is ours. It can always redirect
+// it. m_fd is -1 and m_error says why if it couldn't be opened, and
+// non-blocking otherwise, for a RangeWriter with a wake fd.
+struct ExportSink {
+    int m_fd = -1;
+    pid_t m_child = -1;
+    std::string m_error;
+
+    static ExportSink open_file(std::string const &path) {
+        ExportSink sink;
+        sink.m_fd =
+            open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (sink.m_fd == -1) {
+            sink.m_error = "Could not open " + path + ": " + strerror(errno);
+            return sink;
+        }
+        // not to begin with, a fifo would fail to open without a reader
+        fcntl(sink.m_fd, F_SETFL, fcntl(sink.m_fd, F_GETFL) | O_NONBLOCK);
+        return sink;
+    }
+
+    static ExportSink spawn(std::string const &command) {
+        ExportSink sink;
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) == -1) {
+            sink.m_error = std::string("Could not make a pipe: ") +
+                           strerror(errno);
+            return sink;
+        }
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_adddup2(&actions, fds[0], STDIN_FILENO);
+        posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null",
+                                         O_WRONLY, 0);
+        posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO,
+                                         STDERR_FILENO);
+        // none of the signals we block or ignore are the command's business
+        posix_spawnattr_t attr;
+        posix_spawnattr_init(&attr);
+        sigset_t signals;
+        sigemptyset(&signals);
+        posix_spawnattr_setsigmask(&attr, &signals);
+        sigaddset(&signals, SIGPIPE);
+        posix_spawnattr_setsigdefault(&attr, &signals);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK |
+                                            POSIX_SPAWN_SETSIGDEF);
+        const char *argv[] = {"sh", "-c", command.c_str(), nullptr};
+        int error = posix_spawn(&sink.m_child, "/bin/sh", &actions, &attr,
+                                (char *const *)argv, environ);
+        posix_spawnattr_destroy(&attr);
+        posix_spawn_file_actions_destroy(&actions);
+        close(fds[0]);
+        if (error != 0) {
+            close(fds[1]);
+            sink.m_child = -1;
+            sink.m_error = "Could not run " + command + ": " + strerror(error);
+            return sink;
+        }
+        // only our end, the command's stays blocking. it gets a bigger
+        // pipe too, so there's less waking up to fill it.
+        fcntl(fds[1], F_SETFL, O_NONBLOCK);
+        fcntl(fds[1], F_SETPIPE_SZ, 1024 * 1024);
+        sink.m_fd = fds[1];
+        return sink;
+    }
+
+    // Closes it, and waits for the command if there is one, which gets
+    // killed if the export was stopped. Empty if the command went fine.
+    std::string finish(bool stopped) {
+        if (m_fd != -1) {
+            close(m_fd);
+            m_fd = -1;
+        }
+        if (m_child == -1) {
+            return "";
+        }
+        if (stopped) {
+            kill(m_child, SIGTERM);
+        }
+        int status = 0;
+        while (waitpid(m_child, &status, 0) == -1 && errno == EINTR) {
+        }
+        m_child = -1;
+        if (stopped || (WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
+            return "";
+        }
+        if (WIFEXITED(status)) {
+            return "exited with " + std::to_string(WEXITSTATUS(status));
+        }
+        return "killed by signal " + std::to_string(WTERMSIG(status));
+    }
+};
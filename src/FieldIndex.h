@@ -0,0 +1,204 @@
+#pragma once
+
+#include <algorithm>
+#include <memory>
+#include <optional>
+#include <stddef.h>
+#include <stdint.h>
+#include <stop_token>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "BlockIndex.h"
+#include "JsonFields.h"
+#include "Trace.h"
+#include "Worker.h"
+
+// Where each value of one field is, block by block, so that field queries
+// on its path (see FieldQuery) can be answered without looking at the
+// contents again: the first .status=500 after the view is a binary search.
+// Built the first time a path gets searched for, and extended as the
+// contents grow, same as a TokenFilter. A block where the field has more
+// than max_values different values (ids, times) isn't worth keeping, and
+// gets scanned as usual.
+struct FieldIndex final : BlockIndex {
+    constexpr static size_t max_values = 1024;
+
+    // unquoted value -> where the keys that have it are, in order
+    using Values = std::unordered_map<std::string, std::vector<uint64_t>>;
+
+    std::string m_path;
+    // null for a block with too many values. shared with the index this one
+    // was extended from.
+    std::vector<std::shared_ptr<const Values>> m_values;
+
+    // Builds values for whatever prev doesn't cover of contents, in parallel
+    // on pool. Call it from a background job. nullptr if stop was requested.
+    static std::shared_ptr<FieldIndex> extend(WorkerPool &pool,
+                                              FieldIndex const *prev,
+                                              FieldQuery const &query,
+                                              std::string_view contents,
+                                              std::stop_token stop) {
+        auto index = std::make_shared<FieldIndex>();
+        index->m_path = query.path;
+        if (prev && prev->m_path == query.path) {
+            // a short last block was cut off at the end of the contents,
+            // it gets redone along with whatever came after it
+            size_t keep = prev->num_blocks();
+            if (keep > 0 && prev->block_end((uint32_t)keep - 1) -
+                                    prev->block_begin((uint32_t)keep - 1) <
+                                block_size) {
+                --keep;
+            }
+            index->m_block_starts.assign(prev->m_block_starts.begin(),
+                                         prev->m_block_starts.begin() +
+                                             (ptrdiff_t)keep + 1);
+            index->m_values.assign(prev->m_values.begin(),
+                                   prev->m_values.begin() + (ptrdiff_t)keep);
+        }
+        size_t first_new = index->num_blocks();
+        TRACE_SPAN("index", "field_index", contents.size() -
+                                               index->indexed_size());
+        index->add_blocks(contents);
+        index->m_values.resize(index->num_blocks());
+        pool.parallel_for(
+            WorkerPool::Priority::BACKGROUND,
+            index->num_blocks() - first_new, [&](size_t i) {
+                WorkerPool::preemption_point();
+                if (stop.stop_requested()) {
+                    return;
+                }
+                uint32_t block = (uint32_t)(first_new + i);
+                index->m_values[block] =
+                    build_block(query, contents, index->block_begin(block),
+                                index->block_end(block));
+            });
+        if (stop.stop_requested()) {
+            return nullptr;
+        }
+        return index;
+    }
+
+    std::optional<size_t> find(TrigramQuery const &query, size_t begin,
+                               size_t end, bool caseless,
+                               bool backward) const override {
+        TrigramQuery const *field = field_in(query);
+        if (!field) {
+            return std::nullopt;
+        }
+        size_t block = (size_t)(std::upper_bound(m_block_starts.begin(),
+                                                 m_block_starts.end(),
+                                                 begin) -
+                                m_block_starts.begin()) -
+                       1;
+        if (block >= num_blocks() || end > block_end((uint32_t)block) ||
+            !m_values[block]) {
+            return std::nullopt;
+        }
+        size_t out = std::string::npos;
+        for_each_match(*m_values[block], field->value, caseless,
+                       [&](std::vector<uint64_t> const &offsets) {
+                           if (backward) {
+                               auto it = std::lower_bound(
+                                   offsets.begin(), offsets.end(), end);
+                               if (it != offsets.begin() &&
+                                   *(it - 1) >= begin &&
+                                   (out == std::string::npos ||
+                                    *(it - 1) > out)) {
+                                   out = *(it - 1);
+                               }
+                           } else {
+                               auto it = std::lower_bound(
+                                   offsets.begin(), offsets.end(), begin);
+                               if (it != offsets.end() && *it < end) {
+                                   out = std::min(out, (size_t)*it);
+                               }
+                           }
+                       });
+        return out;
+    }
+
+  protected:
+    // caseless, it doesn't know any better and it's only a superset
+    Blocks blocks_with(TrigramQuery const &query) const override {
+        if (query.kind != TrigramQuery::FIELD || query.token != m_path) {
+            return std::nullopt;
+        }
+        std::vector<uint32_t> out;
+        for (size_t block = 0; block < m_values.size(); ++block) {
+            bool any = !m_values[block];
+            if (!any) {
+                for_each_match(*m_values[block], query.value, true,
+                               [&](auto const &) { any = true; });
+            }
+            if (any) {
+                out.push_back((uint32_t)block);
+            }
+        }
+        return out;
+    }
+
+  private:
+    // the FIELD for this path in query, or in the AND that query is
+    TrigramQuery const *field_in(TrigramQuery const &query) const {
+        if (query.kind == TrigramQuery::FIELD) {
+            return query.token == m_path ? &query : nullptr;
+        }
+        if (query.kind == TrigramQuery::AND) {
+            for (TrigramQuery const &child : query.children) {
+                if (child.kind == TrigramQuery::FIELD) {
+                    return field_in(child);
+                }
+            }
+        }
+        return nullptr;
+    }
+
+    template <typename F>
+    static void for_each_match(Values const &values, std::string const &value,
+                               bool caseless, F &&f) {
+        if (!caseless) {
+            auto it = values.find(value);
+            if (it != values.end()) {
+                f(it->second);
+            }
+            return;
+        }
+        for (auto const &[v, offsets] : values) {
+            if (FieldQuery::equal(v, value, true)) {
+                f(offsets);
+            }
+        }
+    }
+
+    static std::shared_ptr<const Values> build_block(FieldQuery const &query,
+                                                     std::string_view contents,
+                                                     size_t begin,
+                                                     size_t end) {
+        auto values = std::make_shared<Values>();
+        std::string needle = query.needle();
+        std::string_view block = contents.substr(0, end);
+        for (size_t pos = block.find(needle, begin);
+             pos != std::string_view::npos;) {
+            std::string_view line = FieldQuery::line_around(block, pos);
+            size_t line_start = (size_t)(line.data() - contents.data());
+            query.scan(line, [&](size_t key_offset, std::string_view value) {
+                std::vector<uint64_t> &offsets =
+                    (*values)[std::string(FieldQuery::unquote(value))];
+                // every element of an array is at the same key
+                if (offsets.empty() ||
+                    offsets.back() != line_start + key_offset) {
+                    offsets.push_back(line_start + key_offset);
+                }
+                return values->size() > max_values;
+            });
+            if (values->size() > max_values) {
+                return nullptr;
+            }
+            pos = block.find(needle, line_start + line.size());
+        }
+        return values;
+    }
+};
@@ -15,24 +15,55 @@
 #include <stdio.h>
 #include <stop_token>
 #include <string.h>
+#include <sys/inotify.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
 #include <sys/unistd.h>
 
 #include "ContentHandle.h"
+#include "Trace.h"
 
 class FileHandle final : public ContentHandle {
     int m_fd;
     std::string m_path;
+    // identity of the file behind m_fd, to notice when m_path gets rotated
+    dev_t m_dev;
+    ino_t m_ino;
+
+    int m_inotify_fd;
+    int m_file_wd;
+    int m_dir_wd;
+    // without inotify, e.g. once fs.inotify.max_user_instances or
+    // max_user_watches runs out, this ticks instead and every tick counts
+    // as a notification if the file has changed. -1 while inotify works.
+    int m_poll_fd = -1;
+    constexpr static long poll_interval_ms = 100;
 
   public:
     FileHandle(std::string path)
-        : m_fd(open(path.c_str(), O_RDONLY)), m_path(std::move(path)) {
+        : m_fd(open(path.c_str(), O_RDONLY)), m_path(std::move(path)),
+          m_dev(0), m_ino(0),
+          m_inotify_fd(inotify_init1(IN_NONBLOCK | IN_CLOEXEC)),
+          m_file_wd(-1), m_dir_wd(-1) {
         if (m_fd == -1) {
             fprintf(stderr, "FileHandle: Error opening %s. %s\n",
                     m_path.c_str(), strerror(errno));
         }
+        record_identity();
+        if (m_inotify_fd != -1) {
+            // watch the directory too, so we hear about the path being
+            // recreated after a rotation
+            std::string dir =
+                std::filesystem::path(m_path).parent_path().string();
+            m_dir_wd = inotify_add_watch(m_inotify_fd,
+                                         dir.empty() ? "." : dir.c_str(),
+                                         IN_CREATE | IN_MOVED_TO);
+        }
+        if (m_dir_wd == -1 || !watch_file()) {
+            start_polling();
+        }
         // read contents now
         read_more();
     }
@@ -43,36 +74,64 @@ class FileHandle final : public ContentHandle {
     FileHandle &operator=(FileHandle &&other) = delete;
 
     ~FileHandle() final {
+        if (m_inotify_fd != -1) {
+            close(m_inotify_fd);
+        }
+        if (m_poll_fd != -1) {
+            close(m_poll_fd);
+        }
         close(m_fd);
     }
 
     bool read_more() final {
-        // if there is more to the file, we should read into m_contents
+        std::scoped_lock lock(m_mutex);
+        // like tail -F, if the path now names a different file, switch over
+        // to it and start from scratch
+        bool reopened = reopen_if_rotated();
+
+        // if there is more to the file, we should map it in
+        auto snapshot = current_snapshot();
+        size_t mapped_size = snapshot->contents.size();
         size_t curr_file_size = current_file_size();
-        {
-            std::shared_lock lock(m_mutex);
-            if (curr_file_size == m_contents.size()) {
-                return false;
-            }
+        if (!reopened && curr_file_size == mapped_size) {
+            return false;
         }
+        TRACE_SPAN("content", "remap", curr_file_size);
 
-        std::scoped_lock lock2(m_mutex);
-
-        // potentially needs an unmap.
-        if (m_contents.data()) {
-            munmap((void *)m_contents.data(), m_contents.size());
+        if (curr_file_size == 0) {
+            publish(nullptr, {}, true);
+            return true;
         }
 
-        // remap now
-        char *new_contents_ptr =
-            (char *)mmap(NULL, curr_file_size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+        if (!reopened && curr_file_size > mapped_size && snapshot->mapping) {
+            // the file only grew. extend the mapping in place if we can, so
+            // only the appended range gets faulted in and older snapshots
+            // stay valid.
+            Mapping &mapping = *snapshot->mapping;
+            if (mremap(mapping.m_ptr, mapping.m_size, curr_file_size, 0) !=
+                MAP_FAILED) {
+                mapping.m_size = curr_file_size;
+                publish(snapshot->mapping,
+                        {(char *)mapping.m_ptr, curr_file_size}, false);
+                return true;
+            }
+        }
 
-        m_contents = std::string_view{new_contents_ptr, curr_file_size};
+        // otherwise map it fresh. if the file got truncated or replaced the
+        // old mapping gets retired along with the last snapshot using it.
+        char *new_contents_ptr = (char *)mmap(NULL, curr_file_size, PROT_READ,
+                                              MAP_PRIVATE, m_fd, 0);
+        if ((void *)new_contents_ptr == MAP_FAILED) {
+            fprintf(stderr, "FileHandle: mmap error. %s\n", strerror(errno));
+            exit(1);
+        }
+        publish(std::make_shared<Mapping>(new_contents_ptr, curr_file_size),
+                {new_contents_ptr, curr_file_size},
+                reopened || curr_file_size < mapped_size);
         return true;
     }
 
     std::string_view get_path() const final {
-        std::shared_lock lock(m_mutex);
         return m_path;
     }
 
@@ -81,9 +140,48 @@ class FileHandle final : public ContentHandle {
     }
 
     bool has_changed() const final {
-        size_t curr_file_size = current_file_size();
-        std::shared_lock lock(m_mutex);
-        return m_contents.size() != curr_file_size;
+        if (is_rotated()) {
+            return true;
+        }
+        return size() != current_file_size();
+    }
+
+    int dup_content_fd() const final {
+        std::scoped_lock lock(m_mutex);
+        return fcntl(m_fd, F_DUPFD_CLOEXEC, 0);
+    }
+
+    int get_notify_fd() const final {
+        return m_poll_fd != -1 ? m_poll_fd : m_inotify_fd;
+    }
+
+    bool consume_notifications() final {
+        if (m_poll_fd != -1) {
+            uint64_t expirations;
+            read(m_poll_fd, &expirations, sizeof(expirations));
+            return has_changed();
+        }
+        alignas(struct inotify_event) char buf[4096];
+        std::string file_name = std::filesystem::path(m_path).filename();
+        bool relevant = false;
+        while (true) {
+            ssize_t len = read(m_inotify_fd, buf, sizeof(buf));
+            if (len <= 0) {
+                // EAGAIN, we've drained everything
+                break;
+            }
+            for (char *ptr = buf; ptr < buf + len;) {
+                auto *event = (struct inotify_event *)ptr;
+                if (event->wd != m_dir_wd) {
+                    relevant = true;
+                } else if (event->len > 0 && file_name == event->name) {
+                    // something (re)appeared at our path
+                    relevant = true;
+                }
+                ptr += sizeof(struct inotify_event) + event->len;
+            }
+        }
+        return relevant;
     }
 
   private:
@@ -97,4 +195,83 @@ class FileHandle final : public ContentHandle {
 
         return (size_t)statbuf.st_size;
     }
+
+    void record_identity() {
+        struct stat statbuf;
+        if (fstat(m_fd, &statbuf) == 0) {
+            m_dev = statbuf.st_dev;
+            m_ino = statbuf.st_ino;
+        }
+    }
+
+    // false if it couldn't
+    bool watch_file() {
+        if (m_inotify_fd == -1) {
+            return false;
+        }
+        if (m_file_wd != -1) {
+            inotify_rm_watch(m_inotify_fd, m_file_wd);
+        }
+        // IN_ATTRIB catches unlinks, IN_DELETE_SELF won't fire while we hold
+        // the fd open
+        m_file_wd = inotify_add_watch(m_inotify_fd, m_path.c_str(),
+                                      IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF |
+                                          IN_DELETE_SELF);
+        return m_file_wd != -1;
+    }
+
+    // Main has the notify fd in its loop by now, so after a rotation this
+    // can't switch to m_poll_fd. the directory's watch picks up writes to
+    // the file by name instead.
+    void watch_file_through_dir() {
+        std::string dir =
+            std::filesystem::path(m_path).parent_path().string();
+        inotify_add_watch(m_inotify_fd, dir.empty() ? "." : dir.c_str(),
+                          IN_MODIFY | IN_ATTRIB | IN_MASK_ADD);
+    }
+
+    void start_polling() {
+        if (m_inotify_fd != -1) {
+            close(m_inotify_fd);
+            m_inotify_fd = -1;
+            m_file_wd = m_dir_wd = -1;
+        }
+        m_poll_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (m_poll_fd == -1) {
+            fprintf(stderr, "FileHandle: could not create timerfd. %s\n",
+                    strerror(errno));
+            exit(1);
+        }
+        struct itimerspec spec = {};
+        spec.it_interval.tv_nsec = poll_interval_ms * 1'000'000;
+        spec.it_value = spec.it_interval;
+        timerfd_settime(m_poll_fd, 0, &spec, NULL);
+    }
+
+    bool is_rotated() const {
+        struct stat statbuf;
+        if (stat(m_path.c_str(), &statbuf) == -1) {
+            // the path is gone for now, keep showing what we have
+            return false;
+        }
+        return statbuf.st_dev != m_dev || statbuf.st_ino != m_ino;
+    }
+
+    bool reopen_if_rotated() {
+        if (!is_rotated()) {
+            return false;
+        }
+        int new_fd = open(m_path.c_str(), O_RDONLY);
+        if (new_fd == -1) {
+            // lost a race with another rotation, try again next time
+            return false;
+        }
+        close(m_fd);
+        m_fd = new_fd;
+        record_identity();
+        if (m_poll_fd == -1 && !watch_file()) {
+            watch_file_through_dir();
+        }
+        return true;
+    }
 };
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <stdint.h>
+
+// Log-linear histogram in the style of HdrHistogram. Values get bucketed by
+// their power of two, and every power of two is split into sub_buckets
+// linear steps, so the relative error stays under 1/sub_buckets whether the
+// value is 50ns or 5s. Recording is a couple of shifts and an increment.
+struct Histogram {
+    constexpr static unsigned sub_bucket_bits = 5;
+    constexpr static uint64_t sub_buckets = 1 << sub_bucket_bits;
+    // anything past 2^max_bits gets clamped into the last bucket, for
+    // nanoseconds that's a couple of days
+    constexpr static unsigned max_bits = 48;
+    constexpr static size_t num_counts =
+        (max_bits - sub_bucket_bits + 1) * sub_buckets;
+
+    std::array<uint64_t, num_counts> m_counts{};
+    uint64_t m_total = 0;
+    uint64_t m_max = 0;
+
+    void record(uint64_t value) {
+        ++m_counts[std::min(index_of(value), num_counts - 1)];
+        ++m_total;
+        m_max = std::max(m_max, value);
+    }
+
+    uint64_t count() const {
+        return m_total;
+    }
+
+    uint64_t max() const {
+        return m_max;
+    }
+
+    // the smallest value that at least q of the recorded values are at or
+    // below, rounded up to the top of its bucket
+    uint64_t percentile(double q) const {
+        if (m_total == 0) {
+            return 0;
+        }
+        uint64_t rank =
+            std::max((uint64_t)1, (uint64_t)(q * (double)m_total + 0.5));
+        uint64_t seen = 0;
+        for (size_t idx = 0; idx < num_counts; ++idx) {
+            seen += m_counts[idx];
+            if (seen >= rank) {
+                return std::min(highest_value_at(idx), m_max);
+            }
+        }
+        return m_max;
+    }
+
+  private:
+    static size_t index_of(uint64_t value) {
+        if (value < sub_buckets) {
+            return value;
+        }
+        unsigned msb = 63 - __builtin_clzll(value);
+        unsigned shift = msb - sub_bucket_bits;
+        // value >> shift is somewhere in [sub_buckets, 2 * sub_buckets)
+        return (shift + 1) * sub_buckets +
+               ((value >> shift) - sub_buckets);
+    }
+
+    static uint64_t highest_value_at(size_t idx) {
+        size_t bucket = idx / sub_buckets;
+        uint64_t sub = idx % sub_buckets;
+        if (bucket == 0) {
+            return sub;
+        }
+        unsigned shift = (unsigned)(bucket - 1);
+        return ((sub_buckets + sub + 1) << shift) - 1;
+    }
+};
@@ -12,28 +12,17 @@
 #include "Command.h"
 #include "Input.h"
 
+// readline callbacks are plain function pointers, so they need a global to
+// send commands through
 Channel<Command> *command_channel;
 
-void handle_sigwinch(int) {
-    command_channel->push_signal(Command{Command::RESIZE});
-}
-
-void handle_sigint(int) {
-    command_channel->push_signal(Command{Command::INTERRUPT});
-}
-
-void register_signal_handlers(Channel<Command> *to_register) {
-    command_channel = to_register;
-    signal(SIGWINCH, handle_sigwinch);
-    signal(SIGINT, handle_sigint);
-}
-
 InputThread::InputThread(std::mutex *nc_mutex, Channel<Command> *chan,
                          FILE *tty, std::string _history_filename,
-                         int history_maxsize)
+                         int history_maxsize, bool replaying)
     : nc_mutex(nc_mutex), chan(chan),
       history_filename(std::move(_history_filename)),
-      history_maxsize(history_maxsize), fd_ready(0) {
+      history_maxsize(history_maxsize), replaying(replaying), fd_ready(0) {
+    command_channel = chan;
     if (read_history(history_filename.c_str())) {
         struct stat stats;
         int res = stat(history_filename.c_str(), &stats);
@@ -71,8 +60,15 @@ InputThread::InputThread(std::mutex *nc_mutex, Channel<Command> *chan,
 }
 
 std::optional<std::string> readline_result;
+// what's in front of the line being read, and what each redisplay of it
+// gets sent to the main thread as
+char prompt_char;
+Command::Type prompt_display_type;
 
-void InputThread::multi_char_search(size_t num_payload) {
+std::string InputThread::read_prompt(char prompt,
+                                     Command::Type display_type) {
+    prompt_char = prompt;
+    prompt_display_type = display_type;
     static int blockingpipefds[2];
     pipe(blockingpipefds);
     static FILE *blockingpipe = fdopen(blockingpipefds[0], "r");
@@ -83,14 +79,16 @@ void InputThread::multi_char_search(size_t num_payload) {
         rl_tty_set_echoing(0);
         rl_instream = blockingpipe;
         rl_redisplay_function = []() {
-            command_channel->push(Command{Command::SEARCH_START,
-                                          std::string("/") + rl_line_buffer,
-                                          {},
-                                          (size_t)(rl_point + 1)});
+            command_channel->push(
+                Command{prompt_display_type,
+                        prompt_char + std::string(rl_line_buffer),
+                        {},
+                        (size_t)(rl_point + 1)});
         };
         rl_persistent_signal_handlers = 1;
         rl_bind_key('\t', rl_insert);
-        rl_callback_handler_install("/", [](char *input) {
+        const char prompt_str[] = {prompt, '\0'};
+        rl_callback_handler_install(prompt_str, [](char *input) {
             if (input) {
                 readline_result = input;
             } else {
@@ -141,15 +139,27 @@ void InputThread::multi_char_search(size_t num_payload) {
         }
     }
 
-    if (readline_result->empty()) {
+    return std::move(*readline_result);
+}
+
+void InputThread::multi_char_search(size_t num_payload) {
+    std::string result = read_prompt('/', Command::SEARCH_START);
+    if (result.empty()) {
         command_channel->push(Command{Command::SEARCH_QUIT});
     } else {
-        add_history(readline_result->c_str());
+        add_history(result.c_str());
         append_history(1, history_filename.c_str());
         history_truncate_file(history_filename.c_str(), history_maxsize);
         command_channel->push(Command{Command::SEARCH_EXEC,
-                                      std::move(*readline_result),
+                                      std::move(result),
                                       {},
                                       num_payload});
     }
 }
+
+void InputThread::command_line() {
+    // empty if it was abandoned, which just clears the prompt
+    std::string result = read_prompt(':', Command::DISPLAY_COMMAND);
+    command_channel->push(
+        Command{Command::RUN_COMMAND_LINE, std::move(result)});
+}
@@ -22,6 +22,7 @@
 
 #include "Channel.h"
 #include "Command.h"
+#include "Trace.h"
 
 struct InputThread {
     std::mutex *nc_mutex;
@@ -34,11 +35,14 @@ struct InputThread {
     uint16_t cursor_pos = 0;
     std::string history_filename;
     int history_maxsize;
+    // reading a replay script rather than a person
+    bool replaying;
 
     std::binary_semaphore fd_ready;
 
     InputThread(std::mutex *nc_mutex, Channel<Command> *chan, FILE *tty,
-                std::string history_filename, int history_maxsize);
+                std::string history_filename, int history_maxsize,
+                bool replaying = false);
 
     InputThread(const InputThread &) = delete;
     InputThread &operator=(const InputThread &) = delete;
@@ -70,9 +74,16 @@ struct InputThread {
         return getch();
     }
 
+    // Reads a line at a prompt of the one character with readline, sending
+    // what's typed so far to the main thread as display_type each time it
+    // changes. Empty if it was abandoned.
+    std::string read_prompt(char prompt, Command::Type display_type);
     void multi_char_search(size_t num_payload);
+    // the : prompt, for commands with arguments
+    void command_line();
 
     void start() {
+        tracing::set_thread_name("input");
         std::string num_payload_buf;
 
         while (true) {
@@ -141,6 +152,13 @@ struct InputThread {
             case '\x03':
                 chan->push({Command::INTERRUPT});
                 break;
+            case '\x1c':
+                if (replaying) {
+                    chan->push({Command::REPLAY_SYNC});
+                } else {
+                    chan->push({Command::INVALID, keyname(ch)});
+                }
+                break;
             case 'f':
             case CTRL('f'):
             case CTRL('v'):
@@ -203,6 +221,10 @@ struct InputThread {
                 multi_char_search(num_payload);
                 break;
             }
+            case ':':
+                chan->push({Command::DISPLAY_COMMAND, ":", {}, 1});
+                command_line();
+                break;
             case 'n': // this needs to work with search history eventually;
                 chan->push({Command::DISPLAY_COMMAND, ":", {}, 1});
                 chan->push(
@@ -225,6 +247,35 @@ struct InputThread {
                     chan->push({Command::DISPLAY_COMMAND, ":", {}, 1});
                     chan->push({Command::TOGGLE_HIGHLIGHTING, "ESC-u"});
                     break;
+                case 'c':
+                    chan->push({Command::DISPLAY_COMMAND, ":", {}, 1});
+                    chan->push({Command::COUNT_MATCHES, "ESC-c"});
+                    break;
+                case 'm':
+                    chan->push({Command::DISPLAY_COMMAND, ":", {}, 1});
+                    chan->push({Command::TOGGLE_MINIMAP, "ESC-m"});
+                    break;
+                case 'j':
+                    chan->push({Command::DISPLAY_COMMAND, ":", {}, 1});
+                    chan->push({Command::JUMP_TO_DENSEST, "ESC-j"});
+                    break;
+                case 'p':
+                    chan->push({Command::DISPLAY_COMMAND, ":", {}, 1});
+                    chan->push({Command::PIN_PATTERN, "ESC-p"});
+                    break;
+                case 'P':
+                    chan->push({Command::DISPLAY_COMMAND, ":", {}, 1});
+                    chan->push({Command::CLEAR_PINS, "ESC-P"});
+                    break;
+                // a count picks one of the pins, otherwise it's any of them
+                case 'n':
+                    chan->push({Command::DISPLAY_COMMAND, ":", {}, 1});
+                    chan->push({Command::PIN_NEXT, "ESC-n", {}, num_payload});
+                    break;
+                case 'N':
+                    chan->push({Command::DISPLAY_COMMAND, ":", {}, 1});
+                    chan->push({Command::PIN_PREV, "ESC-N", {}, num_payload});
+                    break;
                 default:
                     using namespace std::string_literals;
                     chan->push({Command::DISPLAY_STATUS,
@@ -265,5 +316,3 @@ struct InputThread {
         }
     }
 };
-
-void register_signal_handlers(Channel<Command> *to_register);
@@ -0,0 +1,374 @@
+#pragma once
+
+#include <atomic>
+#include <bit>
+#include <cctype>
+#include <optional>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Where the strings and the structural characters ({}[]:, outside of
+// strings) are in a line of JSON, 64 bytes at a time, the way simdjson's
+// first stage finds them: compare every byte against the interesting ones,
+// work out which quotes are escaped from the runs of backslashes, and turn
+// the quotes into a mask of what's inside a string with a prefix xor. Never
+// builds anything, what to make of the masks is up to the caller.
+struct JsonStructure {
+    // the quotes that open or close a string, and the structural
+    // characters that aren't in one
+    struct Masks {
+        uint64_t quotes;
+        uint64_t structurals;
+    };
+
+    // carried over from the last 64 bytes: all ones if they ended inside a
+    // string, and whether they ended with an unescaped backslash
+    uint64_t m_in_string = 0;
+    bool m_escaped = false;
+
+    // the next min(n, 64) bytes from p
+    Masks next(const char *p, size_t n) {
+        uint64_t quote, backslash, structural;
+        if (n >= 64) {
+            classify(p, quote, backslash, structural);
+        } else {
+            // spaces aren't anything
+            char padded[64];
+            memset(padded, ' ', sizeof(padded));
+            memcpy(padded, p, n);
+            classify(padded, quote, backslash, structural);
+        }
+        // a backslash escapes the next byte, unless it's escaped itself
+        uint64_t escaped = m_escaped ? 1 : 0;
+        uint64_t starts = backslash & ~escaped;
+        m_escaped = false;
+        while (starts) {
+            int i = std::countr_zero(starts);
+            if (i == 63) {
+                m_escaped = true;
+                break;
+            }
+            uint64_t next = (uint64_t)1 << (i + 1);
+            escaped |= next;
+            starts &= ~((uint64_t)1 << i | next);
+        }
+        quote &= ~escaped;
+        // on from an opening quote up to its closing one
+        uint64_t in_string = quote;
+        in_string ^= in_string << 1;
+        in_string ^= in_string << 2;
+        in_string ^= in_string << 4;
+        in_string ^= in_string << 8;
+        in_string ^= in_string << 16;
+        in_string ^= in_string << 32;
+        in_string ^= m_in_string;
+        m_in_string = (uint64_t)((int64_t)in_string >> 63);
+        return {quote, structural & ~in_string};
+    }
+
+  private:
+    static void classify(const char *p, uint64_t &quote, uint64_t &backslash,
+                         uint64_t &structural) {
+        quote = backslash = structural = 0;
+#ifdef __SSE2__
+        for (size_t i = 0; i < 64; i += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+            // | 0x20 turns [ and ] into { and }
+            __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+            __m128i brackets =
+                _mm_or_si128(_mm_cmpeq_epi8(lower, _mm_set1_epi8('{')),
+                             _mm_cmpeq_epi8(lower, _mm_set1_epi8('}')));
+            __m128i separators =
+                _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(':')),
+                             _mm_cmpeq_epi8(v, _mm_set1_epi8(',')));
+            quote |= (uint64_t)(uint16_t)_mm_movemask_epi8(
+                         _mm_cmpeq_epi8(v, _mm_set1_epi8('"')))
+                     << i;
+            backslash |= (uint64_t)(uint16_t)_mm_movemask_epi8(
+                             _mm_cmpeq_epi8(v, _mm_set1_epi8('\\')))
+                         << i;
+            structural |= (uint64_t)(uint16_t)_mm_movemask_epi8(
+                              _mm_or_si128(brackets, separators))
+                          << i;
+        }
+#else
+        for (size_t i = 0; i < 64; ++i) {
+            char c = p[i];
+            quote |= (uint64_t)(c == '"') << i;
+            backslash |= (uint64_t)(c == '\\') << i;
+            structural |= (uint64_t)(c == '{' || c == '}' || c == '[' ||
+                                     c == ']' || c == ':' || c == ',')
+                          << i;
+        }
+#endif
+    }
+};
+
+// A search for lines that are JSON objects with a given value at a given
+// path, from a pattern like .status=500 or .request.method=GET. The value
+// matches a string with exactly that in it ("500") or anything else written
+// exactly like that (500). Arrays are see-through, so .tags=prod matches
+// "tags":["prod","eu"] and .items.id=7 matches "items":[{"id":7}]. Keys are
+// compared as they're written, escapes and all, and always case sensitively,
+// a caseless search only ignores the case of the value.
+//
+// .id=5 is a regex too, so searches only take patterns for field queries
+// once they're turned on, which --field-index does.
+struct FieldQuery {
+    // see set_field_queries() in search.h
+    static inline std::atomic<bool> g_enabled{false};
+
+    // as it was typed, e.g. "request.method"
+    std::string path;
+    std::vector<std::string> keys;
+    std::string value;
+
+    // nullopt unless pattern is a . then a path of keys made of letters,
+    // digits, _ and - with dots between them, then = and the value
+    static std::optional<FieldQuery> parse(std::string_view pattern) {
+        if (pattern.size() < 2 || pattern[0] != '.') {
+            return std::nullopt;
+        }
+        size_t equals = pattern.find('=');
+        if (equals == std::string_view::npos) {
+            return std::nullopt;
+        }
+        FieldQuery query;
+        query.path = pattern.substr(1, equals - 1);
+        // .id="x" is the same as .id=x
+        query.value = unquote(pattern.substr(equals + 1));
+        size_t key_begin = 0;
+        for (size_t i = 0; i <= query.path.size(); ++i) {
+            if (i < query.path.size() && query.path[i] != '.') {
+                unsigned char c = (unsigned char)query.path[i];
+                if (!isalnum(c) && c != '_' && c != '-') {
+                    return std::nullopt;
+                }
+                continue;
+            }
+            if (i == key_begin) {
+                return std::nullopt;
+            }
+            query.keys.push_back(query.path.substr(key_begin, i - key_begin));
+            key_begin = i + 1;
+        }
+        return query;
+    }
+
+    // parse() if field queries are on, otherwise nullopt, so pattern is a
+    // regex
+    static std::optional<FieldQuery> from_pattern(std::string_view pattern) {
+        if (!g_enabled.load(std::memory_order_relaxed)) {
+            return std::nullopt;
+        }
+        return parse(pattern);
+    }
+
+    // the last key in quotes, which every line that matches has where the
+    // match is
+    std::string needle() const {
+        return '"' + keys.back() + '"';
+    }
+
+    // the line around offset, without its newline
+    static std::string_view line_around(std::string_view contents,
+                                        size_t offset) {
+        const char *newline =
+            (const char *)memrchr(contents.data(), '\n', offset);
+        size_t line_start =
+            newline ? (size_t)(newline - contents.data()) + 1 : 0;
+        size_t line_end = contents.find('\n', offset);
+        if (line_end == std::string_view::npos) {
+            line_end = contents.size();
+        }
+        return contents.substr(line_start, line_end - line_start);
+    }
+
+    // a value as it's written in the JSON, quotes and all, without them
+    static std::string_view unquote(std::string_view json_value) {
+        if (json_value.size() >= 2 && json_value.front() == '"') {
+            return json_value.substr(1, json_value.size() - 2);
+        }
+        return json_value;
+    }
+
+    static bool equal(std::string_view a, std::string_view b,
+                      bool caseless) {
+        if (a.size() != b.size()) {
+            return false;
+        }
+        if (!caseless) {
+            return a == b;
+        }
+        for (size_t i = 0; i < a.size(); ++i) {
+            if (tolower((unsigned char)a[i]) != tolower((unsigned char)b[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool value_matches(std::string_view json_value, bool caseless) const {
+        return equal(unquote(json_value), value, caseless);
+    }
+
+    // Calls f(key_offset, json_value) for every string, number, true, false
+    // or null at path in the object that starts at the first { in line,
+    // key_offset being where the quote before its key is. Stops as soon as
+    // f returns true, or at anything that isn't JSON. true if f did.
+    template <typename F> bool scan(std::string_view line, F &&f) const {
+        size_t start = line.find('{');
+        if (start == std::string_view::npos) {
+            return false;
+        }
+        // how many of keys the path to each open object or array matches,
+        // none once it's gone somewhere else
+        constexpr size_t none = SIZE_MAX;
+        struct Level {
+            bool object;
+            size_t matched;
+            size_t key_offset;
+        };
+        constexpr size_t max_depth = 64;
+        Level stack[max_depth];
+        size_t depth = 0;
+        // what the next structural character or string has to be
+        enum { OBJECT, KEY, COLON, VALUE, AFTER_VALUE } expect = OBJECT;
+        size_t string_begin = 0;
+        bool in_string = false;
+        // the key and the value after it, for the member being read
+        std::string_view key;
+        size_t key_offset = 0;
+        size_t value_begin = 0;
+        size_t value_matched = 0;
+
+        JsonStructure structure;
+        for (size_t block = start; block < line.size(); block += 64) {
+            JsonStructure::Masks masks =
+                structure.next(line.data() + block, line.size() - block);
+            uint64_t events = masks.quotes | masks.structurals;
+            while (events) {
+                size_t pos = block + (size_t)std::countr_zero(events);
+                events &= events - 1;
+                char c = line[pos];
+                if (c == '"') {
+                    in_string = !in_string;
+                    if (in_string) {
+                        if (expect != KEY && expect != VALUE) {
+                            return false;
+                        }
+                        string_begin = pos;
+                        continue;
+                    }
+                    if (expect == KEY) {
+                        key = line.substr(string_begin + 1,
+                                          pos - string_begin - 1);
+                        key_offset = string_begin;
+                        expect = COLON;
+                    } else {
+                        if (value_matched == keys.size() &&
+                            f(key_offset,
+                              line.substr(string_begin,
+                                          pos + 1 - string_begin))) {
+                            return true;
+                        }
+                        expect = AFTER_VALUE;
+                    }
+                    continue;
+                }
+                switch (c) {
+                case ':': {
+                    if (expect != COLON) {
+                        return false;
+                    }
+                    size_t matched = stack[depth - 1].matched;
+                    value_matched = matched != none && matched < keys.size() &&
+                                            key == keys[matched]
+                                        ? matched + 1
+                                        : none;
+                    value_begin = pos + 1;
+                    expect = VALUE;
+                    break;
+                }
+                case '{':
+                case '[':
+                    if (expect == OBJECT && c == '{') {
+                        value_matched = 0;
+                    } else if (expect != VALUE) {
+                        return false;
+                    }
+                    if (depth == max_depth) {
+                        return false;
+                    }
+                    stack[depth++] = {c == '{', value_matched, key_offset};
+                    if (c == '{') {
+                        expect = KEY;
+                    } else {
+                        value_begin = pos + 1;
+                        expect = VALUE;
+                    }
+                    break;
+                default: {
+                    // , ] or }, which end a number, true, false or null
+                    if (expect == VALUE) {
+                        std::string_view value =
+                            trim(line.substr(value_begin, pos - value_begin));
+                        if (value.empty() && c == ',') {
+                            return false;
+                        }
+                        if (!value.empty() && value_matched == keys.size() &&
+                            f(key_offset, value)) {
+                            return true;
+                        }
+                    } else if (expect != AFTER_VALUE &&
+                               !(expect == KEY && c == '}')) {
+                        return false;
+                    }
+                    if ((c == '}') != stack[depth - 1].object &&
+                        c != ',') {
+                        return false;
+                    }
+                    if (c == ',') {
+                        Level const &level = stack[depth - 1];
+                        if (level.object) {
+                            expect = KEY;
+                        } else {
+                            value_begin = pos + 1;
+                            value_matched = level.matched;
+                            key_offset = level.key_offset;
+                            expect = VALUE;
+                        }
+                        break;
+                    }
+                    --depth;
+                    if (depth == 0) {
+                        return false;
+                    }
+                    expect = AFTER_VALUE;
+                    break;
+                }
+                }
+            }
+        }
+        return false;
+    }
+
+  private:
+    static std::string_view trim(std::string_view s) {
+        while (!s.empty() && isspace((unsigned char)s.front())) {
+            s.remove_prefix(1);
+        }
+        while (!s.empty() && isspace((unsigned char)s.back())) {
+            s.remove_suffix(1);
+        }
+        return s;
+    }
+};
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <chrono>
+#include <map>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <utility>
+
+#include "Command.h"
+#include "Histogram.h"
+
+// Latency histograms per command type, split up by where the time went. Only
+// ever touched from the main thread.
+struct LatencyStats {
+    enum class Stage {
+        // keypress read until the main loop picks the command up
+        QUEUE,
+        // the main loop handling it, up until it returns or first suspends
+        HANDLE,
+        // searches, from submitting the job until the result comes back
+        SEARCH,
+        // building and refreshing the page it ended up on
+        RENDER,
+        // keypress read until that page reached the terminal
+        TOTAL,
+    };
+
+    std::map<std::pair<Command::Type, Stage>, Histogram> m_histograms;
+
+    void record(Command::Type type, Stage stage,
+                std::chrono::steady_clock::duration duration) {
+        m_histograms[{type, stage}].record(
+            (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                duration)
+                .count());
+    }
+
+    // Overwrites path with p50/p99/p999 for everything recorded so far.
+    // Returns false if it couldn't be written.
+    bool write_json(std::string const &path) const {
+        FILE *f = fopen(path.c_str(), "w");
+        if (!f) {
+            return false;
+        }
+        const char *term = getenv("TERM");
+        fprintf(f, "{\n  \"term\": \"%s\",\n  \"commands\": {",
+                term ? term : "");
+        bool first_type = true;
+        for (auto it = m_histograms.begin(); it != m_histograms.end();) {
+            Command::Type type = it->first.first;
+            fprintf(f, "%s\n    \"%s\": {", first_type ? "" : ",",
+                    Command::type_name(type));
+            first_type = false;
+            bool first_stage = true;
+            for (; it != m_histograms.end() && it->first.first == type; ++it) {
+                Histogram const &histogram = it->second;
+                fprintf(f,
+                        "%s\n      \"%s\": {\"count\": %lu, \"p50_ns\": %lu, "
+                        "\"p99_ns\": %lu, \"p999_ns\": %lu, \"max_ns\": %lu}",
+                        first_stage ? "" : ",", stage_name(it->first.second),
+                        histogram.count(), histogram.percentile(0.5),
+                        histogram.percentile(0.99), histogram.percentile(0.999),
+                        histogram.max());
+                first_stage = false;
+            }
+            fprintf(f, "\n    }");
+        }
+        fprintf(f, "\n  }\n}\n");
+        return fclose(f) == 0;
+    }
+
+    static const char *stage_name(Stage stage) {
+        switch (stage) {
+        case Stage::QUEUE:
+            return "queue";
+        case Stage::HANDLE:
+            return "handle";
+        case Stage::SEARCH:
+            return "search";
+        case Stage::RENDER:
+            return "render";
+        case Stage::TOTAL:
+            return "total";
+        }
+        return "unknown";
+    }
+};
@@ -0,0 +1,777 @@
+#pragma once
+
+#include <algorithm>
+#include <bitset>
+#include <memory>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// A regex engine that looks at each byte once, for the patterns that don't
+// need PCRE2's backtracking. Patterns get parsed into a tree, compiled into
+// a Thompson NFA, and the NFA gets determinised a state at a time as the
+// scan comes across new ones. The states are kept in priority order like
+// RE2 does, which is what makes the matches come out the same as PCRE2's.
+
+using ByteSet = std::bitset<256>;
+
+struct RegexNode {
+    enum Kind {
+        BYTES,
+        CONCAT,
+        ALTERNATE,
+        REPEAT,
+    };
+    constexpr static size_t unbounded = SIZE_MAX;
+
+    Kind kind;
+    ByteSet bytes;
+    std::vector<std::unique_ptr<RegexNode>> children;
+    size_t min = 0;
+    size_t max = 0;
+    bool greedy = true;
+
+    explicit RegexNode(Kind kind_) : kind(kind_) {
+    }
+};
+
+// Parses the part of PCRE2's syntax that means the same thing to a DFA:
+// literals, escapes, classes, ., groups, alternation and greedy or lazy
+// quantifiers. Returns nullptr for anything else (anchors, backreferences,
+// lookaround, possessive quantifiers, options) so the caller can hand the
+// pattern to PCRE2 instead.
+struct RegexParser {
+    // deeper than this, or bigger repeats than this, go to PCRE2
+    constexpr static size_t max_depth = 64;
+    constexpr static size_t max_repeat = 1000;
+
+    std::string_view m_pattern;
+    bool m_caseless;
+    size_t m_pos;
+
+    RegexParser(std::string_view pattern, bool caseless)
+        : m_pattern(pattern), m_caseless(caseless), m_pos(0) {
+    }
+
+    std::unique_ptr<RegexNode> parse() {
+        std::unique_ptr<RegexNode> root = parse_alternation(0);
+        if (m_pos != m_pattern.size()) {
+            return nullptr;
+        }
+        return root;
+    }
+
+  private:
+    bool at(char c) const {
+        return m_pos < m_pattern.size() && m_pattern[m_pos] == c;
+    }
+
+    std::unique_ptr<RegexNode> bytes_node(ByteSet bytes) const {
+        if (m_caseless) {
+            for (int c = 'a'; c <= 'z'; ++c) {
+                int upper = c - 'a' + 'A';
+                if (bytes[c] || bytes[upper]) {
+                    bytes[c] = bytes[upper] = true;
+                }
+            }
+        }
+        auto node = std::make_unique<RegexNode>(RegexNode::BYTES);
+        node->bytes = bytes;
+        return node;
+    }
+
+    std::unique_ptr<RegexNode> parse_alternation(size_t depth) {
+        if (depth > max_depth) {
+            return nullptr;
+        }
+        std::unique_ptr<RegexNode> first = parse_concat(depth);
+        if (!first || !at('|')) {
+            return first;
+        }
+        auto alternation = std::make_unique<RegexNode>(RegexNode::ALTERNATE);
+        alternation->children.push_back(std::move(first));
+        while (at('|')) {
+            ++m_pos;
+            std::unique_ptr<RegexNode> next = parse_concat(depth);
+            if (!next) {
+                return nullptr;
+            }
+            alternation->children.push_back(std::move(next));
+        }
+        return alternation;
+    }
+
+    std::unique_ptr<RegexNode> parse_concat(size_t depth) {
+        auto concat = std::make_unique<RegexNode>(RegexNode::CONCAT);
+        while (m_pos < m_pattern.size() && !at('|') && !at(')')) {
+            std::unique_ptr<RegexNode> repeat = parse_repeat(depth);
+            if (!repeat) {
+                return nullptr;
+            }
+            concat->children.push_back(std::move(repeat));
+        }
+        return concat;
+    }
+
+    // {n}, {n,} or {n,m}. Anything else isn't a quantifier, and PCRE2
+    // takes the { literally.
+    bool parse_counted(size_t &min, size_t &max) {
+        size_t pos = m_pos + 1;
+        auto number = [&](size_t &out) {
+            size_t digits_begin = pos;
+            out = 0;
+            while (pos < m_pattern.size() && pos - digits_begin < 6 &&
+                   m_pattern[pos] >= '0' && m_pattern[pos] <= '9') {
+                out = out * 10 + (size_t)(m_pattern[pos++] - '0');
+            }
+            return pos != digits_begin;
+        };
+        if (!number(min)) {
+            return false;
+        }
+        max = min;
+        if (pos < m_pattern.size() && m_pattern[pos] == ',') {
+            ++pos;
+            if (!number(max)) {
+                max = RegexNode::unbounded;
+            }
+        }
+        if (pos >= m_pattern.size() || m_pattern[pos] != '}') {
+            return false;
+        }
+        m_pos = pos + 1;
+        return true;
+    }
+
+    bool parse_quantifier(size_t &min, size_t &max) {
+        if (at('*')) {
+            min = 0;
+            max = RegexNode::unbounded;
+        } else if (at('+')) {
+            min = 1;
+            max = RegexNode::unbounded;
+        } else if (at('?')) {
+            min = 0;
+            max = 1;
+        } else if (at('{')) {
+            return parse_counted(min, max);
+        } else {
+            return false;
+        }
+        ++m_pos;
+        return true;
+    }
+
+    std::unique_ptr<RegexNode> parse_repeat(size_t depth) {
+        std::unique_ptr<RegexNode> atom = parse_atom(depth);
+        size_t min, max;
+        if (!atom || !parse_quantifier(min, max)) {
+            return atom;
+        }
+        bool greedy = true;
+        if (at('?')) {
+            greedy = false;
+            ++m_pos;
+        } else if (at('+')) {
+            // possessive
+            return nullptr;
+        }
+        size_t after_quantifier = m_pos;
+        size_t next_min, next_max;
+        if (parse_quantifier(next_min, next_max)) {
+            // PCRE2 won't have a quantifier on a quantifier either
+            m_pos = after_quantifier;
+            return nullptr;
+        }
+        if (max < min || min > max_repeat ||
+            (max != RegexNode::unbounded && max > max_repeat)) {
+            return nullptr;
+        }
+        auto repeat = std::make_unique<RegexNode>(RegexNode::REPEAT);
+        repeat->min = min;
+        repeat->max = max;
+        repeat->greedy = greedy;
+        repeat->children.push_back(std::move(atom));
+        return repeat;
+    }
+
+    std::unique_ptr<RegexNode> parse_atom(size_t depth) {
+        char c = m_pattern[m_pos++];
+        switch (c) {
+        case '(': {
+            if (at('?')) {
+                // only (?:, everything else is an option or an assertion
+                if (m_pos + 1 >= m_pattern.size() ||
+                    m_pattern[m_pos + 1] != ':') {
+                    return nullptr;
+                }
+                m_pos += 2;
+            }
+            std::unique_ptr<RegexNode> inner = parse_alternation(depth + 1);
+            if (!inner || !at(')')) {
+                return nullptr;
+            }
+            ++m_pos;
+            return inner;
+        }
+        case '.': {
+            ByteSet bytes;
+            bytes.set();
+            bytes['\n'] = false;
+            return bytes_node(bytes);
+        }
+        case '[':
+            return parse_class();
+        case '\\': {
+            ByteSet bytes;
+            int byte;
+            if (parse_escape(bytes, byte) == 0) {
+                return nullptr;
+            }
+            return bytes_node(bytes);
+        }
+        case '^':
+        case '$':
+        case '*':
+        case '+':
+        case '?':
+        case ')':
+            return nullptr;
+        default: {
+            ByteSet bytes;
+            bytes[(unsigned char)c] = true;
+            return bytes_node(bytes);
+        }
+        }
+    }
+
+    // Adds what the escape after a backslash matches to bytes. Returns 1
+    // if it's a single byte, which also goes in byte, 2 if it's a class
+    // like \d, or 0 if it's not supported.
+    int parse_escape(ByteSet &bytes, int &byte) {
+        if (m_pos == m_pattern.size()) {
+            return 0;
+        }
+        char c = m_pattern[m_pos++];
+        auto range = [&](ByteSet &set, int lo, int hi) {
+            for (int b = lo; b <= hi; ++b) {
+                set[b] = true;
+            }
+        };
+        ByteSet cls;
+        switch (c) {
+        case 'd':
+        case 'D':
+            range(cls, '0', '9');
+            break;
+        case 'w':
+        case 'W':
+            range(cls, '0', '9');
+            range(cls, 'a', 'z');
+            range(cls, 'A', 'Z');
+            cls['_'] = true;
+            break;
+        case 's':
+        case 'S':
+            for (int b : {' ', '\t', '\n', '\v', '\f', '\r'}) {
+                cls[b] = true;
+            }
+            break;
+        case 'n':
+            byte = '\n';
+            break;
+        case 't':
+            byte = '\t';
+            break;
+        case 'r':
+            byte = '\r';
+            break;
+        case 'f':
+            byte = '\f';
+            break;
+        case 'e':
+            byte = 0x1b;
+            break;
+        case 'a':
+            byte = 0x07;
+            break;
+        case 'x': {
+            if (at('{')) {
+                return 0;
+            }
+            // up to two hex digits, none at all means NUL
+            byte = 0;
+            for (size_t i = 0; i < 2 && m_pos < m_pattern.size(); ++i) {
+                char h = m_pattern[m_pos];
+                int value = (h >= '0' && h <= '9')   ? h - '0'
+                            : (h >= 'a' && h <= 'f') ? h - 'a' + 10
+                            : (h >= 'A' && h <= 'F') ? h - 'A' + 10
+                                                     : -1;
+                if (value == -1) {
+                    break;
+                }
+                byte = byte * 16 + value;
+                ++m_pos;
+            }
+            break;
+        }
+        default:
+            if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+                (c >= 'A' && c <= 'Z')) {
+                // backreferences, assertions, \p and friends
+                return 0;
+            }
+            byte = (unsigned char)c;
+            break;
+        }
+        if (c == 'd' || c == 'w' || c == 's') {
+            bytes |= cls;
+            return 2;
+        }
+        if (c == 'D' || c == 'W' || c == 'S') {
+            bytes |= ~cls;
+            return 2;
+        }
+        bytes[byte] = true;
+        return 1;
+    }
+
+    // one member of a class, same returns as parse_escape()
+    int parse_class_member(ByteSet &bytes, int &byte) {
+        char c = m_pattern[m_pos++];
+        if (c == '\\') {
+            return parse_escape(bytes, byte);
+        }
+        if (c == '[' && m_pos < m_pattern.size() &&
+            (at(':') || at('.') || at('='))) {
+            // POSIX classes
+            return 0;
+        }
+        byte = (unsigned char)c;
+        bytes[byte] = true;
+        return 1;
+    }
+
+    std::unique_ptr<RegexNode> parse_class() {
+        bool negate = false;
+        if (at('^')) {
+            negate = true;
+            ++m_pos;
+        }
+        ByteSet bytes;
+        bool first = true;
+        while (true) {
+            if (m_pos == m_pattern.size()) {
+                return nullptr;
+            }
+            if (at(']') && !first) {
+                ++m_pos;
+                break;
+            }
+            first = false;
+            int lo;
+            int kind = parse_class_member(bytes, lo);
+            if (kind == 0) {
+                return nullptr;
+            }
+            if (kind == 1 && at('-') && m_pos + 1 < m_pattern.size() &&
+                m_pattern[m_pos + 1] != ']') {
+                ++m_pos;
+                int hi;
+                ByteSet ignored;
+                if (parse_class_member(ignored, hi) != 1 || hi < lo) {
+                    return nullptr;
+                }
+                for (int b = lo; b <= hi; ++b) {
+                    bytes[b] = true;
+                }
+            }
+        }
+        std::unique_ptr<RegexNode> node = bytes_node(bytes);
+        if (negate) {
+            // after folding, so [^a] doesn't let A through when caseless
+            node->bytes.flip();
+        }
+        return node;
+    }
+};
+
+// A Thompson NFA over bytes. SPLIT prefers out over out1, which is how
+// greedy and lazy come out different.
+struct Nfa {
+    struct State {
+        enum Kind {
+            BYTES,
+            SPLIT,
+            MATCH,
+        };
+        Kind kind;
+        ByteSet bytes;
+        uint32_t out;
+        uint32_t out1;
+    };
+    // past this it goes to PCRE2, counted repeats can blow up fast
+    constexpr static size_t max_states = 20000;
+
+    std::vector<State> m_states;
+    uint32_t m_start;
+    bool m_too_big;
+
+    // Reversed matches the pattern backwards, for scanning from the end.
+    // Unanchored puts a lazy .*? in front, so a match can start anywhere
+    // and earlier starts win.
+    Nfa(RegexNode const &root, bool reversed, bool unanchored)
+        : Nfa(std::vector<RegexNode const *>{&root}, reversed, unanchored) {
+    }
+
+    // Any of roots, each with a MATCH of its own, so what matched can be
+    // told apart: root i's MATCH is state i. Earlier ones win a tie, same
+    // as in an alternation.
+    Nfa(std::vector<RegexNode const *> const &roots, bool reversed,
+        bool unanchored)
+        : m_start(0), m_too_big(false) {
+        for (size_t i = 0; i < roots.size(); ++i) {
+            add({State::MATCH, {}, 0, 0});
+        }
+        m_start = compile(*roots.back(), (uint32_t)(roots.size() - 1),
+                          reversed);
+        for (size_t i = roots.size() - 1; i-- > 0;) {
+            uint32_t branch = compile(*roots[i], (uint32_t)i, reversed);
+            m_start = add({State::SPLIT, {}, branch, m_start});
+        }
+        if (unanchored) {
+            uint32_t split = add({State::SPLIT, {}, m_start, 0});
+            ByteSet any;
+            any.set();
+            m_states[split].out1 = add({State::BYTES, any, split, 0});
+            m_start = split;
+        }
+    }
+
+    bool ok() const {
+        return !m_too_big;
+    }
+
+  private:
+    uint32_t add(State state) {
+        if (m_states.size() >= max_states) {
+            m_too_big = true;
+            return 0;
+        }
+        m_states.push_back(state);
+        return (uint32_t)(m_states.size() - 1);
+    }
+
+    // Builds node in front of next, back to front, and returns where it
+    // starts.
+    uint32_t compile(RegexNode const &node, uint32_t next, bool reversed) {
+        if (m_too_big) {
+            return 0;
+        }
+        switch (node.kind) {
+        case RegexNode::BYTES:
+            return add({State::BYTES, node.bytes, next, 0});
+        case RegexNode::CONCAT:
+            if (reversed) {
+                for (auto const &child : node.children) {
+                    next = compile(*child, next, reversed);
+                }
+            } else {
+                for (auto it = node.children.rbegin();
+                     it != node.children.rend(); ++it) {
+                    next = compile(**it, next, reversed);
+                }
+            }
+            return next;
+        case RegexNode::ALTERNATE: {
+            uint32_t rest = compile(*node.children.back(), next, reversed);
+            for (size_t i = node.children.size() - 1; i-- > 0;) {
+                uint32_t branch = compile(*node.children[i], next, reversed);
+                rest = add({State::SPLIT, {}, branch, rest});
+            }
+            return rest;
+        }
+        case RegexNode::REPEAT: {
+            RegexNode const &child = *node.children[0];
+            if (node.max == RegexNode::unbounded) {
+                uint32_t split = add({State::SPLIT, {}, 0, 0});
+                uint32_t body = compile(child, split, reversed);
+                if (m_too_big) {
+                    return 0;
+                }
+                m_states[split].out = node.greedy ? body : next;
+                m_states[split].out1 = node.greedy ? next : body;
+                next = split;
+            } else {
+                for (size_t i = node.min; i < node.max; ++i) {
+                    uint32_t body = compile(child, next, reversed);
+                    next = node.greedy ? add({State::SPLIT, {}, body, next})
+                                       : add({State::SPLIT, {}, next, body});
+                }
+            }
+            for (size_t i = 0; i < node.min; ++i) {
+                next = compile(child, next, reversed);
+            }
+            return next;
+        }
+        }
+        return next;
+    }
+};
+
+// The DFA for an Nfa, built as it's needed. States are kept in a bounded
+// cache that gets thrown away when it fills up. If that keeps happening
+// the DFA isn't pulling its weight, and next() gives up.
+//
+// With leftmost_first, anything lower priority than a match gets dropped,
+// so once the scan goes dead the last match seen is the one PCRE2 would
+// have picked. Without it every thread carries on, which is what finding
+// the longest match needs.
+//
+// A State is where its row of transitions starts, with flags in the low
+// bits, which rows being 256 long leaves free. A scan can then go from
+// state to state with one load, and only has to stop and look when
+// something has a flag set.
+struct LazyDfa {
+    using State = uint32_t;
+    constexpr static State match_flag = 1;
+    constexpr static State start_flag = 2;
+    constexpr static State flags = 0xff;
+    // all flagged, so they stop a scan too
+    constexpr static State unknown = UINT32_MAX;
+    constexpr static State dead = UINT32_MAX - 1;
+    constexpr static State gave_up = UINT32_MAX - 2;
+    constexpr static size_t max_cached_states = 2048;
+    constexpr static size_t max_resets = 16;
+    // how far the memchrs look at a time when there's more than one start
+    // byte. small, so a rare one doesn't get looked for way past a common
+    // one every time.
+    constexpr static size_t skip_window = 256;
+
+    Nfa const *m_nfa;
+    bool m_leftmost_first;
+    // the NFA states each DFA state stands for, in priority order
+    std::vector<std::vector<uint32_t>> m_sets;
+    std::unordered_map<std::string, State> m_index;
+    std::vector<State> m_transitions;
+    std::vector<uint32_t> m_start_set;
+    State m_start;
+    // since the caller last zeroed it, which it does once per search
+    size_t m_resets;
+    // for the closure, so each NFA state gets added once per step
+    std::vector<uint32_t> m_marks;
+    uint32_t m_mark;
+    bool m_cut;
+    // When the start state only goes anywhere else on a few bytes, the
+    // scan can skip ahead to the next of them with memchr, which is a lot
+    // quicker than stepping. The start state has start_flag set if so.
+    constexpr static size_t max_start_bytes = 3;
+    std::vector<uint8_t> m_start_bytes;
+
+    LazyDfa(Nfa const *nfa, bool leftmost_first)
+        : m_nfa(nfa), m_leftmost_first(leftmost_first), m_resets(0),
+          m_marks(nfa->m_states.size(), 0), m_mark(0), m_cut(false) {
+        begin_step();
+        add_closure(m_nfa->m_start, m_start_set);
+        find_start_bytes();
+        m_start = intern(m_start_set);
+    }
+    LazyDfa(LazyDfa const &) = delete;
+    LazyDfa &operator=(LazyDfa const &) = delete;
+
+    State start() const {
+        return m_start;
+    }
+
+    State next(State state, uint8_t byte) {
+        State next_state = m_transitions[(state & ~flags) + byte];
+        return next_state == unknown ? compute(state, byte) : next_state;
+    }
+
+    // where the first of m_start_bytes in [begin, end) is, or end
+    const char *skip_forward(const char *begin, const char *end) const {
+        if (m_start_bytes.size() == 1) {
+            auto hit = (const char *)memchr(begin, m_start_bytes[0],
+                                            (size_t)(end - begin));
+            return hit ? hit : end;
+        }
+        while (begin < end) {
+            const char *window_end =
+                begin + std::min((size_t)(end - begin), skip_window);
+            const char *first = window_end;
+            for (uint8_t byte : m_start_bytes) {
+                // no further than the first hit so far
+                auto hit = (const char *)memchr(begin, byte,
+                                                (size_t)(first - begin));
+                if (hit) {
+                    first = hit;
+                }
+            }
+            if (first != window_end) {
+                return first;
+            }
+            begin = window_end;
+        }
+        return end;
+    }
+
+    // where the last of m_start_bytes in [begin, end) is, or nullptr
+    const char *skip_backward(const char *begin, const char *end) const {
+        if (m_start_bytes.size() == 1) {
+            return (const char *)memrchr(begin, m_start_bytes[0],
+                                         (size_t)(end - begin));
+        }
+        while (begin < end) {
+            const char *window_begin =
+                end - std::min((size_t)(end - begin), skip_window);
+            const char *last = window_begin - 1;
+            for (uint8_t byte : m_start_bytes) {
+                auto hit = (const char *)memrchr(last + 1, byte,
+                                                 (size_t)(end - last - 1));
+                if (hit) {
+                    last = hit;
+                }
+            }
+            if (last != window_begin - 1) {
+                return last;
+            }
+            end = window_begin;
+        }
+        return nullptr;
+    }
+
+  private:
+    void begin_step() {
+        if (++m_mark == 0) {
+            std::fill(m_marks.begin(), m_marks.end(), 0);
+            m_mark = 1;
+        }
+        m_cut = false;
+    }
+
+    // appends everything reachable from id without reading a byte, in
+    // priority order
+    void add_closure(uint32_t id, std::vector<uint32_t> &out) {
+        std::vector<uint32_t> stack{id};
+        while (!stack.empty() && !m_cut) {
+            uint32_t cur = stack.back();
+            stack.pop_back();
+            if (m_marks[cur] == m_mark) {
+                continue;
+            }
+            m_marks[cur] = m_mark;
+            Nfa::State const &state = m_nfa->m_states[cur];
+            switch (state.kind) {
+            case Nfa::State::SPLIT:
+                stack.push_back(state.out1);
+                stack.push_back(state.out);
+                break;
+            case Nfa::State::BYTES:
+                out.push_back(cur);
+                break;
+            case Nfa::State::MATCH:
+                out.push_back(cur);
+                m_cut = m_leftmost_first;
+                break;
+            }
+        }
+    }
+
+    bool has_match(std::vector<uint32_t> const &set) const {
+        for (uint32_t id : set) {
+            if (m_nfa->m_states[id].kind == Nfa::State::MATCH) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::vector<uint32_t> step(std::vector<uint32_t> const &set,
+                               uint8_t byte) {
+        std::vector<uint32_t> next_set;
+        begin_step();
+        for (uint32_t id : set) {
+            Nfa::State const &nfa_state = m_nfa->m_states[id];
+            if (nfa_state.kind == Nfa::State::BYTES && nfa_state.bytes[byte]) {
+                add_closure(nfa_state.out, next_set);
+                if (m_cut) {
+                    break;
+                }
+            } else if (nfa_state.kind == Nfa::State::MATCH &&
+                       m_leftmost_first) {
+                break;
+            }
+        }
+        return next_set;
+    }
+
+    // Only ever pans out for the unanchored ones, where the start state
+    // loops on everything that can't begin a match.
+    void find_start_bytes() {
+        if (has_match(m_start_set)) {
+            // every byte skipped would have been a match
+            return;
+        }
+        std::vector<uint8_t> bytes;
+        for (int byte = 0; byte < 256; ++byte) {
+            if (step(m_start_set, (uint8_t)byte) == m_start_set) {
+                continue;
+            }
+            if (bytes.size() == max_start_bytes) {
+                return;
+            }
+            bytes.push_back((uint8_t)byte);
+        }
+        m_start_bytes = std::move(bytes);
+    }
+
+    State compute(State state, uint8_t byte) {
+        std::vector<uint32_t> next_set = step(m_sets[state >> 8], byte);
+        State next_state = dead;
+        size_t resets = m_resets;
+        if (!next_set.empty()) {
+            next_state = intern(next_set);
+        }
+        if (next_state != gave_up && resets == m_resets) {
+            // after a reset, state's row is gone
+            m_transitions[(state & ~flags) + byte] = next_state;
+        }
+        return next_state;
+    }
+
+    State intern(std::vector<uint32_t> const &set) {
+        std::string key((char const *)set.data(), set.size() * sizeof(set[0]));
+        auto it = m_index.find(key);
+        if (it != m_index.end()) {
+            return it->second;
+        }
+        if (m_sets.size() >= max_cached_states) {
+            if (++m_resets > max_resets) {
+                return gave_up;
+            }
+            m_sets.clear();
+            m_index.clear();
+            m_transitions.clear();
+            // start keeps its place, it's always the first row
+            intern(m_start_set);
+            if (m_start_set == set) {
+                return m_start;
+            }
+        }
+        State state = (State)(m_sets.size() << 8);
+        if (has_match(set)) {
+            state |= match_flag;
+        }
+        if (m_sets.empty() && !m_start_bytes.empty()) {
+            state |= start_flag;
+        }
+        m_sets.push_back(set);
+        m_index.emplace(std::move(key), state);
+        m_transitions.resize(m_transitions.size() + 256, unknown);
+        return state;
+    }
+};
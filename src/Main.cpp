@@ -8,9 +8,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <string_view>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
 #include <unistd.h>
 
 #include <iostream>
+#include <memory>
 
 #include "Timer.h"
 #include "search.h"
@@ -19,26 +22,50 @@
 // "scoped globals" in this way. perhaps we should make
 // this a static method that takes in params
 void Main::update_screen_highlight_offsets() {
+    TRACE_SPAN("render", "highlight_offsets");
     auto content_guard = m_content_handle->get_contents();
     Page page = m_view.current_page();
 
     // clear our highlight offsets
     m_highlight_offsets.clear();
 
+    // a regex can give up on a line, e.g. on its heap limit, which leaves
+    // that line without search highlights
+    SearchProgress progress(0, 0);
+    SearchProgress::Scope scope(&progress);
+
     std::vector<View::Highlight> line_highlights;
     for (size_t idx = 0; idx < page.get_num_lines(); ++idx) {
         auto page_line = page.get_nth_line(content_guard.contents, idx);
         size_t line_base_offset = page.get_nth_offset(idx);
 
+        line_highlights.clear();
+        // every pin in the one pass, under the search's own highlights. a
+        // line the DFA gives up on just goes without.
+        if (std::optional<std::vector<PinnedMatch>> pinned =
+                pinned_matches(page_line, m_pins)) {
+            for (PinnedMatch const &match : *pinned) {
+                line_highlights.push_back({match.offset, match.length,
+                                           View::Highlight::Type::Pin,
+                                           match.pin});
+            }
+        }
+        if (!m_highlight_active) {
+            m_highlight_offsets.push_back(std::move(line_highlights));
+            continue;
+        }
+
         // this is already relative to our visual line
-        std::vector<size_t> line_offsets = *search_all(
+        std::optional<std::vector<size_t>> line_offsets = search_all(
             regex_search_first, page_line, m_search_pattern, 0,
             page_line.size(), m_search_case != SearchCase::SENSITIVE,
             std::stop_token());
-        line_highlights.clear();
-        line_highlights.reserve(line_offsets.size());
+        if (!line_offsets) {
+            m_highlight_offsets.push_back(std::move(line_highlights));
+            continue;
+        }
 
-        for (size_t offset : line_offsets) {
+        for (size_t offset : *line_offsets) {
             using enum View::Highlight::Type;
             if (offset + line_base_offset == m_last_known_search_result) {
                 line_highlights.push_back(
@@ -52,19 +79,50 @@ void Main::update_screen_highlight_offsets() {
         m_highlight_offsets.push_back(std::move(line_highlights));
     }
     assert(m_highlight_offsets.size() == page.get_num_lines());
+    if (int error = progress.m_regex_error.load(std::memory_order_relaxed)) {
+        set_status("Highlighting gave up: " + regex_error_message(error));
+    }
 }
 
 void Main::display_page() {
-    if (m_highlight_active) {
-        update_screen_highlight_offsets();
-        m_view.display_page_at(m_highlight_offsets);
-    } else {
-        m_view.display_page_at({});
+    // the actual drawing happens in flush_page(), once the current batch of
+    // commands has been handled. holding j down only renders the last one.
+    m_page_dirty = true;
+}
+
+void Main::flush_page() {
+    using LatencyStats::Stage::RENDER, LatencyStats::Stage::TOTAL;
+    auto render_start = std::chrono::steady_clock::now();
+    bool rendered = m_page_dirty;
+    if (m_page_dirty) {
+        m_page_dirty = false;
+        std::span<const uint64_t> density = minimap_density();
+        if (m_highlight_active || !m_pins.empty()) {
+            update_screen_highlight_offsets();
+            m_view.display_page_at(m_highlight_offsets, density);
+        } else {
+            m_view.display_page_at({}, density);
+        }
     }
+
+    // whatever was waiting on this page has reached the terminal now
+    auto painted = std::chrono::steady_clock::now();
+    for (auto [type, start] : m_awaiting_paint) {
+        if (rendered) {
+            m_latency.record(type, RENDER, painted - render_start);
+        }
+        m_latency.record(type, TOTAL, painted - start);
+    }
+    m_awaiting_paint.clear();
 }
 
 void Main::display_command_or_status() {
-    if (!m_command_str_buffer.empty()) {
+    bool idle = m_command_str_buffer == ":" ||
+                (m_command_str_buffer.empty() && m_status_str_buffer.empty());
+    if (m_tee && idle) {
+        // how --tee is going goes after the prompt
+        m_view.display_command(":  " + m_tee->tee_stats().describe(), 1);
+    } else if (!m_command_str_buffer.empty()) {
         m_view.display_command(m_command_str_buffer, m_command_cursor_pos);
     } else if (!m_status_str_buffer.empty()) {
         m_view.display_status(m_status_str_buffer);
@@ -76,59 +134,870 @@ void Main::display_command_or_status() {
     }
 }
 
-bool Main::run_main() {
-    if (m_search_result.valid() &&
-        m_search_result.wait_for(std::chrono::nanoseconds{0}) ==
-            std::future_status::ready) {
-        std::optional<size_t> result = m_search_result.get();
-        if (!result) {
+void Main::handle_search_result(SearchResult search_result) {
+    auto [result, generation] = search_result;
+    if (!result || m_content_handle->is_stale(generation)) {
+        // cancelled, or the contents changed under it
+        return;
+    }
+    if (*result == m_content_handle->size() || *result == std::string::npos) {
+        // this needs to change depending on whether there was
+        // already a search being done
+        set_status("Pattern not found");
+    } else {
+        m_last_known_search_result = *result;
+        m_view_tasks.cancel();
+        m_view.move_to_byte_offset(*result);
+    }
+    display_page();
+}
+
+SearchFunction Main::parallel_regex_search_last() {
+    return [pool = &m_pool](std::string_view contents,
+                            std::string_view pattern, size_t begin,
+                            size_t end, bool caseless, std::stop_token stop) {
+        return parallel_search_last(*pool, regex_search_last, contents,
+                                    pattern, begin, end, caseless,
+                                    std::move(stop));
+    };
+}
+
+std::optional<size_t> Main::known_search_next(std::string_view pattern,
+                                              size_t start, bool caseless) {
+    if (!m_search_gap || m_search_gap->pattern != pattern ||
+        m_search_gap->caseless != caseless ||
+        m_content_handle->is_stale(m_search_gap->generation)) {
+        return std::nullopt;
+    }
+    SearchGap const &gap = *m_search_gap;
+    if (start < gap.begin ||
+        (gap.after == npos ? m_content_handle->size() != gap.size
+                           : start > gap.after)) {
+        return std::nullopt;
+    }
+    return gap.after;
+}
+
+std::optional<size_t> Main::known_search_prev(std::string_view pattern,
+                                              size_t end, bool caseless) {
+    if (!m_search_gap || m_search_gap->pattern != pattern ||
+        m_search_gap->caseless != caseless ||
+        m_content_handle->is_stale(m_search_gap->generation)) {
+        return std::nullopt;
+    }
+    SearchGap const &gap = *m_search_gap;
+    if ((gap.before != npos && end <= gap.before) ||
+        end > (gap.after == npos ? gap.size : gap.after)) {
+        return std::nullopt;
+    }
+    return gap.before;
+}
+
+void Main::remember_search_gap(std::string pattern, size_t before,
+                               size_t after, bool backward, bool caseless,
+                               uint64_t generation, size_t size) {
+    if (m_content_handle->is_stale(generation)) {
+        return;
+    }
+    auto content_guard = m_content_handle->get_contents();
+    size_t begin = 0;
+    if (before != npos && backward) {
+        // there can be more hits later on the same line
+        std::string_view contents = content_guard.contents;
+        size_t newline = contents.find('\n', before);
+        begin = newline == std::string_view::npos ? contents.size()
+                                                  : newline + 1;
+    } else if (before != npos) {
+        begin = before + 1;
+    }
+    m_search_gap = SearchGap{std::move(pattern), caseless, generation,
+                             size, before, begin, after};
+}
+
+namespace {
+
+// nothing in it means anything special to a regex
+bool is_literal(std::string_view pattern) {
+    return pattern.find_first_of("\\^$.|?*+()[]{}") == std::string::npos;
+}
+
+bool literal_at(std::string_view contents, size_t pos,
+                std::string_view literal, bool caseless) {
+    if (pos > contents.size() || contents.size() - pos < literal.size()) {
+        return false;
+    }
+    auto lower = [](char c) {
+        return (char)(c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c);
+    };
+    for (size_t i = 0; i < literal.size(); ++i) {
+        char c = contents[pos + i];
+        if (caseless ? lower(c) != lower(literal[i]) : c != literal[i]) {
             return false;
         }
-        if (*result == m_content_handle->size() ||
-            *result == std::string::npos) {
-            // this needs to change depending on whether there was
-            // already a search being done
-            set_status("Pattern not found");
+    }
+    return true;
+}
+
+// what's after :w or :|, without the spaces either side
+std::string trim_spaces(std::string_view s) {
+    size_t begin = s.find_first_not_of(' ');
+    if (begin == std::string_view::npos) {
+        return "";
+    }
+    return std::string(s.substr(begin, s.find_last_not_of(' ') + 1 - begin));
+}
+
+} // namespace
+
+Task Main::stop_after(std::chrono::milliseconds budget,
+                      std::stop_source source) {
+    co_await m_executor.sleep(budget, source.get_token());
+    source.request_stop();
+}
+
+Task Main::search_incrementally(std::string pattern) {
+    uint64_t serial = ++m_incremental->serial;
+    m_search_tasks.cancel();
+    if (pattern.empty()) {
+        m_search_pattern = m_incremental->prev_pattern;
+        m_last_known_search_result = m_incremental->prev_result;
+        m_highlight_active = m_incremental->prev_highlight_active;
+        m_view_tasks.cancel();
+        m_view.move_to_byte_offset(m_incremental->origin);
+        display_page();
+        co_return;
+    }
+    m_search_pattern = pattern;
+    m_highlight_active = true;
+
+    auto content_guard = m_content_handle->get_contents();
+    std::string_view contents = content_guard.contents;
+    if (contents.empty()) {
+        co_return;
+    }
+    bool caseless = m_search_case != SearchCase::SENSITIVE;
+    std::optional<size_t> found;
+    size_t from = m_incremental->origin;
+    {
+        IncrementalSearch &inc = *m_incremental;
+        if (inc.known && inc.caseless == caseless &&
+            inc.generation == content_guard.generation &&
+            is_literal(pattern) && is_literal(inc.pattern) &&
+            pattern.starts_with(inc.pattern)) {
+            std::erase_if(inc.hits, [&](size_t hit) {
+                return !literal_at(contents, hit, pattern, caseless);
+            });
+            inc.pattern = pattern;
+            if (!inc.hits.empty()) {
+                found = inc.hits.front();
+            }
+            from = inc.limit;
         } else {
-            m_last_known_search_result = *result;
-            m_view.move_to_byte_offset(*result);
+            inc.known = false;
         }
-        display_page();
-        /* m_chan.push(Command{Command::QUIT}); */
-        /* m_input.t.detach(); */
-        return false;
     }
 
-    if (m_chan.empty() && m_following_eof) {
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
-        return false;
+    if (!found) {
+        std::stop_source budget;
+        std::stop_callback on_cancel(
+            m_search_tasks.token(),
+            [budget = budget]() mutable { budget.request_stop(); });
+        stop_after(incremental_search_budget, budget);
+        auto search = [=, guard = std::move(content_guard),
+                       index = search_index(pattern)](
+                          std::stop_token stop) {
+            IndexedSearcher searcher(regex_search_first, index,
+                                     TrigramQuery::regex(pattern), false);
+            std::string_view contents = guard.contents;
+            size_t size = contents.size();
+            IncrementalResult out{std::nullopt, {}, from, guard.generation};
+            out.first =
+                searcher(contents, pattern, from, size, caseless, stop);
+            if (!out.first) {
+                return out;
+            }
+            if (*out.first == npos) {
+                if (size - from >= pattern.size()) {
+                    out.limit = size - pattern.size() + 1;
+                }
+                return out;
+            }
+            // and whatever else is nearby, for the next keystroke
+            out.hits.push_back(*out.first);
+            out.limit = *out.first + 1;
+            size_t window_end =
+                std::min(size, *out.first + incremental_hit_window);
+            while (out.hits.size() < incremental_max_hits) {
+                std::optional<size_t> hit = searcher(
+                    contents, pattern, out.limit, window_end, caseless, stop);
+                if (!hit) {
+                    // out of time, what it's got so far still holds
+                    break;
+                }
+                if (*hit == npos) {
+                    if (window_end - out.limit >= pattern.size()) {
+                        out.limit = window_end - pattern.size() + 1;
+                    }
+                    break;
+                }
+                out.hits.push_back(*hit);
+                out.limit = *hit + 1;
+            }
+            return out;
+        };
+        IncrementalResult result = co_await m_executor.run(
+            m_search_worker, std::move(search), budget.get_token());
+        budget.request_stop();
+        if (!m_incremental || m_incremental->serial != serial ||
+            !result.first || m_content_handle->is_stale(result.generation)) {
+            // overtaken, or out of time. the view stays where it is.
+            co_return;
+        }
+        IncrementalSearch &inc = *m_incremental;
+        if (!inc.known) {
+            inc.known = true;
+            inc.pattern = pattern;
+            inc.caseless = caseless;
+            inc.generation = result.generation;
+            inc.hits.clear();
+        }
+        inc.hits.insert(inc.hits.end(), result.hits.begin(),
+                        result.hits.end());
+        inc.limit = result.limit;
+        found = result.first;
+    }
+
+    m_view_tasks.cancel();
+    if (*found == npos) {
+        m_last_known_search_result = npos;
+        m_view.move_to_byte_offset(m_incremental->origin);
+    } else {
+        m_last_known_search_result = *found;
+        m_view.move_to_byte_offset(*found);
+    }
+    display_page();
+}
+
+Task Main::show_search_progress(std::shared_ptr<SearchProgress> progress,
+                                std::stop_token stop) {
+    while (true) {
+        co_await m_executor.sleep(search_progress_interval, stop);
+        if (stop.stop_requested()) {
+            co_return;
+        }
+        progress->m_shown = true;
+        set_status(progress->describe());
+    }
+}
+
+void Main::finish_search_progress(Command::Type type,
+                                  SearchProgress &progress) {
+    if (progress.m_shown) {
+        set_status("");
+    }
+    // it comes back as though it had been cancelled, which is silent
+    if (int error = progress.m_regex_error.load(std::memory_order_relaxed)) {
+        set_status("Search gave up: " + regex_error_message(error));
     }
+    if (m_options.search_stats) {
+        progress.write_stats(stderr, Command::type_name(type));
+    }
+}
 
-    if (m_time_commands && prev_command) {
-        fprintf(stderr, "Time taken for command %d: %ld ns\n",
-                prev_command->type,
-                std::chrono::duration_cast<std::chrono::nanoseconds>(
-                    std::chrono::steady_clock::now() - prev_command->start)
-                    .count());
+Task Main::estimate_match_count() {
+    m_count_tasks.cancel();
+    auto content_guard = m_content_handle->get_contents();
+    uint64_t generation = content_guard.generation;
+    std::string pattern = m_search_pattern;
+    bool caseless = m_search_case != SearchCase::SENSITIVE;
+    auto counter =
+        std::make_shared<MatchCounter>(count_chunk_size, count_num_strata);
+    auto count = [=, guard = std::move(content_guard),
+                  index = search_index(pattern),
+                  pool = &m_pool](std::stop_token stop) {
+        IndexedSearcher searcher(regex_search_first, index,
+                                 TrigramQuery::regex(pattern), false);
+        return count_matches(*pool, searcher, *counter, guard.contents,
+                             pattern, caseless, stop);
+    };
+    set_status("Counting matches...");
+    std::stop_source shown;
+    show_match_count(counter, shown.get_token());
+    bool counted = co_await m_executor.run(m_count_worker, std::move(count),
+                                           m_count_tasks.token());
+    shown.request_stop();
+    if (counted && !m_content_handle->is_stale(generation)) {
+        set_status(counter->estimate()->describe());
     }
+}
 
-    Command command;
+Task Main::show_match_count(std::shared_ptr<const MatchCounter> counter,
+                            std::stop_token stop) {
+    while (true) {
+        co_await m_executor.sleep(search_progress_interval, stop);
+        if (stop.stop_requested()) {
+            co_return;
+        }
+        std::optional<MatchCountEstimate> estimate = counter->estimate();
+        if (estimate) {
+            set_status(estimate->describe());
+        }
+    }
+}
 
-    if (m_search_result.valid()) {
-        std::optional<Command> c = m_chan.try_pop();
-        if (c) {
-            command = *c;
+std::span<const uint64_t> Main::minimap_density() {
+    if (!m_minimap_shown || m_search_pattern.empty()) {
+        return {};
+    }
+    MinimapKey key{m_search_pattern, m_search_case != SearchCase::SENSITIVE,
+                   m_content_handle->size(), m_view.m_main_window_height};
+    bool usable = m_minimap && m_minimap->key.pattern == key.pattern &&
+                  m_minimap->key.caseless == key.caseless &&
+                  !m_content_handle->is_stale(m_minimap->generation);
+    if ((!usable || m_minimap->key != key) && m_minimap_pending != key) {
+        map_matches(key);
+    }
+    // one for fewer rows or less of the file will do until then
+    if (usable) {
+        return m_minimap->density.counts;
+    }
+    return {};
+}
+
+Task Main::map_matches(MinimapKey key) {
+    m_minimap_tasks.cancel();
+    m_minimap_pending = key;
+    auto content_guard = m_content_handle->get_contents();
+    uint64_t generation = content_guard.generation;
+    auto map = [key, guard = std::move(content_guard),
+                index = search_index(key.pattern),
+                pool = &m_pool](std::stop_token stop) {
+        IndexedSearcher searcher(regex_search_first, index,
+                                 TrigramQuery::regex(key.pattern), false);
+        return count_matches_by_bucket(*pool, searcher, guard.contents,
+                                       key.pattern, key.height, key.caseless,
+                                       stop);
+    };
+    std::optional<MatchDensity> density = co_await m_executor.run(
+        m_minimap_worker, std::move(map), m_minimap_tasks.token());
+    if (!density) {
+        co_return;
+    }
+    m_minimap_pending.reset();
+    m_minimap = Minimap{std::move(key), generation, std::move(*density)};
+    display_page();
+}
+
+Task Main::jump_to_time(std::string text) {
+    m_view_tasks.cancel();
+    std::stop_token stop = m_view_tasks.token();
+    struct TimeJump {
+        std::string error;
+        size_t offset = 0;
+        uint64_t generation = 0;
+    };
+    // a binary search, but the pages it lands on can be cold, so it's
+    // still a job
+    auto jump = [text,
+                 guard = m_content_handle->get_contents()](std::stop_token) {
+        TimeJump out;
+        out.generation = guard.generation;
+        std::optional<TimestampFormat> format =
+            TimestampFormat::detect(guard.contents);
+        if (!format) {
+            out.error = "No timestamps at the start of lines";
+            return out;
+        }
+        std::optional<int64_t> time = format->parse_query(text);
+        if (!time) {
+            out.error = "Not a time: " + text;
+            return out;
+        }
+        out.offset = format->bisect(guard.contents, *time);
+        if (out.offset == guard.contents.size()) {
+            out.error = "Nothing at or after " + text;
+        }
+        return out;
+    };
+    TimeJump result =
+        co_await m_executor.run(m_jump_worker, std::move(jump), stop);
+    if (stop.stop_requested() ||
+        m_content_handle->is_stale(result.generation)) {
+        co_return;
+    }
+    if (!result.error.empty()) {
+        set_status(result.error);
+        co_return;
+    }
+    m_view.move_to_byte_offset(result.offset);
+    display_page();
+}
+
+Task Main::export_lines(std::string destination, bool to_command) {
+    if (destination.empty()) {
+        set_status(to_command ? "No command to pipe to"
+                              : "No file to write to");
+        co_return;
+    }
+    m_export_tasks.cancel();
+    std::stop_token stop = m_export_tasks.token();
+    // the fd has to be for the file the guard's contents are in, if it got
+    // rotated in between then try again
+    ContentGuard content_guard = m_content_handle->get_contents();
+    int in_fd = m_content_handle->dup_content_fd();
+    while (in_fd != -1 &&
+           m_content_handle->is_stale(content_guard.generation)) {
+        close(in_fd);
+        content_guard = m_content_handle->get_contents();
+        in_fd = m_content_handle->dup_content_fd();
+    }
+    if (in_fd == -1) {
+        set_status(std::string("Could not export: ") + strerror(errno));
+        co_return;
+    }
+    // a stop only gets looked at in between copies otherwise, and a copy
+    // into a command that's stopped reading never finishes
+    int wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd == -1) {
+        close(in_fd);
+        set_status(std::string("Could not export: ") + strerror(errno));
+        co_return;
+    }
+
+    struct Export {
+        std::string error;
+        // npos for everything rather than matching lines
+        size_t lines = npos;
+        size_t bytes = 0;
+        size_t calls = 0;
+        RangeWriter::Method method = RangeWriter::WRITE;
+        // how the command went, empty if it went fine
+        std::string exit;
+    };
+    std::string pattern = m_search_pattern;
+    bool caseless = m_search_case != SearchCase::SENSITIVE;
+    auto progress =
+        std::make_shared<SearchProgress>(0, content_guard.contents.size());
+    progress->m_note =
+        (to_command ? "piping to " : "writing to ") + destination;
+    // opening a fifo can block, so that's in here too
+    auto job = [=, guard = std::move(content_guard),
+                index = search_index(pattern)](std::stop_token stop) {
+        SearchProgress::Scope scope(progress.get());
+        std::stop_callback on_stop(stop, [&]() {
+            progress->stop_requested();
+            uint64_t one = 1;
+            write(wake_fd, &one, sizeof(one));
+        });
+        Export out;
+        ExportSink sink = to_command ? ExportSink::spawn(destination)
+                                     : ExportSink::open_file(destination);
+        if (sink.m_fd == -1) {
+            close(in_fd);
+            out.error = sink.m_error;
+            return out;
+        }
+        std::string_view contents = guard.contents;
+        RangeWriter writer(in_fd, sink.m_fd, contents, stop, wake_fd);
+        bool ok = true;
+        if (pattern.empty()) {
+            ok = writer.add(0, contents.size());
         } else {
-            std::this_thread::sleep_for(std::chrono::milliseconds(10));
-            return false;
+            // whole lines, which run together into one range while they
+            // follow on from each other
+            IndexedSearcher searcher(regex_search_first, index,
+                                     TrigramQuery::regex(pattern), false);
+            out.lines = 0;
+            size_t pos = 0;
+            while (ok && pos < contents.size()) {
+                std::optional<size_t> hit = searcher(
+                    contents, pattern, pos, contents.size(), caseless, stop);
+                if (!hit) {
+                    // or the search gave up, which gets seen to below
+                    errno = ECANCELED;
+                    ok = false;
+                    break;
+                }
+                if (*hit >= contents.size()) {
+                    break;
+                }
+                SearchProgress::found();
+                const char *newline = (const char *)memrchr(
+                    contents.data() + pos, '\n', *hit - pos);
+                size_t line_start =
+                    newline ? (size_t)(newline - contents.data()) + 1 : pos;
+                size_t line_end = contents.find('\n', *hit);
+                line_end =
+                    line_end == std::string_view::npos ? contents.size()
+                                                       : line_end + 1;
+                ok = writer.add(line_start, line_end);
+                ++out.lines;
+                pos = line_end;
+            }
+        }
+        if (ok) {
+            ok = writer.flush();
+        }
+        int error = ok ? 0 : errno;
+        int regex_error =
+            progress->m_regex_error.load(std::memory_order_relaxed);
+        out.exit = sink.finish(stop.stop_requested() || regex_error != 0);
+        if (regex_error != 0) {
+            out.error = "Export stopped after " + std::to_string(out.lines) +
+                        " lines, search gave up: " +
+                        regex_error_message(regex_error);
+        } else if (error != 0 && error != ECANCELED) {
+            out.error = std::string("Could not export to ") + destination +
+                        ": " + strerror(error);
+            if (!out.exit.empty()) {
+                out.error += ", it " + out.exit;
+            }
         }
+        close(in_fd);
+        out.bytes = writer.m_bytes;
+        out.calls = writer.m_calls;
+        out.method = writer.m_method;
+        return out;
+    };
+    std::stop_source progress_stop;
+    show_search_progress(progress, progress_stop.get_token());
+    Export result =
+        co_await m_executor.run(m_export_worker, std::move(job), stop);
+    close(wake_fd);
+    progress_stop.request_stop();
+    finish_search_progress(Command::RUN_COMMAND_LINE, *progress);
+    if (stop.stop_requested()) {
+        co_return;
+    }
+    if (!result.error.empty()) {
+        set_status(result.error);
+        co_return;
+    }
+    // e.g. "Wrote 12 lines (1234 bytes) to out.log, 3 copy_file_range calls"
+    std::string status = to_command ? "Piped " : "Wrote ";
+    if (result.lines != npos) {
+        status += std::to_string(result.lines) +
+                  (result.lines == 1 ? " line (" : " lines (");
+    }
+    status += std::to_string(result.bytes) + " bytes";
+    if (result.lines != npos) {
+        status += ")";
+    }
+    status += " to " + destination + ", " + std::to_string(result.calls) +
+              " " + RangeWriter::method_name(result.method) +
+              (result.calls == 1 ? " call" : " calls");
+    if (!result.exit.empty()) {
+        status += ", it " + result.exit;
+    }
+    set_status(status);
+}
+
+Task Main::search_pins(Command command) {
+    set_command("", 0);
+    set_status("");
+    if (m_pins.empty()) {
+        set_status("Nothing pinned, ESC-p pins the search pattern");
+        co_return;
+    }
+    size_t which = command.payload_num;
+    if (which > m_pins.size()) {
+        set_status("No pin " + std::to_string(which) + ", there are " +
+                   std::to_string(m_pins.size()));
+        co_return;
+    }
+    auto content_guard = m_content_handle->get_contents();
+    std::string_view contents = content_guard.contents;
+    if (contents.empty()) {
+        co_return;
+    }
+
+    // on from the last one if it's still in view, like n and N
+    bool backward = command.type == Command::PIN_PREV;
+    bool from_hit = m_last_pin_hit != npos &&
+                    m_last_pin_hit >= m_view.get_starting_offset() &&
+                    m_last_pin_hit < m_view.get_ending_offset();
+    size_t begin = 0;
+    size_t end = contents.size();
+    if (backward) {
+        end = from_hit ? m_last_pin_hit : m_view.get_starting_offset();
+    } else {
+        begin = from_hit ? m_last_pin_hit + 1 : m_view.get_starting_offset();
+    }
+    std::vector<PinnedPattern> pins =
+        which == 0 ? m_pins : std::vector<PinnedPattern>{m_pins[which - 1]};
+
+    auto progress = std::make_shared<SearchProgress>(begin, end);
+    auto search = [=, guard = std::move(content_guard)](std::stop_token stop) {
+        SearchProgress::Scope scope(progress.get());
+        std::stop_callback on_stop(stop,
+                                   [&]() { progress->stop_requested(); });
+        return SearchResult{
+            backward
+                ? pinned_search_last(guard.contents, pins, begin, end, stop)
+                : pinned_search_first(guard.contents, pins, begin, end, stop),
+            guard.generation};
+    };
+    std::stop_source progress_stop;
+    show_search_progress(progress, progress_stop.get_token());
+    auto search_start = std::chrono::steady_clock::now();
+    SearchResult result = co_await m_executor.run(
+        m_search_worker, std::move(search), m_search_tasks.token());
+    progress_stop.request_stop();
+    finish_search_progress(command.type, *progress);
+    if (!result.offset || m_content_handle->is_stale(result.generation)) {
+        co_return;
+    }
+    m_latency.record(command.type, LatencyStats::Stage::SEARCH,
+                     std::chrono::steady_clock::now() - search_start);
+    if (*result.offset == npos) {
+        set_status("Pattern not found");
     } else {
-        command = m_chan.pop().value();
+        m_last_pin_hit = *result.offset;
+        m_view_tasks.cancel();
+        m_view.move_to_byte_offset(*result.offset);
+    }
+    display_page();
+}
+
+void Main::update_tee_stats() {
+    uint64_t expirations;
+    read(m_tee_timer_fd, &expirations, sizeof(expirations));
+    // before reading more, so that's everything there's going to be
+    bool done = m_tee->tee_stats().input_done;
+    // what's been passed on can be looked at, and if the view reaches the
+    // end it shows up there without having to G for it
+    size_t old_size = m_content_handle->size();
+    if (m_content_handle->read_more() &&
+        m_view.get_ending_offset() >= old_size) {
+        display_page();
+    }
+    display_command_or_status();
+    if (done) {
+        // nothing's going to change now
+        m_loop.remove(m_tee_timer_fd);
+    }
+}
+
+void Main::handle_signals() {
+    struct signalfd_siginfo info;
+    while (read(m_signal_fd, &info, sizeof(info)) == sizeof(info)) {
+        // these jump the queue, same as when they came in through handlers
+        if (info.ssi_signo == SIGWINCH) {
+            m_pending_commands.push_front(Command{Command::RESIZE});
+        } else if (info.ssi_signo == SIGINT) {
+            m_pending_commands.push_front(Command{Command::INTERRUPT});
+        } else if (info.ssi_signo == SIGUSR1) {
+            write_latency_report();
+        }
+    }
+}
+
+void Main::write_latency_report() {
+    if (m_options.latency_report_path.empty()) {
+        return;
+    }
+    if (!m_latency.write_json(m_options.latency_report_path)) {
+        set_status("Could not write latency report to " +
+                   m_options.latency_report_path + ": " + strerror(errno));
+    }
+}
+
+void Main::handle_content_changed(uint32_t events) {
+    if (!m_following_eof) {
+        return;
+    }
+    if (m_content_handle->consume_notifications()) {
+        run_follow_eof();
+    }
+    if ((events & EPOLLHUP) && !m_content_handle->has_changed()) {
+        // the writer is gone and we've read everything, nothing more is
+        // coming so stop listening before it spins
+        m_loop.remove(m_content_handle->get_notify_fd());
+        m_watching_content = false;
+    }
+}
+
+void Main::wait_for_events() {
+    m_loop.wait(m_events);
+    for (auto [id, events] : m_events) {
+        switch (id) {
+        case COMMANDS_READY:
+            m_chan.clear_fd();
+            m_chan.pop_all(m_pending_commands);
+            break;
+        case TASKS_READY:
+            m_executor.run_ready();
+            break;
+        case SIGNALLED:
+            handle_signals();
+            break;
+        case CONTENT_CHANGED:
+            handle_content_changed(events);
+            break;
+        case TEE_STATS:
+            update_tee_stats();
+            break;
+        }
     }
-    prev_command = command;
+}
 
+Task Main::load_index() {
+    auto content_guard = m_content_handle->get_contents();
+    uint64_t generation = content_guard.generation;
+    struct Loaded {
+        std::shared_ptr<const TrigramIndex> index;
+        // errno from saving it, 0 if that went fine
+        int save_errno = 0;
+    };
+    auto load = [guard = std::move(content_guard), pool = &m_pool,
+                 path = std::string(m_content_handle->get_path()),
+                 index_path = m_options.index_path](std::stop_token stop) {
+        Loaded loaded;
+        std::optional<TrigramIndex::Identity> identity =
+            TrigramIndex::identify(path);
+        if (identity) {
+            loaded.index = TrigramIndex::load(index_path, *identity);
+        }
+        if (loaded.index) {
+            return loaded;
+        }
+        std::shared_ptr<TrigramIndex> built = TrigramIndex::build(
+            *pool, guard.contents,
+            identity.value_or(TrigramIndex::Identity{}), stop);
+        // only worth saving if it's of the whole file as it is on disk
+        if (built && identity && identity->size == guard.contents.size() &&
+            !built->save(index_path)) {
+            loaded.save_errno = errno;
+        }
+        loaded.index = std::move(built);
+        return loaded;
+    };
+    Loaded loaded =
+        co_await m_executor.run(m_index_worker, std::move(load), {});
+    m_index = std::move(loaded.index);
+    m_index_generation = generation;
+    if (loaded.save_errno != 0) {
+        set_status("Could not write index to " + m_options.index_path + ": " +
+                   strerror(loaded.save_errno));
+    }
+}
+
+Task Main::extend_filter() {
+    m_filter_extending = true;
+    auto content_guard = m_content_handle->get_contents();
+    uint64_t generation = content_guard.generation;
+    std::shared_ptr<const TokenFilter> prev;
+    if (m_filter && !m_content_handle->is_stale(m_filter_generation)) {
+        prev = m_filter;
+    }
+    auto extend = [guard = std::move(content_guard), prev = std::move(prev),
+                   pool = &m_pool](std::stop_token stop) {
+        return std::shared_ptr<const TokenFilter>(
+            TokenFilter::extend(*pool, prev.get(), guard.contents, stop));
+    };
+    std::shared_ptr<const TokenFilter> filter =
+        co_await m_executor.run(m_filter_worker, std::move(extend), {});
+    m_filter_extending = false;
+    if (filter && !m_content_handle->is_stale(generation)) {
+        m_filter = std::move(filter);
+        m_filter_generation = generation;
+    }
+}
+
+Task Main::extend_field_index(FieldQuery query) {
+    m_field_index_pending = query.path;
+    auto content_guard = m_content_handle->get_contents();
+    uint64_t generation = content_guard.generation;
+    std::shared_ptr<const FieldIndex> prev;
+    if (m_field_index &&
+        !m_content_handle->is_stale(m_field_index_generation)) {
+        prev = m_field_index;
+    }
+    auto extend = [guard = std::move(content_guard), prev = std::move(prev),
+                   query = std::move(query),
+                   pool = &m_pool](std::stop_token stop) {
+        return std::shared_ptr<const FieldIndex>(FieldIndex::extend(
+            *pool, prev.get(), query, guard.contents, stop));
+    };
+    std::shared_ptr<const FieldIndex> index =
+        co_await m_executor.run(m_field_index_worker, std::move(extend), {});
+    if (!index) {
+        // one for another path took over, m_field_index_pending is its
+        co_return;
+    }
+    m_field_index_pending.clear();
+    if (!m_content_handle->is_stale(generation)) {
+        m_field_index = std::move(index);
+        m_field_index_generation = generation;
+    }
+}
+
+std::shared_ptr<const BlockIndex>
+Main::search_index(std::string_view pattern) {
+    if (m_index && m_content_handle->is_stale(m_index_generation)) {
+        m_index.reset();
+    }
+    if (m_filter && m_content_handle->is_stale(m_filter_generation)) {
+        m_filter.reset();
+    }
+    if (m_field_index &&
+        m_content_handle->is_stale(m_field_index_generation)) {
+        m_field_index.reset();
+    }
+    if (m_options.token_filter && !m_filter_extending &&
+        (m_filter ? m_filter->indexed_size() : 0) + TokenFilter::block_size <=
+            m_content_handle->size()) {
+        // this search scans what's new, later ones won't have to
+        extend_filter();
+    }
+    std::optional<FieldQuery> field;
+    if (m_options.field_index && (field = FieldQuery::parse(pattern))) {
+        bool indexed = m_field_index && m_field_index->m_path == field->path;
+        if (m_field_index_pending != field->path &&
+            (!indexed || m_field_index->indexed_size() +
+                                 FieldIndex::block_size <=
+                             m_content_handle->size())) {
+            extend_field_index(*field);
+        }
+        if (indexed) {
+            return m_field_index;
+        }
+    }
+    if (m_index) {
+        return m_index;
+    }
+    return m_filter;
+}
+
+Task Main::scroll_view(size_t num_lines, bool down) {
+    // big jumps go a chunk at a time, so input and rendering carry on in
+    // between and the next jump can cancel this one
+    m_view_tasks.cancel();
+    std::stop_token stop = m_view_tasks.token();
+    while (true) {
+        size_t step = std::min(num_lines, scroll_chunk_size);
+        if (down) {
+            m_view.scroll_down(step);
+        } else {
+            m_view.scroll_up(step);
+        }
+        num_lines -= step;
+        display_page();
+        if (num_lines == 0) {
+            break;
+        }
+        co_await m_executor.yield();
+        if (stop.stop_requested()) {
+            co_return;
+        }
+    }
+}
+
+// Runs as a coroutine, anything slow gets co_awaited so the main loop keeps
+// handling input and rendering in the meantime.
+Task Main::handle_command(Command command) {
     if (m_following_eof && command.type != Command::INTERRUPT) {
-        return false;
+        co_return;
     }
 
     switch (command.type) {
@@ -144,7 +1013,8 @@ bool Main::run_main() {
     case Command::QUIT:
         m_chan.close();
         m_file_task_stop_source.request_stop();
-        return true;
+        m_quit = true;
+        break;
     case Command::VIEW_LEFT:
         m_view.scroll_left(std::max(command.payload_num, (size_t)1));
         display_page();
@@ -154,32 +1024,30 @@ bool Main::run_main() {
         display_page();
         break;
     case Command::VIEW_DOWN:
-        m_view.scroll_down(std::max(command.payload_num, (size_t)1));
-        display_page();
+        scroll_view(std::max(command.payload_num, (size_t)1), true);
         break;
     case Command::VIEW_UP:
-        m_view.scroll_up(std::max(command.payload_num, (size_t)1));
-        display_page();
+        scroll_view(std::max(command.payload_num, (size_t)1), false);
         break;
     case Command::VIEW_DOWN_HALF_PAGE:
-        m_view.scroll_down(std::max((size_t)1, command.payload_num) *
-                           m_half_page_size);
-        display_page();
+        scroll_view(std::max((size_t)1, command.payload_num) *
+                        m_half_page_size,
+                    true);
         break;
     case Command::VIEW_UP_HALF_PAGE:
-        m_view.scroll_up(std::max((size_t)1, command.payload_num) *
-                         m_half_page_size);
-        display_page();
+        scroll_view(std::max((size_t)1, command.payload_num) *
+                        m_half_page_size,
+                    false);
         break;
     case Command::VIEW_DOWN_PAGE:
-        m_view.scroll_down(std::max((size_t)1, command.payload_num) *
-                           m_page_size);
-        display_page();
+        scroll_view(std::max((size_t)1, command.payload_num) *
+                        m_page_size,
+                    true);
         break;
     case Command::VIEW_UP_PAGE:
-        m_view.scroll_up(std::max((size_t)1, command.payload_num) *
-                         m_page_size);
-        display_page();
+        scroll_view(std::max((size_t)1, command.payload_num) *
+                        m_page_size,
+                    false);
         break;
     case Command::SET_HALF_PAGE_SIZE:
         m_half_page_size = command.payload_num;
@@ -188,14 +1056,17 @@ bool Main::run_main() {
         m_page_size = command.payload_num;
         break;
     case Command::VIEW_BOF:
+        m_view_tasks.cancel();
         m_view.move_to_top();
         display_page();
         if (!m_status_str_buffer.empty()) {
             set_status("");
         }
         break;
-    case Command::VIEW_EOF:
-        m_search_stop.request_stop();
+    case Command::VIEW_EOF: {
+        m_search_tasks.cancel();
+        m_view_tasks.cancel();
+        std::stop_token stop = m_view_tasks.token();
         if (m_content_handle->has_changed()) {
             // If the pipe is fast (it refills within 10ms), then read more.
             // However have a hard cutoff of 1s so it doesn't hang for
@@ -206,7 +1077,15 @@ bool Main::run_main() {
                        std::chrono::seconds(1)) {
                 m_view.move_to_end();
                 display_page();
-                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                bool more = co_await m_executor.readable(
+                    m_content_handle->get_notify_fd(),
+                    std::chrono::milliseconds(10), stop);
+                if (stop.stop_requested()) {
+                    co_return;
+                }
+                if (!more || !m_content_handle->consume_notifications()) {
+                    break;
+                }
             }
         }
         m_view.move_to_end();
@@ -215,6 +1094,7 @@ bool Main::run_main() {
             set_status("");
         }
         break;
+    }
     case Command::DISPLAY_COMMAND: {
         set_command(command.payload_str, command.payload_num);
         break;
@@ -256,6 +1136,10 @@ bool Main::run_main() {
         break;
     }
     case Command::SEARCH_START: {
+        // what was typed after the /, before it gets made printable
+        std::string typed = command.payload_str.substr(
+            std::min((size_t)1, command.payload_str.size()));
+
         // The loop is weird because command.payload_str is being mutated
         // in the loop body
 
@@ -279,11 +1163,33 @@ bool Main::run_main() {
 
         set_command(command.payload_str, command.payload_num);
         set_status("");
+
+        if (!m_incremental) {
+            m_incremental.emplace();
+            m_incremental->origin = m_view.get_starting_offset();
+            m_incremental->prev_pattern = m_search_pattern;
+            m_incremental->prev_result = m_last_known_search_result;
+            m_incremental->prev_highlight_active = m_highlight_active;
+        } else if (typed != m_incremental->typed) {
+            m_incremental->typed = typed;
+            search_incrementally(std::move(typed));
+        }
         break;
     }
     case Command::SEARCH_QUIT: {
         set_command("", 0);
         set_status("");
+        if (m_incremental) {
+            // back to how things were before the prompt opened
+            m_search_tasks.cancel();
+            m_search_pattern = m_incremental->prev_pattern;
+            m_last_known_search_result = m_incremental->prev_result;
+            m_highlight_active = m_incremental->prev_highlight_active;
+            m_view_tasks.cancel();
+            m_view.move_to_byte_offset(m_incremental->origin);
+            m_incremental.reset();
+            display_page();
+        }
         break;
     }
 
@@ -315,13 +1221,54 @@ bool Main::run_main() {
             end = m_last_known_search_result;
         }
 
-        std::tie(m_search_result, m_search_stop) =
-            m_search_worker.spawn([=](std::stop_token stop) {
-                return search_backward_n(
-                    regex_search_last, std::max((size_t)1, command.payload_num),
-                    contents, search_pattern, 0, end,
-                    m_search_case != SearchCase::SENSITIVE, stop);
-            });
+        bool caseless = m_search_case != SearchCase::SENSITIVE;
+        size_t num_repeats = std::max((size_t)1, command.payload_num);
+        std::optional<size_t> known;
+        if (num_repeats == 1) {
+            known = known_search_prev(search_pattern, end, caseless);
+        }
+        if (known) {
+            m_search_tasks.cancel();
+            handle_search_result({*known, content_guard.generation});
+            break;
+        }
+        // back from a hit, so there's nothing between it and what this finds
+        bool from_hit = end == m_last_known_search_result;
+        uint64_t generation = content_guard.generation;
+        size_t size = contents.size();
+
+        auto progress = std::make_shared<SearchProgress>(0, end);
+        auto search = [=, guard = std::move(content_guard),
+                       index = search_index(search_pattern),
+                       search_last = parallel_regex_search_last()](
+                          std::stop_token stop) {
+            SearchProgress::Scope scope(progress.get());
+            std::stop_callback on_stop(stop,
+                                       [&]() { progress->stop_requested(); });
+            IndexedSearcher searcher(search_last, index,
+                                     TrigramQuery::regex(search_pattern),
+                                     true);
+            return SearchResult{
+                search_backward_n(searcher, num_repeats, guard.contents,
+                                  search_pattern, 0, end, caseless, stop),
+                guard.generation};
+        };
+        std::stop_source progress_stop;
+        show_search_progress(progress, progress_stop.get_token());
+        auto search_start = std::chrono::steady_clock::now();
+        SearchResult result = co_await m_executor.run(
+            m_search_worker, std::move(search), m_search_tasks.token());
+        progress_stop.request_stop();
+        finish_search_progress(command.type, *progress);
+        if (result.offset) {
+            m_latency.record(command.type, LatencyStats::Stage::SEARCH,
+                             std::chrono::steady_clock::now() - search_start);
+        }
+        handle_search_result(result);
+        if (num_repeats == 1 && from_hit && result.offset) {
+            remember_search_gap(search_pattern, *result.offset, end, true,
+                                caseless, generation, size);
+        }
         break;
     }
 
@@ -354,14 +1301,57 @@ bool Main::run_main() {
             start = m_last_known_search_result + 1;
         }
 
-        std::tie(m_search_result, m_search_stop) =
-            m_search_worker.spawn([=](std::stop_token stop) {
-                return search_forward_n(
-                    regex_search_first,
-                    std::max((size_t)1, command.payload_num), contents,
-                    search_pattern, start, m_content_handle->size(),
-                    m_search_case != SearchCase::SENSITIVE, stop);
-            });
+        bool caseless = m_search_case != SearchCase::SENSITIVE;
+        size_t num_repeats = std::max((size_t)1, command.payload_num);
+        std::optional<size_t> known;
+        if (num_repeats == 1) {
+            known = known_search_next(search_pattern, start, caseless);
+        }
+        if (known) {
+            m_search_tasks.cancel();
+            handle_search_result({*known, content_guard.generation});
+            break;
+        }
+        // on from a hit, so there's nothing between it and what this finds
+        size_t from_hit = start == m_last_known_search_result + 1
+                              ? m_last_known_search_result
+                              : npos;
+        uint64_t generation = content_guard.generation;
+        size_t size = contents.size();
+
+        auto progress =
+            std::make_shared<SearchProgress>(start, contents.size());
+        auto search = [=, guard = std::move(content_guard),
+                       index = search_index(search_pattern)](
+                          std::stop_token stop) {
+            SearchProgress::Scope scope(progress.get());
+            std::stop_callback on_stop(stop,
+                                       [&]() { progress->stop_requested(); });
+            IndexedSearcher searcher(regex_search_first, index,
+                                     TrigramQuery::regex(search_pattern),
+                                     false);
+            return SearchResult{
+                search_forward_n(searcher, num_repeats, guard.contents,
+                                 search_pattern, start, guard.contents.size(),
+                                 caseless, stop),
+                guard.generation};
+        };
+        std::stop_source progress_stop;
+        show_search_progress(progress, progress_stop.get_token());
+        auto search_start = std::chrono::steady_clock::now();
+        SearchResult result = co_await m_executor.run(
+            m_search_worker, std::move(search), m_search_tasks.token());
+        progress_stop.request_stop();
+        finish_search_progress(command.type, *progress);
+        if (result.offset) {
+            m_latency.record(command.type, LatencyStats::Stage::SEARCH,
+                             std::chrono::steady_clock::now() - search_start);
+        }
+        handle_search_result(result);
+        if (num_repeats == 1 && from_hit != npos && result.offset) {
+            remember_search_gap(search_pattern, from_hit, *result.offset,
+                                false, caseless, generation, size);
+        }
         break;
     }
 
@@ -379,16 +1369,168 @@ bool Main::run_main() {
         std::string search_pattern = command.payload_str;
         m_search_pattern = search_pattern;
         m_last_known_search_result = npos;
-        size_t start = m_view.get_starting_offset();
-
-        std::tie(m_search_result, m_search_stop) =
-            m_search_worker.spawn([=](std::stop_token stop) {
-                return search_forward_n(
-                    regex_search_first,
-                    std::max((size_t)1, command.payload_num), contents,
-                    search_pattern, start, m_content_handle->size(),
-                    m_search_case != SearchCase::SENSITIVE, stop);
-            });
+        m_search_gap.reset();
+        // from where the prompt was opened, not wherever typing got to
+        size_t start = m_incremental ? m_incremental->origin
+                                     : m_view.get_starting_offset();
+        m_incremental.reset();
+        m_search_tasks.cancel();
+        m_count_tasks.cancel();
+        size_t num_repeats = std::max((size_t)1, command.payload_num);
+        uint64_t generation = content_guard.generation;
+        size_t size = contents.size();
+
+        // outwards in both directions at once, so a hit just above doesn't
+        // wait on a scan to the end, and N is ready about as soon as n is
+        auto progress = std::make_shared<SearchProgress>(0, contents.size());
+        bool caseless = m_search_case != SearchCase::SENSITIVE;
+        auto search = [=, guard = std::move(content_guard),
+                       index = search_index(search_pattern),
+                       pool = &m_pool](std::stop_token stop) {
+            SearchProgress::Scope scope(progress.get());
+            std::stop_callback on_stop(stop,
+                                       [&]() { progress->stop_requested(); });
+            TrigramQuery query = TrigramQuery::regex(search_pattern);
+            IndexedSearcher forward(regex_search_first, index, query, false);
+            IndexedSearcher backward(regex_search_last, index, query, true);
+            return NearestSearchResult{
+                search_nearest(*pool, forward, backward, guard.contents,
+                               search_pattern, start, caseless, stop),
+                guard.generation};
+        };
+        std::stop_source progress_stop;
+        show_search_progress(progress, progress_stop.get_token());
+        auto search_start = std::chrono::steady_clock::now();
+        NearestSearchResult nearest = co_await m_executor.run(
+            m_search_worker, std::move(search), m_search_tasks.token());
+        std::optional<NearestHits> hits = nearest.hits;
+        if (m_content_handle->is_stale(nearest.generation)) {
+            hits.reset();
+        }
+
+        // the nth hit below, which is where / goes unless there's a nearer
+        // one above. nullopt if it got cancelled, npos if there isn't one
+        // before below_end.
+        std::optional<size_t> forward;
+        size_t below_end = npos;
+        if (hits) {
+            forward = hits->forward;
+        }
+        bool hit_above = hits && hits->backward && *hits->backward != npos;
+        if (hits && !forward && num_repeats == 1 && hit_above) {
+            // below only matters as far down as the hit above is up
+            below_end = start + (start - *hits->backward);
+        }
+        if (hits && (!forward || (num_repeats > 1 && *forward != npos))) {
+            if (hit_above) {
+                progress->m_note = "match above";
+            }
+            // carry on below from wherever it had got to
+            size_t from = forward ? *forward + 1 : hits->searched_end;
+            size_t repeats = forward ? num_repeats - 1 : num_repeats;
+            auto rest = [=, guard = m_content_handle->get_contents(),
+                         index = search_index(search_pattern)](
+                            std::stop_token stop) {
+                SearchProgress::Scope scope(progress.get());
+                std::stop_callback on_stop(
+                    stop, [&]() { progress->stop_requested(); });
+                IndexedSearcher searcher(regex_search_first, index,
+                                         TrigramQuery::regex(search_pattern),
+                                         false);
+                size_t end = std::min(below_end, guard.contents.size());
+                return SearchResult{
+                    search_forward_n(searcher, repeats, guard.contents,
+                                     search_pattern, std::min(from, end),
+                                     end, caseless, stop),
+                    guard.generation};
+            };
+            SearchResult result = co_await m_executor.run(
+                m_search_worker, std::move(rest), m_search_tasks.token());
+            if (!result.offset ||
+                m_content_handle->is_stale(result.generation)) {
+                forward.reset();
+            } else if (!forward || *result.offset != npos) {
+                forward = result.offset;
+            }
+        }
+        // for N, or for / itself if there's nothing below
+        auto search_above = [&]() {
+            return [=, guard = m_content_handle->get_contents(),
+                    index = search_index(search_pattern),
+                    search_last = parallel_regex_search_last()](
+                       std::stop_token stop) {
+                SearchProgress::Scope scope(progress.get());
+                IndexedSearcher searcher(search_last, index,
+                                         TrigramQuery::regex(search_pattern),
+                                         true);
+                return SearchResult{searcher(guard.contents, search_pattern,
+                                             0, hits->searched_begin,
+                                             caseless, stop),
+                                    guard.generation};
+            };
+        };
+        if (forward && *forward == npos && !hits->backward) {
+            SearchResult result = co_await m_executor.run(
+                m_search_worker, search_above(), m_search_tasks.token());
+            if (!result.offset ||
+                m_content_handle->is_stale(result.generation)) {
+                forward.reset();
+            } else {
+                hits->backward = result.offset;
+            }
+        }
+        progress_stop.request_stop();
+        finish_search_progress(command.type, *progress);
+        if (!forward) {
+            break;
+        }
+        m_latency.record(command.type, LatencyStats::Stage::SEARCH,
+                         std::chrono::steady_clock::now() - search_start);
+        if (*forward == npos && hits->backward && *hits->backward != npos) {
+            handle_search_result({hits->backward, generation});
+            set_status(below_end == npos
+                           ? "Pattern not found below, showing the match above"
+                           : "The nearest match is above");
+            display_page();
+        } else {
+            handle_search_result({forward, generation});
+        }
+
+        // nobody's waiting on these, they're only so n and N are ready
+        if (*forward == npos && below_end != npos) {
+            auto rest = [=, guard = m_content_handle->get_contents(),
+                         index = search_index(search_pattern)](
+                            std::stop_token stop) {
+                IndexedSearcher searcher(regex_search_first, index,
+                                         TrigramQuery::regex(search_pattern),
+                                         false);
+                return SearchResult{
+                    searcher(guard.contents, search_pattern,
+                             std::min(below_end, guard.contents.size()),
+                             guard.contents.size(), caseless, stop),
+                    guard.generation};
+            };
+            SearchResult result = co_await m_executor.run(
+                m_search_worker, std::move(rest), m_search_tasks.token());
+            if (!result.offset ||
+                m_content_handle->is_stale(result.generation)) {
+                break;
+            }
+            forward = result.offset;
+        }
+        if (!hits->backward) {
+            SearchResult result = co_await m_executor.run(
+                m_search_worker, search_above(), m_search_tasks.token());
+            if (!result.offset ||
+                m_content_handle->is_stale(result.generation)) {
+                break;
+            }
+            hits->backward = result.offset;
+        }
+        if (num_repeats == 1) {
+            remember_search_gap(search_pattern, *hits->backward, *forward,
+                                true, caseless, generation, size);
+        }
         break;
     }
     case Command::UPDATE_LINE_IDXS: {
@@ -397,6 +1539,9 @@ bool Main::run_main() {
     }
     case Command::FOLLOW_EOF: {
         m_following_eof = true;
+        m_loop.add(m_content_handle->get_notify_fd(), CONTENT_CHANGED);
+        m_watching_content = true;
+        run_follow_eof();
         break;
     }
     case Command::TOGGLE_HIGHLIGHTING: {
@@ -413,7 +1558,9 @@ bool Main::run_main() {
     case Command::SEARCH_CLEAR: {
         m_search_pattern = "";
         m_last_known_search_result = npos;
-        m_search_result = std::future<std::optional<size_t>>();
+        m_search_gap.reset();
+        m_search_tasks.cancel();
+        m_count_tasks.cancel();
         set_command("", 0);
         m_highlight_active = false;
         set_status("Search cleared.");
@@ -421,22 +1568,125 @@ bool Main::run_main() {
         display_page();
         break;
     }
+    case Command::COUNT_MATCHES: {
+        set_command("", 0);
+        if (m_search_pattern.empty()) {
+            set_status("No previous search pattern.");
+            break;
+        }
+        estimate_match_count();
+        break;
+    }
+    case Command::TOGGLE_MINIMAP: {
+        if (m_search_pattern.empty()) {
+            set_command("", 0);
+            set_status("No previous search pattern.");
+            break;
+        }
+        m_minimap_shown = !m_minimap_shown;
+        if (!m_minimap_shown) {
+            m_minimap_tasks.cancel();
+            m_minimap_pending.reset();
+        }
+        display_page();
+        break;
+    }
+    case Command::JUMP_TO_DENSEST: {
+        set_command("", 0);
+        if (!m_minimap || m_minimap->key.pattern != m_search_pattern ||
+            m_content_handle->is_stale(m_minimap->generation)) {
+            set_status("Nothing mapped yet, ESC-m maps the matches");
+            break;
+        }
+        std::vector<uint64_t> const &counts = m_minimap->density.counts;
+        size_t densest = (size_t)(std::max_element(counts.begin(),
+                                                   counts.end()) -
+                                  counts.begin());
+        if (counts.empty() || counts[densest] == 0) {
+            set_status("Pattern not found");
+            break;
+        }
+        // to its first match, which n carries on from
+        m_last_known_search_result = m_minimap->density.first_hits[densest];
+        m_highlight_active = true;
+        m_view_tasks.cancel();
+        m_view.move_to_byte_offset(m_last_known_search_result);
+        display_page();
+        break;
+    }
+    case Command::PIN_PATTERN: {
+        set_command("", 0);
+        if (m_search_pattern.empty()) {
+            set_status("No previous search pattern.");
+            break;
+        }
+        PinnedPattern pin{m_search_pattern,
+                          m_search_case != SearchCase::SENSITIVE};
+        if (std::find(m_pins.begin(), m_pins.end(), pin) != m_pins.end()) {
+            set_status("Already pinned");
+        } else if (m_pins.size() == max_pins) {
+            set_status("No more than " + std::to_string(max_pins) +
+                       " pins, ESC-P clears them");
+        } else if (!can_pin(pin.pattern, pin.caseless)) {
+            set_status("Can't pin that, it's too much for the DFA");
+        } else {
+            m_pins.push_back(std::move(pin));
+            set_status("Pinned as " + std::to_string(m_pins.size()));
+            display_page();
+        }
+        break;
+    }
+    case Command::CLEAR_PINS: {
+        m_pins.clear();
+        m_last_pin_hit = npos;
+        set_command("", 0);
+        set_status("Pins cleared.");
+        display_page();
+        break;
+    }
+    case Command::PIN_NEXT:
+    case Command::PIN_PREV:
+        search_pins(command);
+        break;
+    case Command::RUN_COMMAND_LINE: {
+        set_command("", 0);
+        set_status("");
+        std::string_view line = command.payload_str;
+        if (line.empty()) {
+            break;
+        } else if (line.starts_with("t ")) {
+            jump_to_time(std::string(line.substr(2)));
+        } else if (line.starts_with("w ")) {
+            export_lines(trim_spaces(line.substr(2)), false);
+        } else if (line.starts_with("|")) {
+            export_lines(trim_spaces(line.substr(1)), true);
+        } else {
+            set_status("Unknown command: :" + command.payload_str);
+        }
+        break;
+    }
+    case Command::REPLAY_SYNC:
+        // answered by run() rather than here
+        break;
     case Command::INTERRUPT: {
         if (m_following_eof) {
             m_following_eof = false;
+            if (m_watching_content) {
+                m_loop.remove(m_content_handle->get_notify_fd());
+                m_watching_content = false;
+            }
         }
-        m_search_result = std::future<std::optional<size_t>>();
+        m_search_tasks.cancel();
+        m_count_tasks.cancel();
+        m_view_tasks.cancel();
+        m_export_tasks.cancel();
         set_command("", 0);
         set_status("");
         break;
     }
     }
 
-    if (command.type == Command::QUIT) {
-        return true;
-    } else {
-        return false;
-    }
+    m_awaiting_paint.push_back({command.type, command.start});
 }
 
 int main(int argc, char **argv) {
@@ -457,16 +1707,60 @@ int main(int argc, char **argv) {
                         history_maxsize_env + strlen(history_maxsize_env),
                         history_maxsize);
     }
-    FILE *tty = isatty(STDIN_FILENO) ? stdin : fopen("/dev/tty", "r");
-
     // TODO: proper cmdline arg parsing
     std::string filename = "";
     int fd = -1;
-    bool time_commands = false;
+    Main::Options options;
+    std::unique_ptr<ReplayDriver> replay;
+    bool tee = false;
     for (char *arg : std::span<char *>(argv + 1, argv + argc)) {
         using namespace std::string_literals;
+        std::string_view latency_report_flag = "--latency-report=";
+        std::string_view trace_flag = "--trace=";
+        std::string_view replay_flag = "--replay=";
+        std::string_view regex_engine_flag = "--regex-engine=";
+        std::string_view index_flag = "--index=";
         if (arg == "--time-commands"s) {
-            time_commands = true;
+            options.time_commands = true;
+            continue;
+        } else if (arg == "--search-stats"s) {
+            options.search_stats = true;
+            continue;
+        } else if (std::string_view(arg).starts_with(latency_report_flag)) {
+            options.latency_report_path =
+                std::string_view(arg).substr(latency_report_flag.size());
+            continue;
+        } else if (std::string_view(arg).starts_with(trace_flag)) {
+            options.trace_path =
+                std::string_view(arg).substr(trace_flag.size());
+            continue;
+        } else if (std::string_view(arg).starts_with(replay_flag)) {
+            replay = std::make_unique<ReplayDriver>(
+                std::string(std::string_view(arg).substr(replay_flag.size())));
+            options.replay = replay.get();
+            continue;
+        } else if (std::string_view(arg).starts_with(regex_engine_flag)) {
+            std::optional<RegexEngine> engine = parse_regex_engine(
+                std::string_view(arg).substr(regex_engine_flag.size()));
+            if (!engine) {
+                fprintf(stderr, "%s: expected auto or pcre2\n", arg);
+                return 1;
+            }
+            set_regex_engine(*engine);
+            continue;
+        } else if (arg == "--bloom-filter"s) {
+            options.token_filter = true;
+            continue;
+        } else if (arg == "--field-index"s) {
+            options.field_index = true;
+            set_field_queries(true);
+            continue;
+        } else if (arg == "--tee"s) {
+            tee = true;
+            continue;
+        } else if (std::string_view(arg).starts_with(index_flag)) {
+            options.index_path =
+                std::string_view(arg).substr(index_flag.size());
             continue;
         } else {
             // try to open the file
@@ -479,6 +1773,13 @@ int main(int argc, char **argv) {
         }
     }
 
+    FILE *tty;
+    if (replay) {
+        tty = replay->m_tty;
+    } else {
+        tty = isatty(STDIN_FILENO) ? stdin : fopen("/dev/tty", "r");
+    }
+
     if (fd != -1) {
         // We already have a file
     } else if (!isatty(STDIN_FILENO)) {
@@ -495,44 +1796,120 @@ int main(int argc, char **argv) {
         return 1;
     }
 
+    if (tee) {
+        if (!S_ISFIFO(statbuf.st_mode)) {
+            fprintf(stderr, "--tee needs its input from a pipe\n");
+            return 1;
+        }
+        // what was stdout gets the input, and the screen goes to the
+        // terminal instead. a replay has a screen of its own.
+        options.tee_fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+        if (options.tee_fd == -1) {
+            fprintf(stderr, "--tee: %s\n", strerror(errno));
+            return 1;
+        }
+        if (!replay) {
+            int terminal = open("/dev/tty", O_WRONLY | O_CLOEXEC);
+            if (terminal == -1 || dup2(terminal, STDOUT_FILENO) == -1) {
+                fprintf(stderr, "--tee: /dev/tty: %s\n", strerror(errno));
+                return 1;
+            }
+            close(terminal);
+        }
+    }
+
     /* Timer timer; */
 
+    // a :| command that stops reading is an error for the export to
+    // report, not a reason to quit
+    signal(SIGPIPE, SIG_IGN);
+
+    // has to be on before Main starts any threads
+    std::string trace_path = options.trace_path;
+    if (!trace_path.empty()) {
+        tracing::enable();
+        tracing::set_thread_name("main");
+    }
+
     if (S_ISREG(statbuf.st_mode)) {
         Main main{std::move(filename), tty, std::move(history_filename),
-                  history_maxsize, time_commands};
+                  history_maxsize, std::move(options)};
         main.run();
-        return 0;
     } else {
+        // a pipe's contents are gone once they've been read, there's nothing
+        // to index ahead of time
+        options.index_path.clear();
         Main main{fd, tty, std::move(history_filename), history_maxsize,
-                  time_commands};
+                  std::move(options)};
         main.run();
-        return 0;
     }
+
+    // every thread has been joined by now
+    if (!trace_path.empty() && !tracing::write_chrome_json(trace_path)) {
+        fprintf(stderr, "%s: %s\n", trace_path.c_str(), strerror(errno));
+        return 1;
+    }
+    return 0;
 }
 
 void Main::run_follow_eof() {
     if (m_content_handle->has_changed()) {
         // Cancel existing search so this doesn't hang
-        m_search_stop.request_stop();
+        m_search_tasks.cancel();
         m_content_handle->read_to_eof();
     }
     m_view.move_to_end();
     display_page();
-    m_view.display_status("Waiting for data... (interrupt to abort) " +
-                          std::to_string(rand()));
+    m_view.display_status("Waiting for data... (interrupt to abort)");
 }
 
 void Main::run() {
     /* m_chan.push(Command{Command::SEARCH_EXEC, "123123", {}, 0}); */
-    while (true) {
-        if (run_main()) {
-            break;
+    while (!m_quit) {
+        if (m_pending_commands.empty()) {
+            flush_page();
+            if (m_replay_sync_pending && Task::num_outstanding == 0) {
+                // everything typed before the sync has been handled, come
+                // back and painted
+                m_replay_sync_pending = false;
+                m_options.replay->synced(m_view.screen_checksum());
+            }
         }
-        /* if (m_search_state) { */
-        /*     run_search(); */
-        /* } */
-        if (m_following_eof) {
-            run_follow_eof();
+
+        if (m_options.time_commands && prev_command) {
+            fprintf(stderr, "Time taken for command %d: %ld ns\n",
+                    prev_command->type,
+                    std::chrono::duration_cast<std::chrono::nanoseconds>(
+                        std::chrono::steady_clock::now() - prev_command->start)
+                        .count());
+            prev_command.reset();
+        }
+
+        if (m_pending_commands.empty()) {
+            // sleep until there's input, a search result, a signal or more
+            // content
+            wait_for_events();
+            continue;
         }
+
+        Command command = std::move(m_pending_commands.front());
+        m_pending_commands.pop_front();
+        if (command.type == Command::REPLAY_SYNC) {
+            m_replay_sync_pending = true;
+            continue;
+        }
+        prev_command = command;
+        Command::Type type = command.type;
+        auto handle_start = std::chrono::steady_clock::now();
+        m_latency.record(type, LatencyStats::Stage::QUEUE,
+                         handle_start - command.start);
+        {
+            TRACE_SPAN("command", Command::type_name(type));
+            handle_command(std::move(command));
+        }
+        m_latency.record(type, LatencyStats::Stage::HANDLE,
+                         std::chrono::steady_clock::now() - handle_start);
     }
+
+    write_latency_report();
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <algorithm>
+#include <deque>
 #include <filesystem>
 #include <functional>
 #include <future>
@@ -8,16 +9,31 @@
 #include <ncurses.h>
 #include <optional>
 #include <signal.h>
+#include <span>
+#include <stdint.h>
 #include <stdio.h>
 #include <stop_token>
 #include <string>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include <utility>
 #include <vector>
 
 #include "Channel.h"
 #include "Command.h"
+#include "EventLoop.h"
+#include "Export.h"
+#include "FieldIndex.h"
 #include "Input.h"
+#include "LatencyStats.h"
+#include "Replay.h"
+#include "SearchProgress.h"
 #include "View.h"
+#include "Task.h"
+#include "Timestamp.h"
+#include "TokenFilter.h"
+#include "Trace.h"
+#include "TrigramIndex.h"
 #include "Worker.h"
 #include "search.h"
 
@@ -28,7 +44,50 @@
 struct Main {
     constexpr static size_t npos = std::string::npos;
 
+    struct Options {
+        bool time_commands = false;
+        // print what each search did to stderr once it's done
+        bool search_stats = false;
+        // where latency percentiles get written on exit and on SIGUSR1, empty
+        // to not write them at all
+        std::string latency_report_path;
+        // where a Chrome trace gets written on exit, empty to not trace
+        std::string trace_path;
+        // set when input comes from a replay script instead of a person
+        ReplayDriver *replay = nullptr;
+        // where the file's trigram index gets loaded from, or saved to
+        // after building it in the background. empty to not index.
+        std::string index_path;
+        // keep a TokenFilter of the contents, built in the background and
+        // extended as they grow
+        bool token_filter = false;
+        // take patterns like .status=500 for field queries rather than
+        // regexes, and keep a FieldIndex for the path the last one was on,
+        // the same way
+        bool field_index = false;
+        // --tee, where the input gets passed on to as it comes in, see
+        // PipeHandle. -1 without.
+        int tee_fd = -1;
+    };
+
+    // has to come before anything that starts a thread, so that they all
+    // inherit the blocked signal mask
+    int m_signal_fd;
+
+    // everything the main thread waits on
+    enum EventId : uint64_t {
+        COMMANDS_READY,
+        TASKS_READY,
+        SIGNALLED,
+        CONTENT_CHANGED,
+        TEE_STATS,
+    };
+    EventLoop m_loop;
+    std::vector<EventLoop::Event> m_events;
+
     Channel<Command> m_chan;
+    // commands drained from m_chan that haven't been handled yet
+    std::deque<Command> m_pending_commands;
 
     std::stop_source m_file_task_stop_source;
     std::promise<void> m_file_task_promise;
@@ -36,11 +95,16 @@ struct Main {
     std::mutex m_nc_mutex;
 
     std::unique_ptr<ContentHandle> m_content_handle;
+    // the same handle with --tee, for how that's going. null without.
+    PipeHandle *m_tee = nullptr;
+    // goes off every tee_stats_interval with --tee
+    int m_tee_timer_fd = -1;
     View m_view;
 
     InputThread m_input;
 
     bool m_highlight_active;
+    bool m_page_dirty;
 
     enum class SearchCase {
         SENSITIVE,
@@ -50,9 +114,144 @@ struct Main {
     SearchCase m_search_case;
     std::string m_search_pattern;
     size_t m_last_known_search_result;
-    std::future<std::optional<size_t>> m_search_result;
-    std::stop_source m_search_stop;
-    WorkerThread m_search_worker;
+    // tagged with the generation of the contents it was computed against,
+    // so results that predate a truncation or rotation can be dropped
+    struct SearchResult {
+        std::optional<size_t> offset;
+        uint64_t generation;
+    };
+    struct NearestSearchResult {
+        std::optional<NearestHits> hits;
+        uint64_t generation;
+    };
+    // A stretch of the contents that a search has already found to have no
+    // hits for pattern, from begin up to after. before and after are hits
+    // themselves, or npos if there aren't any that way. Lets n and N inside
+    // it answer straight away.
+    struct SearchGap {
+        std::string pattern;
+        bool caseless;
+        uint64_t generation;
+        // the contents can grow past an after of npos
+        size_t size;
+        size_t before;
+        // just past before, or past the end of its line if it came from a
+        // backward search, which only finds the first hit on a line
+        size_t begin;
+        size_t after;
+    };
+    std::optional<SearchGap> m_search_gap;
+    // Searching as the pattern gets typed, while the / prompt is open.
+    struct IncrementalSearch {
+        // where the view was when the prompt opened, every keystroke
+        // searches on from here
+        size_t origin;
+        // put back if the prompt gets abandoned
+        std::string prev_pattern;
+        size_t prev_result;
+        bool prev_highlight_active;
+        // what was typed last, redisplays that don't change it are ignored
+        std::string typed;
+        // bumped every keystroke, so a search that's been overtaken keeps
+        // its result to itself
+        uint64_t serial = 0;
+        // every hit for pattern that starts in [origin, limit), if known.
+        // a literal that carries on from pattern can only match at one of
+        // them, so the next keystroke narrows these down instead of
+        // searching again.
+        bool known = false;
+        std::string pattern;
+        bool caseless = false;
+        uint64_t generation = 0;
+        std::vector<size_t> hits;
+        size_t limit = 0;
+    };
+    struct IncrementalResult {
+        // nullopt if it ran out of time
+        std::optional<size_t> first;
+        // the hits from first onwards it had time to find
+        std::vector<size_t> hits;
+        size_t limit;
+        uint64_t generation;
+    };
+    std::optional<IncrementalSearch> m_incremental;
+    // has to outlive the pool, jobs that are still running when it shuts
+    // down post their coroutines in here
+    Executor m_executor;
+    WorkerPool m_pool;
+    Worker m_search_worker;
+    // searches that haven't come back yet
+    TaskGroup m_search_tasks;
+    Worker m_index_worker;
+    // null until it's been loaded or built, and once the contents it was
+    // built from get replaced
+    std::shared_ptr<const TrigramIndex> m_index;
+    uint64_t m_index_generation;
+    Worker m_filter_worker;
+    // same as m_index, but covering less than the contents while it's
+    // catching up with them
+    std::shared_ptr<const TokenFilter> m_filter;
+    uint64_t m_filter_generation;
+    bool m_filter_extending;
+    Worker m_field_index_worker;
+    // same as m_filter, for one path at a time
+    std::shared_ptr<const FieldIndex> m_field_index;
+    uint64_t m_field_index_generation;
+    // the path it's being built or extended for, empty if it isn't
+    std::string m_field_index_pending;
+    // reads and jumps that move the view, a newer one supersedes them
+    TaskGroup m_view_tasks;
+    // ESC-c's count of m_search_pattern, which carries on until it's exact
+    // unless a new search or ^C stops it
+    Worker m_count_worker;
+    TaskGroup m_count_tasks;
+    // it counts this much at a time, in strata of neighbouring chunks
+    constexpr static size_t count_chunk_size = 256 * 1024;
+    constexpr static size_t count_num_strata = 64;
+    // ESC-m's minimap of where m_search_pattern matches, a screen row's
+    // share of the file to each row. worked out again whenever any of
+    // MinimapKey changes.
+    struct MinimapKey {
+        std::string pattern;
+        bool caseless;
+        size_t size;
+        size_t height;
+        bool operator==(MinimapKey const &) const = default;
+    };
+    struct Minimap {
+        MinimapKey key;
+        uint64_t generation;
+        MatchDensity density;
+    };
+    bool m_minimap_shown;
+    // the last one worked out, and the one being worked out now
+    std::optional<Minimap> m_minimap;
+    std::optional<MinimapKey> m_minimap_pending;
+    Worker m_minimap_worker;
+    TaskGroup m_minimap_tasks;
+    // for :t, which goes in m_view_tasks
+    Worker m_jump_worker;
+    // :w and :|, which carry on in the background until they're done or ^C
+    Worker m_export_worker;
+    TaskGroup m_export_tasks;
+    // ESC-p's, highlighted whatever's being searched for, each in a colour
+    // of its own
+    std::vector<PinnedPattern> m_pins;
+    // where ESC-n or ESC-N last went, the next one carries on from there
+    size_t m_last_pin_hit;
+    constexpr static size_t scroll_chunk_size = 4096;
+    // how often the status bar shows how a slow search is getting on. a
+    // search that's quicker than this never shows anything.
+    constexpr static std::chrono::milliseconds search_progress_interval{100};
+    // how long a keystroke's search gets before it's given up on, so the
+    // view keeps up with the typing. Enter still searches everything.
+    constexpr static std::chrono::milliseconds incremental_search_budget{50};
+    // how often --tee's stats in the status bar get updated
+    constexpr static std::chrono::milliseconds tee_stats_interval{500};
+    // how many hits past the first it collects for the next keystroke, and
+    // how far it looks for them
+    constexpr static size_t incremental_max_hits = 4096;
+    constexpr static size_t incremental_hit_window = 256 * 1024;
 
     std::string m_status_str_buffer;
     std::string m_command_str_buffer;
@@ -63,45 +262,95 @@ struct Main {
     std::optional<Command> prev_command;
 
     bool m_following_eof;
+    bool m_watching_content;
 
     size_t m_half_page_size;
     size_t m_page_size;
-    bool m_time_commands;
+    Options m_options;
+    bool m_quit;
+    // a REPLAY_SYNC came in and gets answered once everything settles
+    bool m_replay_sync_pending;
+
+    LatencyStats m_latency;
+    // commands that are done but whose effects haven't been painted yet
+    std::vector<std::pair<Command::Type,
+                          std::chrono::steady_clock::time_point>>
+        m_awaiting_paint;
 
     Main(ContentHandle *content_ptr, FILE *tty, std::string history_filename,
-         int history_maxsize, bool time_commands)
-        : m_content_handle(content_ptr),
-          m_view(View::create(&m_nc_mutex, m_content_handle.get(), tty)),
+         int history_maxsize, Options options)
+        : m_signal_fd(make_signal_fd()), m_content_handle(content_ptr),
+          m_view(View::create(&m_nc_mutex, m_content_handle.get(), tty,
+                              options.replay ? options.replay->m_screen
+                                             : stdout)),
           m_input(&m_nc_mutex, &m_chan, tty, std::move(history_filename),
-                  history_maxsize),
-          m_highlight_active(false), m_search_case(SearchCase::SENSITIVE),
-          m_search_pattern(), m_search_worker(), m_following_eof(false),
-          m_time_commands(time_commands) {
-        register_signal_handlers(&m_chan);
+                  history_maxsize, options.replay != nullptr),
+          m_highlight_active(false), m_page_dirty(false),
+          m_search_case(SearchCase::SENSITIVE),
+          m_search_pattern(), m_pool(),
+          m_search_worker(&m_pool, WorkerPool::Priority::INTERACTIVE),
+          m_index_worker(&m_pool, WorkerPool::Priority::BACKGROUND),
+          m_index_generation(0),
+          m_filter_worker(&m_pool, WorkerPool::Priority::BACKGROUND),
+          m_filter_generation(0), m_filter_extending(false),
+          m_field_index_worker(&m_pool, WorkerPool::Priority::BACKGROUND),
+          m_field_index_generation(0),
+          m_count_worker(&m_pool, WorkerPool::Priority::BACKGROUND),
+          m_minimap_shown(false),
+          m_minimap_worker(&m_pool, WorkerPool::Priority::BACKGROUND),
+          m_jump_worker(&m_pool, WorkerPool::Priority::INTERACTIVE),
+          m_export_worker(&m_pool, WorkerPool::Priority::BACKGROUND),
+          m_last_pin_hit(npos),
+          m_following_eof(false), m_watching_content(false),
+          m_options(std::move(options)), m_quit(false),
+          m_replay_sync_pending(false) {
+        m_loop.add(m_chan.get_fd(), COMMANDS_READY);
+        m_loop.add(m_executor.get_fd(), TASKS_READY);
+        m_loop.add(m_signal_fd, SIGNALLED);
 
         display_page();
+        flush_page();
         display_command_or_status();
 
         m_half_page_size = std::max((size_t)1, m_view.m_main_window_height / 2);
         m_page_size = std::max((size_t)1, m_view.m_main_window_height);
+
+        if (m_options.replay) {
+            m_options.replay->start();
+        }
+        if (!m_options.index_path.empty()) {
+            load_index();
+        }
+        if (m_options.token_filter) {
+            extend_filter();
+        }
     }
 
   public:
     Main(std::string path, FILE *tty, std::string history_filename,
-         int history_maxsize, bool time_commands)
+         int history_maxsize, Options options)
         : Main(new FileHandle(std::move(path)), tty, history_filename,
-               history_maxsize, time_commands) {
+               history_maxsize, std::move(options)) {
     }
 
     Main(int fd, FILE *tty, std::string history_filename, int history_maxsize,
-         bool time_commands)
-        : Main(new PipeHandle(fd), tty, history_filename, history_maxsize,
-               time_commands) {
+         Options options)
+        : Main(new PipeHandle(fd, options.tee_fd), tty, history_filename,
+               history_maxsize, std::move(options)) {
+        if (m_options.tee_fd != -1) {
+            m_tee = static_cast<PipeHandle *>(m_content_handle.get());
+            m_tee_timer_fd = make_timer_fd(tee_stats_interval);
+            m_loop.add(m_tee_timer_fd, TEE_STATS);
+        }
     }
 
     ~Main() {
         m_chan.close();
         m_file_task_stop_source.request_stop();
+        close(m_signal_fd);
+        if (m_tee_timer_fd != -1) {
+            close(m_tee_timer_fd);
+        }
     }
     Main(Main const &other) = delete;
     Main(Main &&other) = delete;
@@ -114,12 +363,95 @@ struct Main {
     void update_screen_highlight_offsets();
 
     void display_page();
+    void flush_page();
     void display_command_or_status();
 
     void run_search();
-    bool run_main();
     void run_follow_eof();
 
+    void wait_for_events();
+    void handle_search_result(SearchResult result);
+    // where n from start or N from end would go according to m_search_gap,
+    // nullopt if it doesn't cover them
+    std::optional<size_t> known_search_next(std::string_view pattern,
+                                            size_t start, bool caseless);
+    std::optional<size_t> known_search_prev(std::string_view pattern,
+                                            size_t end, bool caseless);
+    // regex_search_last spread over m_pool, for N
+    SearchFunction parallel_regex_search_last();
+    // backward if before came from a backward search
+    void remember_search_gap(std::string pattern, size_t before,
+                             size_t after, bool backward, bool caseless,
+                             uint64_t generation, size_t size);
+    Task show_search_progress(std::shared_ptr<SearchProgress> progress,
+                              std::stop_token stop);
+    void finish_search_progress(Command::Type type, SearchProgress &progress);
+    Task estimate_match_count();
+    Task show_match_count(std::shared_ptr<const MatchCounter> counter,
+                          std::stop_token stop);
+    // what the minimap shows right now, empty if it's off. starts working
+    // it out again if it's out of date.
+    std::span<const uint64_t> minimap_density();
+    Task map_matches(MinimapKey key);
+    // :t, to the first line at or after the time in text
+    Task jump_to_time(std::string text);
+    // :w and :|, the lines that match m_search_pattern, or everything if
+    // there isn't one, to a file or the stdin of a shell command
+    Task export_lines(std::string destination, bool to_command);
+    // ESC-n and ESC-N, to the next or previous match of any of m_pins or
+    // of the one the count picks
+    Task search_pins(Command command);
+    // every tee_stats_interval with --tee
+    void update_tee_stats();
+    void handle_signals();
+    void write_latency_report();
+    void handle_content_changed(uint32_t events);
+    Task handle_command(Command command);
+    Task scroll_view(size_t num_lines, bool down);
+    Task load_index();
+    Task search_incrementally(std::string pattern);
+    // requests stop on source once budget is up
+    Task stop_after(std::chrono::milliseconds budget, std::stop_source source);
+    Task extend_filter();
+    Task extend_field_index(FieldQuery query);
+    // the best index there is for searching the current contents for
+    // pattern, or null
+    std::shared_ptr<const BlockIndex> search_index(std::string_view pattern);
+
+    static int make_signal_fd() {
+        // SIGWINCH, SIGINT and SIGUSR1 get read off a signalfd in the main
+        // loop rather than interrupting whichever thread happens to get them
+        sigset_t mask;
+        sigemptyset(&mask);
+        sigaddset(&mask, SIGWINCH);
+        sigaddset(&mask, SIGINT);
+        sigaddset(&mask, SIGUSR1);
+        pthread_sigmask(SIG_BLOCK, &mask, NULL);
+        int fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+        if (fd == -1) {
+            fprintf(stderr, "Main: could not create signalfd. %s\n",
+                    strerror(errno));
+            exit(1);
+        }
+        return fd;
+    }
+
+    // readable every interval, for as long as it's open
+    static int make_timer_fd(std::chrono::milliseconds interval) {
+        int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+        if (fd == -1) {
+            fprintf(stderr, "Main: could not create timerfd. %s\n",
+                    strerror(errno));
+            exit(1);
+        }
+        struct timespec period = {
+            (time_t)(interval.count() / 1000),
+            (long)(interval.count() % 1000) * 1000000};
+        struct itimerspec spec = {period, period};
+        timerfd_settime(fd, 0, &spec, nullptr);
+        return fd;
+    }
+
     void set_command(std::string command, size_t cursor_pos) {
         m_command_str_buffer = std::move(command);
         m_command_cursor_pos = cursor_pos;
@@ -1,21 +1,87 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
 #include <fcntl.h>
 #include <filesystem>
+#include <poll.h>
 #include <stddef.h>
+#include <stdio.h>
 #include <string.h>
+#include <string>
 #include <string_view>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <thread>
 #include <unistd.h>
 #include <vector>
 
 #include "ContentHandle.h"
+#include "Export.h"
+#include "Trace.h"
+
+// How --tee is getting on with passing the input on.
+struct TeeStats {
+    uint64_t bytes;
+    uint64_t elapsed_ns;
+    // how long it had input to pass on but was waiting on the output,
+    // which is how long it held up whatever's writing to us
+    uint64_t stalled_ns;
+    bool input_done;
+    // whatever was reading the output went away. the input still gets kept.
+    bool output_closed;
+
+    // e.g. "tee: 1.2 GB at 850.0 MB/s, waiting on output 12% of the time"
+    std::string describe() const {
+        double seconds = (double)elapsed_ns / 1e9;
+        double mb = (double)bytes / 1e6;
+        char buf[128];
+        int len =
+            mb >= 1000
+                ? snprintf(buf, sizeof(buf), "tee: %.1f GB", mb / 1000)
+                : snprintf(buf, sizeof(buf), "tee: %.1f MB", mb);
+        if (seconds > 0 && (size_t)len < sizeof(buf)) {
+            snprintf(buf + len, sizeof(buf) - (size_t)len,
+                     " at %.1f MB/s, waiting on output %d%% of the time",
+                     mb / seconds,
+                     (int)(100 * (double)stalled_ns / (double)elapsed_ns));
+        }
+        std::string out = buf;
+        if (output_closed) {
+            out += ", output closed";
+        }
+        if (input_done) {
+            out += ", done";
+        }
+        return out;
+    }
+};
 
 class PipeHandle final : public ContentHandle {
     int m_pipe_fd; // the pipe file des
     int m_temp_fd; // the temp file des
 
+    // --tee's. a thread moves everything from the pipe into the temp file
+    // as soon as it comes in, having tee()'d it to m_tee_fd first, so
+    // passing it on never waits on anyone looking at it and it never comes
+    // through user space. read_more() then only has to map in what that's
+    // added. -1 without --tee.
+    int m_tee_fd = -1;
+    // as much as it'll try to move in one go, pipes permitting
+    constexpr static size_t pump_size = 1024 * 1024;
+    std::thread m_pump;
+    // readable whenever the pump has added to the temp file
+    int m_pumped_fd = -1;
+    // written to tell the pump to stop
+    int m_wake_fd = -1;
+    std::atomic<uint64_t> m_pumped{0};
+    std::atomic<uint64_t> m_stalled_ns{0};
+    std::atomic<bool> m_output_closed{false};
+    uint64_t m_start_ns = 0;
+    // set once the input has run out
+    std::atomic<uint64_t> m_end_ns{0};
+
   public:
     PipeHandle(PipeHandle const &other) = delete;
     PipeHandle &operator=(PipeHandle const &other) = delete;
@@ -23,11 +89,20 @@ class PipeHandle final : public ContentHandle {
     PipeHandle(PipeHandle &&other) = delete;
     PipeHandle &operator=(PipeHandle &&other) = delete;
     ~PipeHandle() {
+        if (m_pump.joinable()) {
+            uint64_t one = 1;
+            write(m_wake_fd, &one, sizeof(one));
+            m_pump.join();
+            close(m_wake_fd);
+            close(m_pumped_fd);
+        }
         close(m_pipe_fd);
         close(m_temp_fd);
     }
 
-    PipeHandle(int fd) : m_pipe_fd(fd) {
+    // with tee_fd, everything that comes in on fd goes out on that as well,
+    // and it gets closed once fd runs out
+    PipeHandle(int fd, int tee_fd = -1) : m_pipe_fd(fd) {
         // create a temp file
         char temp_filename[7] = "XXXXXX";
         int temp_fd = mkstemp(temp_filename);
@@ -39,13 +114,44 @@ class PipeHandle final : public ContentHandle {
 
         m_temp_fd = temp_fd;
 
+        if (tee_fd != -1) {
+            m_tee_fd = tee_fd;
+            m_pumped_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            m_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+            if (m_pumped_fd == -1 || m_wake_fd == -1) {
+                fprintf(stderr, "PipeHandle: could not create eventfd. %s\n",
+                        strerror(errno));
+                exit(1);
+            }
+            // fewer, bigger tees. it's fine if we're not allowed.
+            fcntl(m_pipe_fd, F_SETPIPE_SZ, (int)pump_size);
+            fcntl(m_tee_fd, F_SETPIPE_SZ, (int)pump_size);
+            // the pump polls it along with m_wake_fd instead of blocking
+            // on it, or quitting would wait on whatever's reading it
+            fcntl(m_tee_fd, F_SETFL, fcntl(m_tee_fd, F_GETFL) | O_NONBLOCK);
+            m_start_ns = tracing::now_ns();
+            m_pump = std::thread(&PipeHandle::pump, this);
+            return;
+        }
+
         // read some stuff if possible, just give up if not possible
         read_to_eof();
     }
 
+    bool is_teeing() const {
+        return m_pump.joinable();
+    }
+
+    TeeStats tee_stats() const {
+        uint64_t end_ns = m_end_ns.load(std::memory_order_acquire);
+        return {m_pumped.load(std::memory_order_relaxed),
+                (end_ns ? end_ns : tracing::now_ns()) - m_start_ns,
+                m_stalled_ns.load(std::memory_order_relaxed), end_ns != 0,
+                m_output_closed.load(std::memory_order_relaxed)};
+    }
+
   private:
-    ssize_t read_into_temp(std::shared_lock<std::shared_mutex> &lock,
-                           size_t num_to_read = 1 * 1024 * 1024 * 1024) {
+    ssize_t read_into_temp(size_t num_to_read = 1 * 1024 * 1024 * 1024) {
         // splice from m_pipe_fd into temp file
         ssize_t ret_val = splice(m_pipe_fd, NULL, m_temp_fd, NULL, num_to_read,
                                  SPLICE_F_NONBLOCK);
@@ -63,33 +169,170 @@ class PipeHandle final : public ContentHandle {
             exit(1);
         }
 
-        if (!lock.owns_lock()) {
-            lock.lock();
+        map_to(current_snapshot()->contents.size() + (size_t)ret_val);
+        return ret_val;
+    }
+
+    // publishes the first curr_file_size bytes of the temp file
+    void map_to(size_t curr_file_size) {
+        auto snapshot = current_snapshot();
+        TRACE_SPAN("content", "remap", curr_file_size);
+        if (snapshot->mapping) {
+            // grow in place so that older snapshots stay valid
+            Mapping &mapping = *snapshot->mapping;
+            if (mremap(mapping.m_ptr, mapping.m_size, curr_file_size, 0) !=
+                MAP_FAILED) {
+                mapping.m_size = curr_file_size;
+                publish(snapshot->mapping,
+                        {(char *)mapping.m_ptr, curr_file_size}, false);
+                return;
+            }
         }
-        size_t curr_file_size = m_contents.size() + (size_t)ret_val;
-        char *new_contents_ptr =
-            m_contents.data()
-                ? (char *)mremap((void *)m_contents.data(), m_contents.size(),
-                                 curr_file_size, MREMAP_MAYMOVE)
-                : (char *)mmap(NULL, curr_file_size, PROT_READ, MAP_PRIVATE,
-                               m_temp_fd, 0);
+
+        char *new_contents_ptr = (char *)mmap(NULL, curr_file_size, PROT_READ,
+                                              MAP_PRIVATE, m_temp_fd, 0);
         if ((void *)new_contents_ptr == MAP_FAILED) {
             // Map failed for some reason
-            fprintf(stderr, "mremap or mmap error. %s\n", strerror(errno));
+            fprintf(stderr, "mmap error. %s\n", strerror(errno));
             exit(1);
         }
-        m_contents = {new_contents_ptr, new_contents_ptr + curr_file_size};
+        publish(std::make_shared<Mapping>(new_contents_ptr, curr_file_size),
+                {new_contents_ptr, curr_file_size}, false);
+    }
 
-        return ret_val;
+    // blocks until fd has events, false if the destructor wants the pump
+    // to stop first
+    bool wait_for(int fd, short events) {
+        pollfd fds[2] = {{fd, events, 0}, {m_wake_fd, POLLIN, 0}};
+        while (poll(fds, 2, -1) == -1 && errno == EINTR) {
+        }
+        return fds[1].revents == 0;
+    }
+
+    void notify_pumped() {
+        uint64_t one = 1;
+        write(m_pumped_fd, &one, sizeof(one));
+    }
+
+    // --tee's thread
+    void pump() {
+        tracing::set_thread_name("tee");
+        struct stat statbuf;
+        bool to_pipe =
+            fstat(m_tee_fd, &statbuf) == 0 && S_ISFIFO(statbuf.st_mode);
+        bool forwarding = true;
+        uint64_t size = 0;
+        while (true) {
+            if (!wait_for(m_pipe_fd, POLLIN)) {
+                break;
+            }
+            ssize_t num_read;
+            if (forwarding && to_pipe) {
+                num_read =
+                    tee(m_pipe_fd, m_tee_fd, pump_size, SPLICE_F_NONBLOCK);
+                if (num_read == -1 && errno == EAGAIN) {
+                    // there's input, so it's the output that's full
+                    uint64_t stall_start = tracing::now_ns();
+                    bool woken = !wait_for(m_tee_fd, POLLOUT);
+                    m_stalled_ns.fetch_add(tracing::now_ns() - stall_start,
+                                           std::memory_order_relaxed);
+                    if (woken) {
+                        break;
+                    }
+                    continue;
+                }
+                if (num_read == -1 && errno != EINTR) {
+                    // EPIPE, most likely. what comes in still gets kept.
+                    forwarding = false;
+                    m_output_closed.store(true, std::memory_order_relaxed);
+                    continue;
+                }
+                // now take what was tee()'d, it's still in the pipe
+                for (ssize_t left = num_read; left > 0;) {
+                    ssize_t moved = splice(m_pipe_fd, NULL, m_temp_fd, NULL,
+                                           (size_t)left, 0);
+                    if (moved == 0) {
+                        // the input ran out before all of that, which
+                        // takes something else reading it too. keep
+                        // what did come, and it's the end next time round.
+                        num_read -= left;
+                        break;
+                    }
+                    if (moved == -1) {
+                        if (errno == EINTR) {
+                            continue;
+                        }
+                        fprintf(stderr, "PipeHandle error splicing. %s\n",
+                                strerror(errno));
+                        exit(1);
+                    }
+                    left -= moved;
+                }
+            } else {
+                num_read = splice(m_pipe_fd, NULL, m_temp_fd, NULL, pump_size,
+                                  SPLICE_F_NONBLOCK);
+                if (num_read > 0 && forwarding) {
+                    // tee() only goes into a pipe, anything else gets it
+                    // from the temp file instead
+                    uint64_t stall_start = tracing::now_ns();
+                    RangeWriter writer(m_temp_fd, m_tee_fd, {}, {},
+                                       m_wake_fd);
+                    bool woken = false;
+                    if (!writer.add(size, size + (size_t)num_read) ||
+                        !writer.flush()) {
+                        if (errno == ECANCELED) {
+                            // the destructor, while it waited on the output
+                            woken = true;
+                        } else {
+                            forwarding = false;
+                            m_output_closed.store(true,
+                                                  std::memory_order_relaxed);
+                        }
+                    }
+                    m_stalled_ns.fetch_add(tracing::now_ns() - stall_start,
+                                           std::memory_order_relaxed);
+                    if (woken) {
+                        break;
+                    }
+                }
+            }
+            if (num_read == -1) {
+                if (errno == EAGAIN || errno == EINTR) {
+                    continue;
+                }
+                fprintf(stderr, "PipeHandle error splicing. %s\n",
+                        strerror(errno));
+                exit(1);
+            }
+            if (num_read == 0) {
+                // no writers left, and nothing left from them
+                m_end_ns.store(tracing::now_ns(), std::memory_order_release);
+                notify_pumped();
+                break;
+            }
+            size += (uint64_t)num_read;
+            m_pumped.store(size, std::memory_order_release);
+            notify_pumped();
+        }
+        // whatever's reading it has had everything it's going to get
+        close(m_tee_fd);
     }
 
   public:
     bool read_more() final {
-        std::shared_lock<std::shared_mutex> lock(m_mutex, std::defer_lock);
+        std::scoped_lock lock(m_mutex);
+        if (is_teeing()) {
+            size_t pumped = m_pumped.load(std::memory_order_acquire);
+            if (pumped == current_snapshot()->contents.size()) {
+                return false;
+            }
+            map_to(pumped);
+            return true;
+        }
         ssize_t total_read = 0;
         ssize_t num_read = 0;
         do {
-            num_read = read_into_temp(lock);
+            num_read = read_into_temp();
             total_read += num_read;
         } while (num_read != 0);
         return total_read != 0;
@@ -103,7 +346,14 @@ class PipeHandle final : public ContentHandle {
         return "";
     }
 
+    int dup_content_fd() const final {
+        return fcntl(m_temp_fd, F_DUPFD_CLOEXEC, 0);
+    }
+
     bool has_changed() const final {
+        if (is_teeing()) {
+            return m_pumped.load(std::memory_order_acquire) != size();
+        }
         int result = 0;
         if (ioctl(m_pipe_fd, FIONREAD, &result) == -1) {
             fprintf(stderr, "PipeHandle: ioctl error %s\n", strerror(errno));
@@ -112,4 +362,17 @@ class PipeHandle final : public ContentHandle {
 
         return result != 0;
     }
+
+    int get_notify_fd() const final {
+        return is_teeing() ? m_pumped_fd : m_pipe_fd;
+    }
+
+    bool consume_notifications() final {
+        if (is_teeing()) {
+            uint64_t count;
+            read(m_pumped_fd, &count, sizeof(count));
+        }
+        // the pipe stays readable until read_more() drains it
+        return true;
+    }
 };
@@ -0,0 +1,291 @@
+#pragma once
+
+#include <chrono>
+#include <errno.h>
+#include <fstream>
+#include <semaphore>
+#include <sstream>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+// Drives the whole thing from a script instead of a person, so View, Page,
+// Main and search can be timed end to end without a terminal. Keystrokes go
+// down a pipe that InputThread reads in place of the tty, and ncurses draws
+// into its own virtual screen with the output thrown away.
+//
+// Scripts are line based:
+//
+//     # comment
+//     size 50 200          screen rows and columns, has to come first
+//     step NAME            starts a step
+//     keys TEXT            types TEXT, with \r \n \t \e \\ and \xNN escapes
+//     sleep MS
+//     hold KEY MS EVERY    types KEY every EVERY ms for MS ms
+//
+// At the end of each step the driver waits for Main to go idle: every
+// command handled, every search back and the page painted. What gets
+// reported per step is the time from its first keystroke to that point, the
+// time from its last keystroke to that point, and a checksum of what ended
+// up on the screen.
+struct ReplayDriver {
+    // ^\, which nothing else is bound to. InputThread only turns it into
+    // a REPLAY_SYNC while replaying.
+    constexpr static char sync_key = '\x1c';
+
+    struct Action {
+        enum Type {
+            KEYS,
+            SLEEP,
+            HOLD,
+        };
+        Type type;
+        std::string keys;
+        std::chrono::milliseconds duration;
+        std::chrono::milliseconds interval;
+    };
+    struct Step {
+        std::string name;
+        std::vector<Action> actions;
+    };
+    struct StepResult {
+        std::string name;
+        std::chrono::nanoseconds latency;
+        // just the part after the last keystroke, which is what matters
+        // for steps that hold a key down
+        std::chrono::nanoseconds settle;
+        uint64_t checksum;
+    };
+
+    std::string m_script_path;
+    std::vector<Step> m_steps;
+    int m_pipe_fds[2];
+    // the read end, for InputThread and ncurses to treat as the tty
+    FILE *m_tty;
+    // where ncurses' output goes
+    FILE *m_screen;
+
+    // the first step is timed from here, so it covers opening the file
+    std::chrono::steady_clock::time_point m_created;
+    std::binary_semaphore m_synced;
+    uint64_t m_last_checksum;
+    std::vector<StepResult> m_results;
+    std::thread m_thread;
+
+    explicit ReplayDriver(std::string script_path)
+        : m_script_path(std::move(script_path)),
+          m_created(std::chrono::steady_clock::now()), m_synced(0),
+          m_last_checksum(0) {
+        parse();
+        if (pipe(m_pipe_fds) == -1) {
+            fprintf(stderr, "ReplayDriver: could not create pipe. %s\n",
+                    strerror(errno));
+            exit(1);
+        }
+        m_tty = fdopen(m_pipe_fds[0], "r");
+        m_screen = fopen("/dev/null", "w");
+        if (!getenv("TERM")) {
+            setenv("TERM", "xterm", 1);
+        }
+    }
+    ReplayDriver(ReplayDriver const &) = delete;
+    ReplayDriver &operator=(ReplayDriver const &) = delete;
+    ReplayDriver(ReplayDriver &&) = delete;
+    ReplayDriver &operator=(ReplayDriver &&) = delete;
+    ~ReplayDriver() {
+        if (m_thread.joinable()) {
+            m_thread.join();
+        }
+        close(m_pipe_fds[1]);
+        fclose(m_tty);
+        fclose(m_screen);
+    }
+
+    // Starts typing. Call once the signal mask is set up, so the driver
+    // thread inherits it.
+    void start() {
+        m_thread = std::thread(&ReplayDriver::run, this);
+    }
+
+    // Called from the main thread once it's idle after a sync_key.
+    void synced(uint64_t checksum) {
+        m_last_checksum = checksum;
+        m_synced.release();
+    }
+
+  private:
+    [[noreturn]] void parse_error(size_t line_num, std::string const &line) {
+        fprintf(stderr, "%s:%zu: can't parse '%s'\n", m_script_path.c_str(),
+                line_num, line.c_str());
+        exit(1);
+    }
+
+    void parse() {
+        std::ifstream script(m_script_path);
+        if (!script) {
+            fprintf(stderr, "%s: %s\n", m_script_path.c_str(),
+                    strerror(errno));
+            exit(1);
+        }
+        std::string line;
+        size_t line_num = 0;
+        while (std::getline(script, line)) {
+            ++line_num;
+            std::istringstream words(line);
+            std::string directive;
+            if (!(words >> directive) || directive[0] == '#') {
+                continue;
+            }
+            if (directive == "size") {
+                std::string rows, cols;
+                if (!(words >> rows >> cols) || !m_steps.empty()) {
+                    parse_error(line_num, line);
+                }
+                // ncurses falls back to these when it can't ask the terminal
+                setenv("LINES", rows.c_str(), 1);
+                setenv("COLUMNS", cols.c_str(), 1);
+                continue;
+            }
+            if (directive == "step") {
+                std::string name;
+                std::getline(words >> std::ws, name);
+                m_steps.push_back({name, {}});
+                continue;
+            }
+            if (m_steps.empty()) {
+                parse_error(line_num, line);
+            }
+            Action action{Action::KEYS, "", {}, {}};
+            if (directive == "keys") {
+                std::string text;
+                std::getline(words >> std::ws, text);
+                action.keys = unescape(text);
+            } else if (directive == "sleep") {
+                long ms;
+                if (!(words >> ms)) {
+                    parse_error(line_num, line);
+                }
+                action.type = Action::SLEEP;
+                action.duration = std::chrono::milliseconds(ms);
+            } else if (directive == "hold") {
+                std::string key;
+                long ms, every_ms;
+                if (!(words >> key >> ms >> every_ms) || every_ms <= 0) {
+                    parse_error(line_num, line);
+                }
+                action.type = Action::HOLD;
+                action.keys = unescape(key);
+                action.duration = std::chrono::milliseconds(ms);
+                action.interval = std::chrono::milliseconds(every_ms);
+            } else {
+                parse_error(line_num, line);
+            }
+            m_steps.back().actions.push_back(std::move(action));
+        }
+    }
+
+    static std::string unescape(std::string_view text) {
+        std::string out;
+        for (size_t i = 0; i < text.size(); ++i) {
+            if (text[i] != '\\' || i + 1 == text.size()) {
+                out.push_back(text[i]);
+                continue;
+            }
+            char c = text[++i];
+            switch (c) {
+            case 'r':
+                out.push_back('\r');
+                break;
+            case 'n':
+                out.push_back('\n');
+                break;
+            case 't':
+                out.push_back('\t');
+                break;
+            case 'e':
+                out.push_back('\x1b');
+                break;
+            case 'x':
+                if (i + 2 < text.size()) {
+                    out.push_back((char)strtol(
+                        std::string(text.substr(i + 1, 2)).c_str(), nullptr,
+                        16));
+                    i += 2;
+                }
+                break;
+            default:
+                out.push_back(c);
+                break;
+            }
+        }
+        return out;
+    }
+
+    void type(std::string_view keys) {
+        while (!keys.empty()) {
+            ssize_t written = write(m_pipe_fds[1], keys.data(), keys.size());
+            if (written == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                // nobody's reading any more
+                return;
+            }
+            keys.remove_prefix((size_t)written);
+        }
+    }
+
+    void run() {
+        for (Step const &step : m_steps) {
+            auto start = m_results.empty() ? m_created
+                                           : std::chrono::steady_clock::now();
+            for (Action const &action : step.actions) {
+                switch (action.type) {
+                case Action::KEYS:
+                    type(action.keys);
+                    break;
+                case Action::SLEEP:
+                    std::this_thread::sleep_for(action.duration);
+                    break;
+                case Action::HOLD: {
+                    auto until = std::chrono::steady_clock::now() +
+                                 action.duration;
+                    while (std::chrono::steady_clock::now() < until) {
+                        type(action.keys);
+                        std::this_thread::sleep_for(action.interval);
+                    }
+                    break;
+                }
+                }
+            }
+            auto typed = std::chrono::steady_clock::now();
+            type(std::string_view(&sync_key, 1));
+            m_synced.acquire();
+            auto end = std::chrono::steady_clock::now();
+            m_results.push_back(
+                {step.name, end - start, end - typed, m_last_checksum});
+        }
+        report();
+        type("q");
+    }
+
+    void report() {
+        // ncurses is drawing into /dev/null, so stdout is all ours
+        printf("{\"script\": \"%s\", \"steps\": [", m_script_path.c_str());
+        for (size_t i = 0; i < m_results.size(); ++i) {
+            StepResult const &result = m_results[i];
+            printf("%s\n  {\"name\": \"%s\", \"latency_ns\": %ld, "
+                   "\"settle_ns\": %ld, \"screen_checksum\": \"%016lx\"}",
+                   i == 0 ? "" : ",", result.name.c_str(),
+                   (long)result.latency.count(), (long)result.settle.count(),
+                   result.checksum);
+        }
+        printf("\n]}\n");
+        fflush(stdout);
+    }
+};
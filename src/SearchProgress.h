@@ -0,0 +1,183 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+
+// How far along a search job is. The search kernels publish into whichever
+// one the job running on their thread has set up with a Scope, and the main
+// thread polls it for the status bar. The job's threads only ever add to
+// the counters or overwrite m_offset, so everything is relaxed.
+struct SearchProgress {
+    using Clock = std::chrono::steady_clock;
+
+    // the range being searched, for working out the percentage
+    size_t m_begin;
+    size_t m_end;
+    Clock::time_point m_start;
+
+    std::atomic<uint64_t> m_bytes_scanned{0};
+    // ruled out by the trigram index without being looked at
+    std::atomic<uint64_t> m_bytes_skipped{0};
+    // where the kernel got up to, in either direction
+    std::atomic<uint64_t> m_offset;
+    std::atomic<uint64_t> m_matches{0};
+    std::atomic<uint64_t> m_chunks{0};
+    std::atomic<uint64_t> m_regex_calls{0};
+    // when stop was requested and when the kernel noticed, in nanoseconds
+    // since m_start. 0 if it never was.
+    std::atomic<uint64_t> m_stop_requested_ns{0};
+    std::atomic<uint64_t> m_stopped_ns{0};
+    // the PCRE2 error a regex gave up with part way, e.g. on running into
+    // its heap limit, 0 if none did. the kernel returns nullopt as though
+    // it had been stopped, this is what tells the two apart.
+    std::atomic<int> m_regex_error{0};
+
+    // only touched by the main thread, true once it's been put in the
+    // status bar
+    bool m_shown = false;
+    // also the main thread's, for what it already knows, e.g. "match above"
+    std::string m_note;
+
+    SearchProgress(size_t begin, size_t end)
+        : m_begin(begin), m_end(end), m_start(Clock::now()), m_offset(begin) {
+    }
+    SearchProgress(SearchProgress const &) = delete;
+    SearchProgress &operator=(SearchProgress const &) = delete;
+
+    // Makes progress on this thread go into progress until it's destroyed.
+    struct Scope {
+        SearchProgress *m_prev;
+        explicit Scope(SearchProgress *progress) : m_prev(t_current) {
+            t_current = progress;
+        }
+        Scope(Scope const &) = delete;
+        Scope &operator=(Scope const &) = delete;
+        ~Scope() {
+            t_current = m_prev;
+        }
+    };
+
+    // nullptr unless the current thread is inside a Scope
+    static SearchProgress *current() {
+        return t_current;
+    }
+
+    // for the kernels, each is a no-op outside of a Scope
+    static void scanned(size_t chunk_start, size_t chunk_end, size_t offset) {
+        if (SearchProgress *progress = t_current) {
+            progress->m_bytes_scanned.fetch_add(chunk_end - chunk_start,
+                                                std::memory_order_relaxed);
+            progress->m_offset.store(offset, std::memory_order_relaxed);
+            progress->m_chunks.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    static void skipped(size_t bytes) {
+        if (SearchProgress *progress = t_current) {
+            progress->m_bytes_skipped.fetch_add(bytes,
+                                                std::memory_order_relaxed);
+        }
+    }
+    static void found() {
+        if (SearchProgress *progress = t_current) {
+            progress->m_matches.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    static void regex_called() {
+        if (SearchProgress *progress = t_current) {
+            progress->m_regex_calls.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+    static void stopped() {
+        if (SearchProgress *progress = t_current) {
+            progress->m_stopped_ns.store(progress->elapsed_ns(),
+                                         std::memory_order_relaxed);
+        }
+    }
+
+    static void gave_up(int regex_error) {
+        if (SearchProgress *progress = t_current) {
+            progress->m_regex_error.store(regex_error,
+                                          std::memory_order_relaxed);
+        }
+    }
+
+    // thread safe, for a stop_callback on the job's token
+    void stop_requested() {
+        uint64_t expected = 0;
+        m_stop_requested_ns.compare_exchange_strong(
+            expected, elapsed_ns(), std::memory_order_relaxed);
+    }
+
+    uint64_t elapsed_ns() const {
+        // never 0, that means unset
+        return std::max(
+            (uint64_t)1,
+            (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                Clock::now() - m_start)
+                .count());
+    }
+
+    // e.g. "Searching... 42% 3.1 GB/s ETA 2s, 12 matches"
+    std::string describe() const {
+        uint64_t total = m_end - m_begin;
+        uint64_t scanned = std::min(
+            m_bytes_scanned.load(std::memory_order_relaxed), total);
+        // skipped bytes count towards how far along it is, but not how fast
+        uint64_t done = std::min(
+            scanned + m_bytes_skipped.load(std::memory_order_relaxed), total);
+        double seconds = (double)elapsed_ns() / 1e9;
+        double bytes_per_second = (double)scanned / seconds;
+        char buf[128];
+        int len = snprintf(buf, sizeof(buf), "Searching... %d%% %.1f GB/s",
+                           total ? (int)(100 * done / total) : 100,
+                           bytes_per_second / 1e9);
+        if (scanned > 0 && (size_t)len < sizeof(buf)) {
+            len += snprintf(buf + len, sizeof(buf) - (size_t)len,
+                            " ETA %.0fs",
+                            (double)(total - done) / bytes_per_second);
+        }
+        uint64_t matches = m_matches.load(std::memory_order_relaxed);
+        if (matches > 0 && (size_t)len < sizeof(buf)) {
+            snprintf(buf + len, sizeof(buf) - (size_t)len, ", %lu matches",
+                     matches);
+        }
+        if (!m_note.empty()) {
+            return buf + (", " + m_note);
+        }
+        return buf;
+    }
+
+    // one line of --search-stats
+    void write_stats(FILE *f, const char *command_name) const {
+        uint64_t stop_requested_ns =
+            m_stop_requested_ns.load(std::memory_order_relaxed);
+        uint64_t stopped_ns = m_stopped_ns.load(std::memory_order_relaxed);
+        uint64_t skipped = m_bytes_skipped.load(std::memory_order_relaxed);
+        fprintf(f,
+                "Search stats for %s: %lu bytes scanned, %lu chunks, %lu "
+                "regex calls, %lu matches in %lu ns",
+                command_name, m_bytes_scanned.load(std::memory_order_relaxed),
+                m_chunks.load(std::memory_order_relaxed),
+                m_regex_calls.load(std::memory_order_relaxed),
+                m_matches.load(std::memory_order_relaxed), elapsed_ns());
+        if (skipped != 0) {
+            fprintf(f, ", %lu bytes skipped by the index", skipped);
+        }
+        if (m_regex_error.load(std::memory_order_relaxed) != 0) {
+            fprintf(f, ", gave up");
+        }
+        if (stop_requested_ns != 0 && stopped_ns >= stop_requested_ns) {
+            fprintf(f, ", cancelled after %lu ns",
+                    stopped_ns - stop_requested_ns);
+        }
+        fprintf(f, "\n");
+    }
+
+  private:
+    inline static thread_local SearchProgress *t_current = nullptr;
+};
@@ -0,0 +1,313 @@
+#pragma once
+
+#include <chrono>
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <optional>
+#include <stdint.h>
+#include <stop_token>
+#include <sys/timerfd.h>
+#include <type_traits>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#include "Channel.h"
+#include "EventLoop.h"
+#include "Worker.h"
+
+// A fire-and-forget coroutine. It runs synchronously up to its first
+// co_await, and after that gets resumed by an Executor on the main thread.
+struct Task {
+    // coroutines that haven't finished yet. they're only ever created and
+    // resumed on the main thread.
+    inline static size_t num_outstanding = 0;
+
+    struct promise_type {
+        promise_type() {
+            ++num_outstanding;
+        }
+        ~promise_type() {
+            --num_outstanding;
+        }
+        Task get_return_object() {
+            return {};
+        }
+        std::suspend_never initial_suspend() noexcept {
+            return {};
+        }
+        std::suspend_never final_suspend() noexcept {
+            return {};
+        }
+        void return_void() {
+        }
+        void unhandled_exception() {
+            std::terminate();
+        }
+    };
+};
+
+// Outstanding operations that can be cancelled together. Awaiting on an
+// Executor with a group's token means cancelling the group wakes the
+// coroutine up early.
+struct TaskGroup {
+    std::stop_source m_source;
+
+    std::stop_token token() const {
+        return m_source.get_token();
+    }
+
+    void cancel() {
+        m_source.request_stop();
+        m_source = std::stop_source();
+    }
+};
+
+// Resumes coroutines on the thread that calls run_ready(). Everything it's
+// waiting on sits behind a single epoll fd, so the main loop can wait on
+// get_fd() along with its own fds.
+struct Executor {
+    using Clock = std::chrono::steady_clock;
+
+    struct Waiter {
+        std::coroutine_handle<> handle;
+        int fd;
+        std::optional<Clock::time_point> deadline;
+        // true if fd became readable, false if it timed out or got cancelled
+        bool ready;
+        bool done;
+    };
+
+    enum EventId : uint64_t {
+        RESUME_READY,
+        TIMER_EXPIRED,
+        // fd waits use FD_READY + fd
+        FD_READY,
+    };
+
+    // coroutines that are ready to be resumed, posted from any thread
+    Channel<std::coroutine_handle<>> m_ready;
+    EventLoop m_loop;
+    std::vector<EventLoop::Event> m_events;
+    int m_timer_fd;
+
+    // any number of them to an fd, which is in m_loop while there are
+    std::multimap<int, Waiter *> m_fd_waiters;
+    std::multimap<Clock::time_point, Waiter *> m_timers;
+
+    Executor() : m_timer_fd(timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC)) {
+        if (m_timer_fd == -1) {
+            fprintf(stderr, "Executor: could not create timerfd. %s\n",
+                    strerror(errno));
+            exit(1);
+        }
+        m_loop.add(m_ready.get_fd(), RESUME_READY);
+        m_loop.add(m_timer_fd, TIMER_EXPIRED);
+    }
+    Executor(Executor const &) = delete;
+    Executor &operator=(Executor const &) = delete;
+    Executor(Executor &&) = delete;
+    Executor &operator=(Executor &&) = delete;
+    ~Executor() {
+        close(m_timer_fd);
+    }
+
+    // polls readable whenever run_ready() has something to do
+    int get_fd() const {
+        return m_loop.m_epoll_fd;
+    }
+
+    // thread safe
+    void post(std::coroutine_handle<> handle) {
+        m_ready.push(handle);
+    }
+
+    // Resumes everything that's ready without blocking.
+    void run_ready() {
+        m_loop.wait(m_events, 0);
+        for (auto [id, events] : m_events) {
+            if (id == RESUME_READY) {
+                m_ready.clear_fd();
+            } else if (id == TIMER_EXPIRED) {
+                uint64_t expirations;
+                read(m_timer_fd, &expirations, sizeof(expirations));
+                auto now = Clock::now();
+                while (!m_timers.empty() && m_timers.begin()->first <= now) {
+                    finish(m_timers.begin()->second, false);
+                }
+                arm_timer();
+            } else {
+                // all of them, finish() takes each one out
+                int fd = (int)(id - FD_READY);
+                auto it = m_fd_waiters.find(fd);
+                while (it != m_fd_waiters.end()) {
+                    finish(it->second, true);
+                    it = m_fd_waiters.find(fd);
+                }
+            }
+        }
+        // finish() only posts, so all the resuming happens here, after the
+        // bookkeeping is done
+        std::vector<std::coroutine_handle<>> ready;
+        m_ready.pop_all(ready);
+        for (std::coroutine_handle<> handle : ready) {
+            handle.resume();
+        }
+    }
+
+    // co_await executor.yield() lets the main loop render and handle input
+    // before carrying on
+    auto yield() {
+        struct Awaiter {
+            Executor *executor;
+            bool await_ready() {
+                return false;
+            }
+            void await_suspend(std::coroutine_handle<> handle) {
+                executor->post(handle);
+            }
+            void await_resume() {
+            }
+        };
+        return Awaiter{this};
+    }
+
+    // co_await executor.readable(fd, timeout, stop) is true once fd polls
+    // readable, or false if the timeout passes or stop is requested first
+    auto readable(int fd, Clock::duration timeout, std::stop_token stop) {
+        struct Awaiter {
+            Executor *executor;
+            std::stop_token stop;
+            Waiter waiter;
+            std::optional<std::stop_callback<std::function<void()>>> on_stop;
+
+            bool await_ready() {
+                return stop.stop_requested();
+            }
+            void await_suspend(std::coroutine_handle<> handle) {
+                waiter.handle = handle;
+                executor->add_waiter(&waiter);
+                on_stop.emplace(stop, [this]() {
+                    executor->finish(&waiter, false);
+                });
+            }
+            bool await_resume() {
+                return waiter.ready;
+            }
+        };
+        return Awaiter{
+            this, std::move(stop),
+            Waiter{nullptr, fd, Clock::now() + timeout, false, false}, {}};
+    }
+
+    // co_await executor.sleep(duration, stop) resumes once duration has
+    // passed, or sooner if stop is requested
+    auto sleep(Clock::duration duration, std::stop_token stop) {
+        return readable(-1, duration, std::move(stop));
+    }
+
+    // co_await executor.run(worker, f, stop) runs f(std::stop_token) as a
+    // job on worker and evaluates to its result. Requesting stop on the
+    // token passes the request on to the job.
+    template <typename Function>
+    auto run(Worker &worker, Function f, std::stop_token stop) {
+        using Result = std::invoke_result_t<Function, std::stop_token>;
+        struct Awaiter {
+            Executor *executor;
+            Worker *worker;
+            Function f;
+            std::stop_token stop;
+            std::shared_ptr<std::optional<Result>> result;
+            std::stop_source job_stop;
+            std::optional<std::stop_callback<std::function<void()>>> on_stop;
+
+            bool await_ready() {
+                return false;
+            }
+            void await_suspend(std::coroutine_handle<> handle) {
+                std::future<void> job_done;
+                std::tie(job_done, job_stop) = worker->spawn(
+                    [f = std::move(f), result = result, executor = executor,
+                     handle](std::stop_token job_token) mutable {
+                        *result = f(job_token);
+                        executor->post(handle);
+                    });
+                on_stop.emplace(stop, [job_stop = job_stop]() mutable {
+                    job_stop.request_stop();
+                });
+            }
+            Result await_resume() {
+                return std::move(**result);
+            }
+        };
+        return Awaiter{this,
+                       &worker,
+                       std::move(f),
+                       std::move(stop),
+                       std::make_shared<std::optional<Result>>(),
+                       {},
+                       {}};
+    }
+
+  private:
+    void add_waiter(Waiter *waiter) {
+        if (waiter->fd != -1) {
+            if (!m_fd_waiters.contains(waiter->fd)) {
+                m_loop.add(waiter->fd, FD_READY + (uint64_t)waiter->fd);
+            }
+            m_fd_waiters.insert({waiter->fd, waiter});
+        }
+        if (waiter->deadline) {
+            m_timers.insert({*waiter->deadline, waiter});
+            arm_timer();
+        }
+    }
+
+    // unregisters the waiter and schedules its coroutine to be resumed
+    void finish(Waiter *waiter, bool ready) {
+        if (waiter->done) {
+            return;
+        }
+        waiter->done = true;
+        waiter->ready = ready;
+        if (waiter->fd != -1) {
+            auto [begin, end] = m_fd_waiters.equal_range(waiter->fd);
+            for (auto it = begin; it != end; ++it) {
+                if (it->second == waiter) {
+                    m_fd_waiters.erase(it);
+                    break;
+                }
+            }
+            if (!m_fd_waiters.contains(waiter->fd)) {
+                m_loop.remove(waiter->fd);
+            }
+        }
+        if (waiter->deadline) {
+            auto [begin, end] = m_timers.equal_range(*waiter->deadline);
+            for (auto it = begin; it != end; ++it) {
+                if (it->second == waiter) {
+                    m_timers.erase(it);
+                    break;
+                }
+            }
+        }
+        post(waiter->handle);
+    }
+
+    void arm_timer() {
+        struct itimerspec spec = {};
+        if (!m_timers.empty()) {
+            auto until = m_timers.begin()->first - Clock::now();
+            // zero would disarm it, so round up to something that fires
+            auto ns = std::max(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(until),
+                std::chrono::nanoseconds{1});
+            spec.it_value.tv_sec = (time_t)(ns.count() / 1'000'000'000);
+            spec.it_value.tv_nsec = (long)(ns.count() % 1'000'000'000);
+        }
+        timerfd_settime(m_timer_fd, 0, &spec, NULL);
+    }
+};
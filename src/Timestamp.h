@@ -0,0 +1,372 @@
+#pragma once
+
+#include <algorithm>
+#include <cctype>
+#include <iterator>
+#include <optional>
+#include <stddef.h>
+#include <stdint.h>
+#include <string_view>
+
+// Times at the start of log lines, as milliseconds since the epoch. Time
+// zones are ignored, everything is taken to be UTC, which is fine for
+// comparing a log's times with each other.
+struct TimestampFormat {
+    enum Kind {
+        // 2026-10-16T03:14:15.926, or with a space instead of the T
+        ISO8601,
+        // Oct 16 03:14:15, which has no year, they all go in 1970
+        SYSLOG,
+        // [16/Oct/2026:03:14:15 +0000], Apache and nginx access logs
+        COMMON_LOG,
+        // 1792120455 or 1792120455926
+        EPOCH,
+    };
+    constexpr static Kind kinds[] = {ISO8601, SYSLOG, COMMON_LOG, EPOCH};
+
+    Kind m_kind;
+
+    // how far into a line the timestamp can start, there's often a level or
+    // an address in front of it
+    constexpr static size_t max_prefix = 64;
+    // lines sampled from the start and from all over, for detect()
+    constexpr static size_t num_samples = 64;
+
+    // The kind of timestamp most of a sample of lines start with, nullopt
+    // if it's fewer than half of them. Only looks at a few pages.
+    static std::optional<TimestampFormat> detect(std::string_view contents) {
+        size_t parsed[std::size(kinds)] = {};
+        size_t num_lines = 0;
+        auto sample = [&](size_t line_start) {
+            std::string_view line = line_at(contents, line_start);
+            if (line.empty()) {
+                return;
+            }
+            ++num_lines;
+            for (size_t i = 0; i < std::size(kinds); ++i) {
+                parsed[i] += TimestampFormat{kinds[i]}.parse_line(line)
+                                 .has_value();
+            }
+        };
+        size_t pos = 0;
+        for (size_t i = 0; i < num_samples / 2 && pos < contents.size();
+             ++i) {
+            sample(pos);
+            pos = next_line(contents, pos);
+        }
+        for (size_t i = 0; i < num_samples / 2; ++i) {
+            size_t offset = contents.size() * i / (num_samples / 2);
+            sample(next_line(contents, offset));
+        }
+        size_t best = (size_t)(std::max_element(std::begin(parsed),
+                                                std::end(parsed)) -
+                               std::begin(parsed));
+        if (num_lines == 0 || parsed[best] * 2 < num_lines) {
+            return std::nullopt;
+        }
+        return TimestampFormat{kinds[best]};
+    }
+
+    // nullopt if there isn't one of these near the start of line
+    std::optional<int64_t> parse_line(std::string_view line) const {
+        for (size_t i = 0; i < std::min(line.size(), max_prefix); ++i) {
+            // only at the start of a word or a number
+            if (i > 0 && isalnum((unsigned char)line[i - 1])) {
+                continue;
+            }
+            if (std::optional<Civil> civil = parse(m_kind, line.substr(i))) {
+                return civil->ms();
+            }
+        }
+        return std::nullopt;
+    }
+
+    // What someone typed after :t, in any of the kinds, with whatever's
+    // left off the end taken as 0. A year gets ignored if these timestamps
+    // don't have one.
+    std::optional<int64_t> parse_query(std::string_view text) const {
+        while (!text.empty() && text.front() == ' ') {
+            text.remove_prefix(1);
+        }
+        for (Kind kind : kinds) {
+            std::optional<Civil> civil = parse(kind, text, true);
+            if (!civil) {
+                continue;
+            }
+            if (m_kind == SYSLOG) {
+                civil->year = 1970;
+            }
+            return civil->ms();
+        }
+        return std::nullopt;
+    }
+
+    // The start of the first line at or after time, for contents that are
+    // in time order. Binary search over the bytes, looking at the first
+    // line with a timestamp after each midpoint, so it touches a few pages
+    // per halving however big the contents are, unless there's a long run
+    // of lines without one. Those, like the rest of a stack trace, go with
+    // the line before them.
+    size_t bisect(std::string_view contents, int64_t time) const {
+        // every line with a timestamp that starts before lo is earlier than
+        // time, and every one that starts at or after hi is at or after it.
+        // the first of those is at found, which is where hi was last moved
+        // to a line.
+        size_t lo = 0;
+        size_t hi = contents.size();
+        size_t found = contents.size();
+        constexpr size_t scan_size = 64 * 1024;
+        while (hi - lo > scan_size) {
+            size_t mid = lo + (hi - lo) / 2;
+            // the first line that starts at or after mid
+            size_t line_start = next_line(contents, mid - 1);
+            std::optional<int64_t> line_time;
+            while (line_start < hi) {
+                line_time = parse_line(line_at(contents, line_start));
+                if (line_time) {
+                    break;
+                }
+                line_start = next_line(contents, line_start);
+            }
+            if (!line_time) {
+                // nothing with a timestamp from the middle up to hi, so
+                // what's in the top half can't be it either
+                hi = mid;
+            } else if (*line_time < time) {
+                lo = next_line(contents, line_start);
+            } else {
+                hi = found = line_start;
+            }
+        }
+        // whatever's left is small enough to go through a line at a time
+        for (size_t line_start = lo; line_start < hi;
+             line_start = next_line(contents, line_start)) {
+            std::optional<int64_t> line_time =
+                parse_line(line_at(contents, line_start));
+            if (line_time && *line_time >= time) {
+                return line_start;
+            }
+        }
+        return found;
+    }
+
+  private:
+    struct Civil {
+        int64_t year = 1970;
+        int64_t month = 1;
+        int64_t day = 1;
+        int64_t hour = 0;
+        int64_t minute = 0;
+        int64_t second = 0;
+        int64_t millisecond = 0;
+
+        // Howard Hinnant's days_from_civil()
+        int64_t ms() const {
+            int64_t y = year - (month <= 2);
+            int64_t era = (y >= 0 ? y : y - 399) / 400;
+            int64_t yoe = y - era * 400;
+            int64_t doy =
+                (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+            int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+            int64_t days = era * 146097 + doe - 719468;
+            return (((days * 24 + hour) * 60 + minute) * 60 + second) * 1000 +
+                   millisecond;
+        }
+    };
+
+    // the start of the line after the one pos is in, or the end
+    static size_t next_line(std::string_view contents, size_t pos) {
+        size_t newline = contents.find('\n', pos);
+        return newline == std::string_view::npos ? contents.size()
+                                                 : newline + 1;
+    }
+
+    // just the start of it, that's all that gets looked at
+    static std::string_view line_at(std::string_view contents,
+                                    size_t line_start) {
+        std::string_view line = contents.substr(
+            line_start, std::min(contents.size() - line_start,
+                                 max_prefix + 32));
+        return line.substr(0, line.find('\n'));
+    }
+
+    // exactly n digits at pos, which moves past them
+    static std::optional<int64_t> digits(std::string_view s, size_t &pos,
+                                         size_t n) {
+        if (pos + n > s.size()) {
+            return std::nullopt;
+        }
+        int64_t value = 0;
+        for (size_t i = 0; i < n; ++i) {
+            char c = s[pos + i];
+            if (c < '0' || c > '9') {
+                return std::nullopt;
+            }
+            value = value * 10 + (c - '0');
+        }
+        pos += n;
+        return value;
+    }
+
+    static bool literal(std::string_view s, size_t &pos, char c) {
+        if (pos < s.size() && s[pos] == c) {
+            ++pos;
+            return true;
+        }
+        return false;
+    }
+
+    static std::optional<int64_t> month_name(std::string_view s,
+                                             size_t &pos) {
+        constexpr std::string_view names[] = {"Jan", "Feb", "Mar", "Apr",
+                                              "May", "Jun", "Jul", "Aug",
+                                              "Sep", "Oct", "Nov", "Dec"};
+        for (size_t i = 0; i < std::size(names); ++i) {
+            if (s.substr(pos, 3) == names[i]) {
+                pos += 3;
+                return (int64_t)i + 1;
+            }
+        }
+        return std::nullopt;
+    }
+
+    // :SS then an optional fraction, after HH:MM. false if there's no :SS.
+    static bool seconds(std::string_view s, size_t &pos, Civil &civil) {
+        size_t p = pos;
+        std::optional<int64_t> second;
+        if (!literal(s, p, ':') || !(second = digits(s, p, 2))) {
+            return false;
+        }
+        civil.second = *second;
+        pos = p;
+        if (!literal(s, p, '.') && !literal(s, p, ',')) {
+            return true;
+        }
+        int64_t scale = 100;
+        for (; p < s.size() && s[p] >= '0' && s[p] <= '9'; ++p) {
+            civil.millisecond += (s[p] - '0') * scale;
+            scale /= 10;
+        }
+        pos = p;
+        return true;
+    }
+
+    static bool valid(Civil const &civil) {
+        return civil.month >= 1 && civil.month <= 12 && civil.day >= 1 &&
+               civil.day <= 31 && civil.hour <= 23 && civil.minute <= 59 &&
+               civil.second <= 60;
+    }
+
+    // partial lets the time, or the part of it after the date, be left off
+    static std::optional<Civil> parse(Kind kind, std::string_view s,
+                                      bool partial = false) {
+        Civil civil;
+        size_t pos = 0;
+        std::optional<int64_t> a, b, c, d, e;
+        switch (kind) {
+        case ISO8601:
+            if (!(a = digits(s, pos, 4)) || !literal(s, pos, '-') ||
+                !(b = digits(s, pos, 2)) || !literal(s, pos, '-') ||
+                !(c = digits(s, pos, 2))) {
+                return std::nullopt;
+            }
+            civil.year = *a;
+            civil.month = *b;
+            civil.day = *c;
+            if (!literal(s, pos, 'T') && !literal(s, pos, ' ')) {
+                if (!partial) {
+                    return std::nullopt;
+                }
+                break;
+            }
+            if (!(d = digits(s, pos, 2)) || !literal(s, pos, ':') ||
+                !(e = digits(s, pos, 2))) {
+                if (!partial) {
+                    return std::nullopt;
+                }
+                break;
+            }
+            civil.hour = *d;
+            civil.minute = *e;
+            seconds(s, pos, civil);
+            break;
+        case SYSLOG:
+            if (!(a = month_name(s, pos)) || !literal(s, pos, ' ')) {
+                return std::nullopt;
+            }
+            // the day is padded with a space
+            literal(s, pos, ' ');
+            if (!(b = digits(s, pos, 2)) && !(b = digits(s, pos, 1))) {
+                return std::nullopt;
+            }
+            civil.month = *a;
+            civil.day = *b;
+            if (!literal(s, pos, ' ') || !(c = digits(s, pos, 2)) ||
+                !literal(s, pos, ':') || !(d = digits(s, pos, 2))) {
+                if (!partial) {
+                    return std::nullopt;
+                }
+                break;
+            }
+            civil.hour = *c;
+            civil.minute = *d;
+            // without them it's too easy to mistake for prose
+            if (!seconds(s, pos, civil) && !partial) {
+                return std::nullopt;
+            }
+            break;
+        case COMMON_LOG:
+            literal(s, pos, '[');
+            if (!(a = digits(s, pos, 2)) || !literal(s, pos, '/') ||
+                !(b = month_name(s, pos)) || !literal(s, pos, '/') ||
+                !(c = digits(s, pos, 4))) {
+                return std::nullopt;
+            }
+            civil.day = *a;
+            civil.month = *b;
+            civil.year = *c;
+            if (!literal(s, pos, ':') || !(d = digits(s, pos, 2)) ||
+                !literal(s, pos, ':') || !(e = digits(s, pos, 2))) {
+                if (!partial) {
+                    return std::nullopt;
+                }
+                break;
+            }
+            civil.hour = *d;
+            civil.minute = *e;
+            seconds(s, pos, civil);
+            break;
+        case EPOCH: {
+            size_t n = 0;
+            while (n < s.size() && s[n] >= '0' && s[n] <= '9') {
+                ++n;
+            }
+            // seconds or milliseconds from 2001 to 2286, so that ids and
+            // sizes don't pass for times
+            if (n != 10 && n != 13) {
+                return std::nullopt;
+            }
+            int64_t value = *digits(s, pos, n);
+            int64_t ms = n == 10 ? value * 1000 : value;
+            if (n == 10 && literal(s, pos, '.')) {
+                int64_t scale = 100;
+                for (; pos < s.size() && s[pos] >= '0' && s[pos] <= '9';
+                     ++pos) {
+                    ms += (s[pos] - '0') * scale;
+                    scale /= 10;
+                }
+            }
+            if (ms < 1000000000000) {
+                return std::nullopt;
+            }
+            // a Civil that comes back out as ms
+            civil.millisecond = ms;
+            return civil;
+        }
+        }
+        if (!valid(civil)) {
+            return std::nullopt;
+        }
+        return civil;
+    }
+};
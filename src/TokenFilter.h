@@ -0,0 +1,235 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <memory>
+#include <optional>
+#include <stddef.h>
+#include <stdint.h>
+#include <stop_token>
+#include <string.h>
+#include <string_view>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "BlockIndex.h"
+#include "Trace.h"
+#include "Worker.h"
+
+// A Bloom filter per block of its tokens (runs of letters, digits, _ and
+// anything non-ASCII), and of the trigrams inside them, so that searches
+// for IDs and hostnames can skip the blocks that can't have them. / finds
+// substrings rather than words, so whole tokens only help when the pattern
+// has something either side of one (" 1234 ", "id=1234,"). The trigrams
+// cover the rest, but IDs made of digits or hex have every trigram in every
+// block. Each filter is 1/32 of its block, and an entry sets 3 bits in one
+// 64 bit word, so a lookup costs one cache miss.
+//
+// Much cheaper than a TrigramIndex to build, and it can be extended as the
+// contents grow, but it isn't exact and it doesn't get saved.
+struct TokenFilter final : BlockIndex {
+    constexpr static size_t bytes_per_word = 256;
+
+    // shared with the filter this one was extended from
+    std::vector<std::shared_ptr<const std::vector<uint64_t>>> m_filters;
+
+    // Builds filters for whatever prev doesn't cover of contents, in
+    // parallel on pool. Call it from a background job. nullptr if stop was
+    // requested.
+    static std::shared_ptr<TokenFilter> extend(WorkerPool &pool,
+                                               TokenFilter const *prev,
+                                               std::string_view contents,
+                                               std::stop_token stop) {
+        auto filter = std::make_shared<TokenFilter>();
+        if (prev) {
+            // a short last block was cut off at the end of the contents,
+            // it gets redone along with whatever came after it
+            size_t keep = prev->num_blocks();
+            if (keep > 0 && prev->block_end((uint32_t)keep - 1) -
+                                    prev->block_begin((uint32_t)keep - 1) <
+                                block_size) {
+                --keep;
+            }
+            filter->m_block_starts.assign(prev->m_block_starts.begin(),
+                                          prev->m_block_starts.begin() +
+                                              (ptrdiff_t)keep + 1);
+            filter->m_filters.assign(prev->m_filters.begin(),
+                                     prev->m_filters.begin() +
+                                         (ptrdiff_t)keep);
+        }
+        size_t first_new = filter->num_blocks();
+        TRACE_SPAN("index", "token_filter", contents.size() -
+                                                filter->indexed_size());
+        filter->add_blocks(contents);
+        filter->m_filters.resize(filter->num_blocks());
+        pool.parallel_for(
+            WorkerPool::Priority::BACKGROUND,
+            filter->num_blocks() - first_new, [&](size_t i) {
+                WorkerPool::preemption_point();
+                if (stop.stop_requested()) {
+                    return;
+                }
+                uint32_t block = (uint32_t)(first_new + i);
+                size_t begin = filter->block_begin(block);
+                size_t end = filter->block_end(block);
+                filter->m_filters[block] =
+                    build_block(contents.substr(begin, end - begin));
+            });
+        if (stop.stop_requested()) {
+            return nullptr;
+        }
+        return filter;
+    }
+
+  protected:
+    Blocks blocks_with(TrigramQuery const &query) const override {
+        if (query.kind == TrigramQuery::FIELD) {
+            return std::nullopt;
+        }
+        uint64_t hash;
+        if (query.kind == TrigramQuery::TOKEN) {
+            hash = hash_token(query.token);
+        } else {
+            // only trigrams made of token bytes went in
+            uint32_t trigram = query.trigram;
+            if (!TrigramQuery::is_token_byte((unsigned char)(trigram >> 16)) ||
+                !TrigramQuery::is_token_byte((unsigned char)(trigram >> 8)) ||
+                !TrigramQuery::is_token_byte((unsigned char)trigram)) {
+                return std::nullopt;
+            }
+            hash = hash_trigram(trigram);
+        }
+        std::vector<uint32_t> out;
+        for (size_t block = 0; block < m_filters.size(); ++block) {
+            std::vector<uint64_t> const &filter = *m_filters[block];
+            uint64_t word = filter[(hash >> 32) & (filter.size() - 1)];
+            if ((word & bits(hash)) == bits(hash)) {
+                out.push_back((uint32_t)block);
+            }
+        }
+        return out;
+    }
+
+  private:
+    static uint64_t mix(uint64_t hash) {
+        hash ^= hash >> 32;
+        hash *= 0xd6e8feb86659fd93;
+        return hash ^ (hash >> 29);
+    }
+
+    // one multiply, everything below uses the well mixed top half. | 0x20
+    // does the case folding, same as for tokens.
+    static uint64_t hash_trigram(uint32_t trigram) {
+        return (uint64_t)(trigram | 0x202020) * 0x9e3779b97f4a7c15;
+    }
+
+    // eight bytes at a time. | 0x20 lower cases letters and leaves digits
+    // alone, it also lumps a few non-ASCII bytes together, which a Bloom
+    // filter can live with.
+    static uint64_t hash_token(std::string_view token) {
+        constexpr uint64_t lower = 0x2020202020202020;
+        uint64_t hash = token.size();
+        size_t i = 0;
+        for (; i + 8 <= token.size(); i += 8) {
+            uint64_t word;
+            memcpy(&word, token.data() + i, 8);
+            hash = mix((hash ^ (word | lower)) * 0x9e3779b97f4a7c15);
+        }
+        uint64_t word = 0;
+        memcpy(&word, token.data() + i, token.size() - i);
+        return mix((hash ^ (word | lower)) * 0x9e3779b97f4a7c15);
+    }
+
+    // the word is picked by bits 32 and up
+    static uint64_t bits(uint64_t hash) {
+        return (uint64_t)1 << (hash >> 46 & 63) |
+               (uint64_t)1 << (hash >> 52 & 63) | (uint64_t)1 << (hash >> 58);
+    }
+
+    // bit i is set if p[i] is a token byte, for the first min(n, 64)
+    static uint64_t token_mask(const char *p, size_t n) {
+        uint64_t mask = 0;
+#ifdef __SSE2__
+        if (n >= 64) {
+            for (size_t i = 0; i < 64; i += 16) {
+                __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+                // signed compares, the non-ASCII bytes are negative and get
+                // picked up by movemask on their own
+                __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+                __m128i letter = _mm_and_si128(
+                    _mm_cmpgt_epi8(lower, _mm_set1_epi8('a' - 1)),
+                    _mm_cmplt_epi8(lower, _mm_set1_epi8('z' + 1)));
+                __m128i digit = _mm_and_si128(
+                    _mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+                    _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+                __m128i underscore = _mm_cmpeq_epi8(v, _mm_set1_epi8('_'));
+                __m128i token = _mm_or_si128(
+                    _mm_or_si128(letter, digit), _mm_or_si128(underscore, v));
+                mask |= (uint64_t)(uint16_t)_mm_movemask_epi8(token) << i;
+            }
+            return mask;
+        }
+#endif
+        for (size_t i = 0; i < std::min(n, (size_t)64); ++i) {
+            mask |= (uint64_t)TrigramQuery::is_token_byte((unsigned char)p[i])
+                    << i;
+        }
+        return mask;
+    }
+
+    static std::shared_ptr<const std::vector<uint64_t>>
+    build_block(std::string_view block) {
+        auto filter = std::make_shared<std::vector<uint64_t>>(
+            std::bit_ceil(std::max((size_t)1, block.size() / bytes_per_word)));
+        size_t num_words = filter->size();
+        auto insert = [&](uint64_t hash) {
+            (*filter)[(hash >> 32) & (num_words - 1)] |= bits(hash);
+        };
+        uint64_t prev = 0;
+        uint64_t mask = token_mask(block.data(), block.size());
+        // a token that carries on into the next 64 bytes
+        std::optional<size_t> token_begin;
+        for (size_t i = 0; i < block.size(); i += 64) {
+            uint64_t next = i + 64 < block.size()
+                                ? token_mask(block.data() + i + 64,
+                                             block.size() - i - 64)
+                                : 0;
+            // tokens never cross blocks, a block ends with a newline
+            uint64_t token_starts = mask & ~(mask << 1 | prev >> 63);
+            uint64_t token_ends = mask & ~(mask >> 1 | next << 63);
+            while (token_ends) {
+                size_t begin = token_begin.value_or(
+                    i + (size_t)std::countr_zero(token_starts));
+                if (!token_begin) {
+                    token_starts &= token_starts - 1;
+                }
+                token_begin.reset();
+                size_t end = i + (size_t)std::countr_zero(token_ends) + 1;
+                token_ends &= token_ends - 1;
+                if (end - begin >= TrigramAnalysis::min_token) {
+                    insert(hash_token(block.substr(begin, end - begin)));
+                }
+            }
+            if (token_starts) {
+                token_begin = i + (size_t)std::countr_zero(token_starts);
+            }
+            // where three token bytes in a row start
+            uint64_t starts = mask & (mask >> 1 | next << 63) &
+                              (mask >> 2 | next << 62);
+            while (starts) {
+                size_t pos = i + (size_t)std::countr_zero(starts);
+                starts &= starts - 1;
+                insert(hash_trigram((uint32_t)(unsigned char)block[pos] << 16 |
+                                    (uint32_t)(unsigned char)block[pos + 1]
+                                        << 8 |
+                                    (unsigned char)block[pos + 2]));
+            }
+            prev = mask;
+            mask = next;
+        }
+        return filter;
+    }
+};
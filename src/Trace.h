@@ -0,0 +1,168 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <sys/types.h>
+#include <unistd.h>
+#include <vector>
+
+// Optional tracer for seeing how time splits between the threads. Spans go
+// into per-thread buffers that only their own thread ever writes to, and get
+// written out as Chrome trace events (chrome://tracing or ui.perfetto.dev)
+// at exit. While tracing is off, a span costs a relaxed load and a branch.
+//
+//     TRACE_SPAN("search", "chunk_scan", chunk_size);
+//
+// Names and categories have to be string literals, only the pointers are
+// kept.
+namespace tracing {
+
+struct Event {
+    const char *category;
+    const char *name;
+    uint64_t begin_ns;
+    uint64_t end_ns;
+    uint64_t size;
+};
+
+struct ThreadBuffer {
+    // events past this get counted and dropped rather than allocating on
+    // the hot path
+    constexpr static size_t capacity = 1 << 16;
+
+    std::unique_ptr<Event[]> events{new Event[capacity]};
+    std::atomic<size_t> num_events{0};
+    size_t num_dropped = 0;
+    pid_t tid = gettid();
+    std::string name;
+};
+
+inline std::atomic<bool> g_enabled{false};
+inline uint64_t g_start_ns = 0;
+// buffers outlive their threads, so they can still be written out after
+// everything's been joined
+inline std::mutex g_buffers_mutex;
+inline std::vector<std::unique_ptr<ThreadBuffer>> g_buffers;
+inline thread_local ThreadBuffer *t_buffer = nullptr;
+
+inline bool enabled() {
+    return g_enabled.load(std::memory_order_relaxed);
+}
+
+inline uint64_t now_ns() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+// Call before starting any threads.
+inline void enable() {
+    g_start_ns = now_ns();
+    g_enabled.store(true, std::memory_order_relaxed);
+}
+
+inline ThreadBuffer *this_thread_buffer() {
+    if (t_buffer == nullptr) {
+        std::scoped_lock lock(g_buffers_mutex);
+        t_buffer = g_buffers.emplace_back(new ThreadBuffer()).get();
+    }
+    return t_buffer;
+}
+
+inline void set_thread_name(std::string name) {
+    if (enabled()) {
+        this_thread_buffer()->name = std::move(name);
+    }
+}
+
+inline void record(const char *category, const char *name, uint64_t begin_ns,
+                   uint64_t end_ns, uint64_t size) {
+    ThreadBuffer *buffer = this_thread_buffer();
+    size_t idx = buffer->num_events.load(std::memory_order_relaxed);
+    if (idx == ThreadBuffer::capacity) {
+        ++buffer->num_dropped;
+        return;
+    }
+    buffer->events[idx] = {category, name, begin_ns, end_ns, size};
+    buffer->num_events.store(idx + 1, std::memory_order_release);
+}
+
+struct Span {
+    const char *m_category;
+    const char *m_name;
+    uint64_t m_size;
+    // 0 if tracing was off when the span started
+    uint64_t m_begin_ns;
+
+    Span(const char *category, const char *name, uint64_t size = 0)
+        : m_category(category), m_name(name), m_size(size),
+          m_begin_ns(enabled() ? now_ns() : 0) {
+    }
+    Span(Span const &) = delete;
+    Span &operator=(Span const &) = delete;
+    ~Span() {
+        if (m_begin_ns != 0) {
+            record(m_category, m_name, m_begin_ns, now_ns(), m_size);
+        }
+    }
+
+    // for when the size is only known at the end
+    void set_size(uint64_t size) {
+        m_size = size;
+    }
+};
+
+// Writes every buffer out in the Chrome trace event format. Only call once
+// all the traced threads have stopped. Returns false if it couldn't be
+// written.
+inline bool write_chrome_json(std::string const &path) {
+    FILE *f = fopen(path.c_str(), "w");
+    if (!f) {
+        return false;
+    }
+    pid_t pid = getpid();
+    const char *separator = "";
+    fprintf(f, "{\"traceEvents\": [");
+    std::scoped_lock lock(g_buffers_mutex);
+    for (auto const &buffer : g_buffers) {
+        if (!buffer->name.empty()) {
+            fprintf(f,
+                    "%s\n{\"ph\": \"M\", \"name\": \"thread_name\", "
+                    "\"pid\": %d, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+                    separator, pid, buffer->tid, buffer->name.c_str());
+            separator = ",";
+        }
+        size_t num_events = buffer->num_events.load(std::memory_order_acquire);
+        for (size_t idx = 0; idx < num_events; ++idx) {
+            Event const &event = buffer->events[idx];
+            // timestamps are in microseconds
+            fprintf(f,
+                    "%s\n{\"ph\": \"X\", \"cat\": \"%s\", \"name\": \"%s\", "
+                    "\"pid\": %d, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f, "
+                    "\"args\": {\"size\": %lu}}",
+                    separator, event.category, event.name, pid, buffer->tid,
+                    (double)(event.begin_ns - g_start_ns) / 1000,
+                    (double)(event.end_ns - event.begin_ns) / 1000,
+                    event.size);
+            separator = ",";
+        }
+        if (buffer->num_dropped > 0) {
+            fprintf(stderr, "trace: dropped %lu events on thread %d\n",
+                    buffer->num_dropped, buffer->tid);
+        }
+    }
+    fprintf(f, "\n]}\n");
+    return fclose(f) == 0;
+}
+
+} // namespace tracing
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+#define TRACE_SPAN(...)                                                        \
+    tracing::Span TRACE_CONCAT(trace_span_, __LINE__)(__VA_ARGS__)
@@ -0,0 +1,252 @@
+#pragma once
+
+#include <algorithm>
+#include <errno.h>
+#include <memory>
+#include <optional>
+#include <span>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stop_token>
+#include <string.h>
+#include <string>
+#include <string_view>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "BlockIndex.h"
+#include "Trace.h"
+#include "Worker.h"
+
+// An index of which trigrams turn up in which blocks of a file, so that a
+// search for something rare only has to look at the handful of blocks that
+// could have it.
+//
+// Saved to disk as, all native endian:
+//   magic, then u64 file size, device, inode, mtime in ns,
+//   u64 number of blocks, trigrams and postings
+//   u64 block starts, one more than there are blocks
+//   u32 trigrams, sorted
+//   u64 offset of each trigram's postings, one more than there are trigrams
+//   u32 postings, the sorted block numbers each trigram turns up in
+struct TrigramIndex final : BlockIndex {
+    constexpr static size_t num_trigrams = 1 << 24;
+    constexpr static char magic[8] = {'S', 'L', 'T', 'R', 'I', 'G', '0', '1'};
+
+    // what the index was built from, it's out of date if any of it changes
+    struct Identity {
+        uint64_t size;
+        uint64_t dev;
+        uint64_t ino;
+        uint64_t mtime_ns;
+        bool operator==(Identity const &) const = default;
+    };
+
+    Identity m_identity;
+    std::vector<uint32_t> m_trigrams;
+    std::vector<uint64_t> m_offsets;
+    std::vector<uint32_t> m_postings;
+
+    std::span<const uint32_t> postings(uint32_t trigram) const {
+        auto it =
+            std::lower_bound(m_trigrams.begin(), m_trigrams.end(), trigram);
+        if (it == m_trigrams.end() || *it != trigram) {
+            return {};
+        }
+        size_t i = (size_t)(it - m_trigrams.begin());
+        return std::span<const uint32_t>(m_postings)
+            .subspan(m_offsets[i], m_offsets[i + 1] - m_offsets[i]);
+    }
+
+    static std::optional<Identity> identify(std::string const &path) {
+        struct stat statbuf;
+        if (stat(path.c_str(), &statbuf) == -1) {
+            return std::nullopt;
+        }
+        return Identity{(uint64_t)statbuf.st_size, (uint64_t)statbuf.st_dev,
+                        (uint64_t)statbuf.st_ino,
+                        (uint64_t)statbuf.st_mtim.tv_sec * 1000000000 +
+                            (uint64_t)statbuf.st_mtim.tv_nsec};
+    }
+
+    // Blocks get indexed in parallel on pool. Call it from a background
+    // job, it gives way to interactive work between blocks. nullptr if stop
+    // was requested.
+    static std::shared_ptr<TrigramIndex> build(WorkerPool &pool,
+                                               std::string_view contents,
+                                               Identity identity,
+                                               std::stop_token stop) {
+        TRACE_SPAN("index", "build", contents.size());
+        auto index = std::make_shared<TrigramIndex>();
+        index->m_identity = identity;
+
+        index->add_blocks(contents);
+
+        size_t num_blocks = index->num_blocks();
+        std::vector<std::vector<uint32_t>> block_trigrams(num_blocks);
+        pool.parallel_for(
+            WorkerPool::Priority::BACKGROUND, num_blocks, [&](size_t block) {
+                WorkerPool::preemption_point();
+                if (stop.stop_requested()) {
+                    return;
+                }
+                size_t begin = index->block_begin((uint32_t)block);
+                size_t end = index->block_end((uint32_t)block);
+                block_trigrams[block] =
+                    trigrams_in(contents.substr(begin, end - begin));
+            });
+        if (stop.stop_requested()) {
+            return nullptr;
+        }
+
+        // turn the per block lists inside out. counts doubles up as the
+        // trigram's position in m_trigrams once they've all been counted.
+        std::vector<uint32_t> counts(num_trigrams);
+        for (std::vector<uint32_t> const &trigrams : block_trigrams) {
+            for (uint32_t trigram : trigrams) {
+                ++counts[trigram];
+            }
+        }
+        index->m_offsets.push_back(0);
+        for (uint32_t trigram = 0; trigram < num_trigrams; ++trigram) {
+            if (counts[trigram] == 0) {
+                continue;
+            }
+            index->m_offsets.push_back(index->m_offsets.back() +
+                                       counts[trigram]);
+            counts[trigram] = (uint32_t)index->m_trigrams.size();
+            index->m_trigrams.push_back(trigram);
+        }
+        index->m_postings.resize(index->m_offsets.back());
+        std::vector<uint64_t> next(index->m_offsets.begin(),
+                                   index->m_offsets.end() - 1);
+        for (size_t block = 0; block < num_blocks; ++block) {
+            for (uint32_t trigram : block_trigrams[block]) {
+                index->m_postings[next[counts[trigram]]++] = (uint32_t)block;
+            }
+            block_trigrams[block] = {};
+        }
+        return index;
+    }
+
+    // false with errno set if it couldn't be written. goes via a temporary
+    // file, so nobody ever loads half an index.
+    bool save(std::string const &path) const {
+        std::string tmp_path = path + ".tmp";
+        FILE *f = fopen(tmp_path.c_str(), "wb");
+        if (!f) {
+            return false;
+        }
+        uint64_t header[] = {m_identity.size,     m_identity.dev,
+                             m_identity.ino,      m_identity.mtime_ns,
+                             num_blocks(),        m_trigrams.size(),
+                             m_postings.size()};
+        bool ok = fwrite(magic, sizeof(magic), 1, f) == 1 &&
+                  write_array(f, std::span<const uint64_t>(header)) &&
+                  write_array(f, std::span(m_block_starts)) &&
+                  write_array(f, std::span(m_trigrams)) &&
+                  write_array(f, std::span(m_offsets)) &&
+                  write_array(f, std::span(m_postings));
+        ok = (fclose(f) == 0) && ok;
+        if (!ok || rename(tmp_path.c_str(), path.c_str()) == -1) {
+            int saved_errno = errno;
+            unlink(tmp_path.c_str());
+            errno = saved_errno;
+            return false;
+        }
+        return true;
+    }
+
+    // nullptr if there's no index at path, or it's for something other than
+    // identity
+    static std::shared_ptr<TrigramIndex> load(std::string const &path,
+                                              Identity identity) {
+        FILE *f = fopen(path.c_str(), "rb");
+        if (!f) {
+            return nullptr;
+        }
+        auto index = std::make_shared<TrigramIndex>();
+        char file_magic[sizeof(magic)];
+        uint64_t header[7];
+        bool ok = fread(file_magic, sizeof(file_magic), 1, f) == 1 &&
+                  memcmp(file_magic, magic, sizeof(magic)) == 0 &&
+                  fread(header, sizeof(header), 1, f) == 1;
+        if (ok) {
+            index->m_identity = {header[0], header[1], header[2], header[3]};
+            uint64_t num_blocks = header[4];
+            uint64_t num_trigrams = header[5];
+            uint64_t num_postings = header[6];
+            // check the sizes add up before trusting them with an allocation
+            struct stat statbuf;
+            ok = index->m_identity == identity &&
+                 num_blocks <= identity.size &&
+                 num_trigrams <= TrigramIndex::num_trigrams &&
+                 fstat(fileno(f), &statbuf) == 0 &&
+                 (uint64_t)statbuf.st_size ==
+                     sizeof(magic) + sizeof(header) +
+                         8 * (num_blocks + 1) + 4 * num_trigrams +
+                         8 * (num_trigrams + 1) + 4 * num_postings &&
+                 read_array(f, index->m_block_starts, num_blocks + 1) &&
+                 read_array(f, index->m_trigrams, num_trigrams) &&
+                 read_array(f, index->m_offsets, num_trigrams + 1) &&
+                 read_array(f, index->m_postings, num_postings) &&
+                 index->m_block_starts.front() == 0 &&
+                 index->m_block_starts.back() <= identity.size &&
+                 index->m_offsets.back() == num_postings;
+        }
+        fclose(f);
+        return ok ? index : nullptr;
+    }
+
+  protected:
+    Blocks blocks_with(TrigramQuery const &query) const override {
+        if (query.kind != TrigramQuery::TRIGRAM) {
+            return std::nullopt;
+        }
+        std::span<const uint32_t> blocks = postings(query.trigram);
+        return std::vector<uint32_t>(blocks.begin(), blocks.end());
+    }
+
+  private:
+    // sorted, without duplicates
+    static std::vector<uint32_t> trigrams_in(std::string_view block) {
+        // a bit per trigram, left all clear between calls
+        thread_local std::vector<uint64_t> t_seen(num_trigrams / 64);
+        std::vector<uint32_t> out;
+        if (block.size() >= 3) {
+            uint32_t trigram = TrigramQuery::fold((unsigned char)block[0])
+                                   << 8 |
+                               TrigramQuery::fold((unsigned char)block[1]);
+            for (size_t i = 2; i < block.size(); ++i) {
+                trigram = (trigram << 8 |
+                           TrigramQuery::fold((unsigned char)block[i])) &
+                          (num_trigrams - 1);
+                uint64_t &word = t_seen[trigram / 64];
+                uint64_t bit = (uint64_t)1 << (trigram % 64);
+                if (!(word & bit)) {
+                    word |= bit;
+                    out.push_back(trigram);
+                }
+            }
+        }
+        for (uint32_t trigram : out) {
+            t_seen[trigram / 64] = 0;
+        }
+        std::sort(out.begin(), out.end());
+        return out;
+    }
+
+    template <typename T>
+    static bool write_array(FILE *f, std::span<const T> array) {
+        return fwrite(array.data(), sizeof(T), array.size(), f) ==
+               array.size();
+    }
+
+    template <typename T>
+    static bool read_array(FILE *f, std::vector<T> &array, size_t size) {
+        array.resize(size);
+        return fread(array.data(), sizeof(T), size, f) == size;
+    }
+};
@@ -3,6 +3,7 @@
 #include <algorithm>
 #include <cassert>
 #include <mutex>
+#include <span>
 #include <stdio.h>
 #include <stdlib.h>
 #include <utility>
@@ -16,6 +17,8 @@
 #include "ContentHandle.h"
 #include "Cursor.h"
 #include "Page.h"
+#include "Trace.h"
+#include "search.h"
 
 inline std::string_view strip_trailing_rn(std::string_view str) {
     size_t last_non_newline_char = str.find_last_not_of("\r\n");
@@ -34,6 +37,8 @@ struct View {
     enum class ColorPair {
         MAIN_RESULT = 0,
         SIDE_RESULT = 8,
+        // and one after another from here, one for each pin
+        FIRST_PIN = 9,
     };
 
     std::mutex *m_nc_mutex;
@@ -50,10 +55,12 @@ struct View {
 
     Page m_page;
 
+    // out is where the drawing goes, which is only ever not stdout when
+    // replaying headless
     static View create(std::mutex *nc_mutex, ContentHandle *content_handle,
-                       FILE *tty) {
+                       FILE *tty, FILE *out = stdout) {
         std::scoped_lock lock(*nc_mutex);
-        newterm(getenv("TERM"), stdout, tty);
+        newterm(getenv("TERM"), out, tty);
         start_color();
         use_default_colors();
         noecho();
@@ -66,6 +73,14 @@ struct View {
         // initialise some colours
         // init_pair((short)ColorPair::MAIN_RESULT, COLOR_WHITE, COLOR_BLACK);
         init_pair((short)ColorPair::SIDE_RESULT, -1, COLOR_RED);
+        constexpr short pin_colours[] = {COLOR_GREEN, COLOR_YELLOW,
+                                         COLOR_BLUE,  COLOR_MAGENTA,
+                                         COLOR_CYAN,  COLOR_WHITE};
+        static_assert(std::size(pin_colours) == max_pins);
+        for (size_t pin = 0; pin < max_pins; ++pin) {
+            init_pair((short)((size_t)ColorPair::FIRST_PIN + pin), COLOR_BLACK,
+                      pin_colours[pin]);
+        }
 
         // Get the screen height and width
         int height, width;
@@ -111,6 +126,20 @@ struct View {
         endwin(); // here's how you finish up ncurses mode
     }
 
+    // FNV-1a over what ncurses thinks is on the terminal right now,
+    // attributes included so highlights count
+    uint64_t screen_checksum() const {
+        std::scoped_lock lock(*m_nc_mutex);
+        uint64_t hash = 0xcbf29ce484222325;
+        for (int y = 0; y < getmaxy(curscr); ++y) {
+            for (int x = 0; x < getmaxx(curscr); ++x) {
+                hash ^= (uint64_t)mvwinch(curscr, y, x);
+                hash *= 0x100000001b3;
+            }
+        }
+        return hash;
+    }
+
     Page current_page() const {
         return m_page;
     }
@@ -177,6 +206,8 @@ struct View {
         auto content_guard = m_content_handle->get_contents();
         std::string_view contents = content_guard.contents;
         if (contents.empty()) {
+            // e.g. the file got truncated, don't hang on to the old offsets
+            move_to_byte_offset(0, false);
             return;
         }
         // in the case of eof we don't scroll to the right because we
@@ -185,6 +216,7 @@ struct View {
     }
 
     void move_to_byte_offset(size_t offset, bool auto_chunk_index = true) {
+        TRACE_SPAN("render", "page_build");
         m_page = Page::get_page_at_byte_offset(
             m_content_handle->get_contents().contents, offset,
             m_main_window_height, m_main_window_width, m_wrap_lines,
@@ -200,11 +232,13 @@ struct View {
     }
 
     struct Highlight {
-        enum class Type { Main, Side };
+        enum class Type { Main, Side, Pin };
 
         size_t m_offset;
         size_t m_length;
         Type m_type;
+        // which one, for a Pin
+        size_t m_pin = 0;
 
         size_t begin_offset() const {
             return m_offset;
@@ -220,8 +254,12 @@ struct View {
         }
     };
 
+    // density, if there is any, goes down the right hand side as a minimap
+    // with a row per bucket, see MatchDensity
     void
-    display_page_at(std::vector<std::vector<Highlight>> const &highlight_list) {
+    display_page_at(std::vector<std::vector<Highlight>> const &highlight_list,
+                    std::span<const uint64_t> density = {}) {
+        TRACE_SPAN("render", "display_page_at");
         std::scoped_lock lock(*m_nc_mutex);
 
         werase(m_main_window_ptr);
@@ -256,9 +294,18 @@ struct View {
                               ? WA_STANDOUT
                               : WA_NORMAL;
             using enum ColorPair;
-            short colour = (short)((highlight.type() == Highlight::Type::Main)
-                                       ? MAIN_RESULT
-                                       : SIDE_RESULT);
+            short colour = 0;
+            switch (highlight.type()) {
+            case Highlight::Type::Main:
+                colour = (short)MAIN_RESULT;
+                break;
+            case Highlight::Type::Side:
+                colour = (short)SIDE_RESULT;
+                break;
+            case Highlight::Type::Pin:
+                colour = (short)((size_t)FIRST_PIN + highlight.m_pin);
+                break;
+            }
 
             mvwchgat(m_main_window_ptr, row_idx, highlight.begin_offset(),
                      actual_length, attr, colour, 0);
@@ -271,9 +318,43 @@ struct View {
             }
         }
 
+        if (!density.empty()) {
+            display_density(density, page, contents.size());
+        }
+
         wrefresh(m_main_window_ptr);
     }
 
+    // the busiest row gets @ and any row with a match gets at least a dot,
+    // in reverse apart from the rows the page is in, like a scrollbar. call
+    // with m_nc_mutex held.
+    void display_density(std::span<const uint64_t> density, Page const &page,
+                         size_t size) {
+        constexpr std::string_view levels = " .:-=+*#%@";
+        uint64_t busiest = *std::max_element(density.begin(), density.end());
+        size_t height = m_main_window_height;
+        auto row_of = [&](size_t offset) {
+            return size == 0 ? 0 : std::min(height - 1, offset * height / size);
+        };
+        size_t page_begin = row_of(page.get_begin_offset());
+        size_t page_end =
+            std::max(page_begin, row_of(std::max(page.get_end_offset(),
+                                                 (size_t)1) -
+                                        1));
+        for (size_t row = 0; row < height; ++row) {
+            uint64_t count = density[row * density.size() / height];
+            size_t level =
+                count == 0 ? 0
+                           : 1 + (size_t)((double)(levels.size() - 2) *
+                                          (double)count / (double)busiest);
+            chtype attr =
+                row >= page_begin && row <= page_end ? A_NORMAL : A_REVERSE;
+            mvwaddch(m_main_window_ptr, (int)row,
+                     (int)m_main_window_width - 1,
+                     (chtype)(unsigned char)levels[level] | attr);
+        }
+    }
+
     void display_command(std::string_view command, size_t cursor_pos) {
         if (cursor_pos >= m_main_window_width) {
             size_t half_width = (m_main_window_width + 1) / 2;
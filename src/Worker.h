@@ -1,26 +1,29 @@
 #pragma once
 
+#include <algorithm>
 #include <assert.h>
-#include <cctype>
-#include <fcntl.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <functional>
 #include <future>
 #include <memory>
 #include <mutex>
 #include <optional>
-#include <poll.h>
-#include <signal.h>
+#include <stdint.h>
 #include <stop_token>
-#include <string_view>
 #include <thread>
+#include <vector>
 
-#include "Channel.h"
+#include "Trace.h"
 
 #if 0
 // Sample usage:
 int main() {
-    // Make a worker thread
-    WorkerThread worker;
+    // Make a pool, usually there's just the one
+    WorkerPool pool;
+    // And a worker on it for each kind of job
+    Worker worker(&pool, WorkerPool::Priority::INTERACTIVE);
 
     // Send jobs into it
     for (size_t i = 0; i < 10; ++i) {
@@ -52,22 +55,8 @@ int main() {
     }
 
     {
-        // We can send more jobs now that the previous one was cancelled
-        auto [fut, stop] = worker.spawn(
-            [](int i) {
-                std::cout << i << std::endl;
-                return i;
-            },
-            69);
-        // Await the job
-        auto job_result = fut.get();
-        std::cout << "Job completed: " << job_result << std::endl;
-    }
-
-    {
-        // You can also just send another job in without cancelling the existing
-        // job, attempting to send a new job in automatically requests a stop
-        // for the existing job.
+        // Sending another job into the same worker automatically requests a
+        // stop for the existing job.
         auto [fut1, stop1] = worker.spawn([](std::stop_token stop) {
             while (!stop.stop_requested()) {
                 std::this_thread::sleep_for(std::chrono::seconds(1));
@@ -88,24 +77,240 @@ int main() {
         auto job_result2 = fut2.get();
         std::cout << "Job completed: " << job_result2 << std::endl;
     }
+
+    {
+        // Jobs on different workers don't cancel each other, and can run at
+        // the same time. A background job gives way to interactive ones
+        // whenever it calls WorkerPool::preemption_point().
+        Worker indexer(&pool, WorkerPool::Priority::BACKGROUND);
+        auto [fut1, stop1] = indexer.spawn([](std::stop_token stop) {
+            for (size_t chunk = 0; chunk < 1000; ++chunk) {
+                WorkerPool::preemption_point();
+                if (stop.stop_requested()) {
+                    return;
+                }
+                // ... index one chunk
+            }
+        });
+        auto [fut2, stop2] = worker.spawn([](std::stop_token) { return 69; });
+        fut2.get();
+        fut1.get();
+    }
 }
 #endif
-struct WorkerThread {
-    Channel<std::function<void(void)>> task_chan;
+
+// A pool of threads shared by everything that needs to run in the
+// background. Every thread owns a deque per priority, pops its own from the
+// back and steals from the front of the others when it runs dry. Interactive
+// tasks are always taken before background ones.
+struct WorkerPool {
+    enum class Priority {
+        INTERACTIVE,
+        BACKGROUND,
+    };
+    constexpr static size_t num_priorities = 2;
+
+    using Task = std::function<void(void)>;
+
+    struct Queue {
+        std::mutex mut;
+        std::deque<Task> tasks[num_priorities];
+    };
+
+    std::vector<std::unique_ptr<Queue>> m_queues;
+    // can go negative briefly, a task is counted after it's pushed
+    std::atomic<long> m_num_pending[num_priorities];
+    std::atomic<size_t> m_next_queue;
+
+    std::mutex m_sleep_mut;
+    std::condition_variable m_sleep_cond;
+    bool m_closed;
+
+    std::vector<std::thread> m_threads;
+
+    explicit WorkerPool(
+        size_t num_threads = std::max(2u, std::thread::hardware_concurrency()))
+        : m_num_pending{0, 0}, m_next_queue(0), m_closed(false) {
+        for (size_t i = 0; i < num_threads; ++i) {
+            m_queues.push_back(std::make_unique<Queue>());
+        }
+        for (size_t i = 0; i < num_threads; ++i) {
+            m_threads.emplace_back(&WorkerPool::run, this, i);
+        }
+    }
+
+    WorkerPool(const WorkerPool &) = delete;
+    WorkerPool &operator=(const WorkerPool &) = delete;
+    WorkerPool(WorkerPool &&) = delete;
+    WorkerPool &operator=(WorkerPool &&) = delete;
+    ~WorkerPool() {
+        {
+            std::scoped_lock lock(m_sleep_mut);
+            m_closed = true;
+        }
+        m_sleep_cond.notify_all();
+        for (std::thread &t : m_threads) {
+            t.join();
+        }
+    }
+
+    size_t num_threads() const {
+        return m_threads.size();
+    }
+
+    void submit(Priority priority, Task task) {
+        // tasks submitted from a pool thread stay local to it, everything
+        // else gets spread around
+        size_t idx = (t_pool == this) ? t_self
+                                      : m_next_queue++ % m_queues.size();
+        {
+            Queue &queue = *m_queues[idx];
+            std::scoped_lock lock(queue.mut);
+            queue.tasks[(size_t)priority].push_back(std::move(task));
+        }
+        {
+            std::scoped_lock lock(m_sleep_mut);
+            ++m_num_pending[(size_t)priority];
+        }
+        m_sleep_cond.notify_one();
+    }
+
+    // Runs f(i) for every i in [0, n) spread over the pool at priority, and
+    // returns once they've all finished. The calling thread works through
+    // them too, so it's fine to call from a job already on the pool, even
+    // when every other thread is busy.
+    template <typename Function>
+    void parallel_for(Priority priority, size_t n, Function const &f) {
+        struct State {
+            std::atomic<size_t> next{0};
+            std::mutex mut;
+            std::condition_variable cond;
+            size_t done = 0;
+        };
+        // helpers that only get going after everything's done still look at
+        // the state, so it can't live on this stack. f can, they never call
+        // it once next has run past n.
+        auto state = std::make_shared<State>();
+        auto work = [state, n, &f]() {
+            size_t finished = 0;
+            for (size_t i; (i = state->next++) < n; ++finished) {
+                f(i);
+            }
+            if (finished > 0) {
+                std::scoped_lock lock(state->mut);
+                state->done += finished;
+                if (state->done == n) {
+                    state->cond.notify_all();
+                }
+            }
+        };
+        size_t num_helpers = std::min(n, num_threads()) - (n > 0);
+        for (size_t i = 0; i < num_helpers; ++i) {
+            submit(priority, work);
+        }
+        work();
+        std::unique_lock lock(state->mut);
+        state->cond.wait(lock, [&]() { return state->done == n; });
+    }
+
+    // Background tasks should call this between chunks of work. If there is
+    // interactive work waiting, it gets run right here before returning.
+    static void preemption_point() {
+        if (t_pool == nullptr || t_priority != Priority::BACKGROUND) {
+            return;
+        }
+        size_t interactive = (size_t)Priority::INTERACTIVE;
+        while (t_pool->m_num_pending[interactive] > 0) {
+            std::optional<Task> task =
+                t_pool->take_task(t_self, Priority::INTERACTIVE);
+            if (!task) {
+                break;
+            }
+            t_priority = Priority::INTERACTIVE;
+            (*task)();
+            t_priority = Priority::BACKGROUND;
+        }
+    }
+
+  private:
+    inline static thread_local WorkerPool *t_pool = nullptr;
+    inline static thread_local size_t t_self = 0;
+    inline static thread_local Priority t_priority = Priority::INTERACTIVE;
+
+    std::optional<Task> take_task(size_t self, Priority priority) {
+        for (size_t i = 0; i < m_queues.size(); ++i) {
+            Queue &queue = *m_queues[(self + i) % m_queues.size()];
+            std::scoped_lock lock(queue.mut);
+            std::deque<Task> &tasks = queue.tasks[(size_t)priority];
+            if (tasks.empty()) {
+                continue;
+            }
+            Task task;
+            if (i == 0) {
+                task = std::move(tasks.back());
+                tasks.pop_back();
+            } else {
+                task = std::move(tasks.front());
+                tasks.pop_front();
+            }
+            --m_num_pending[(size_t)priority];
+            return task;
+        }
+        return std::nullopt;
+    }
+
+    bool has_pending() const {
+        for (auto const &num_pending : m_num_pending) {
+            if (num_pending > 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void run(size_t self) {
+        t_pool = this;
+        t_self = self;
+        tracing::set_thread_name("worker " + std::to_string(self));
+        while (true) {
+            for (Priority priority :
+                 {Priority::INTERACTIVE, Priority::BACKGROUND}) {
+                std::optional<Task> task = take_task(self, priority);
+                if (task) {
+                    t_priority = priority;
+                    (*task)();
+                    break;
+                }
+            }
+
+            std::unique_lock lock(m_sleep_mut);
+            m_sleep_cond.wait(lock, [this]() {
+                return has_pending() || m_closed;
+            });
+            if (m_closed && !has_pending()) {
+                break;
+            }
+        }
+    }
+};
+
+// A handle for submitting one kind of job into a WorkerPool. Spawning a new
+// job cancels whatever the previous one on the same Worker was doing.
+struct Worker {
+    WorkerPool *m_pool;
+    WorkerPool::Priority m_priority;
     std::stop_source stop_current_task;
-    std::thread t;
 
-    WorkerThread() : task_chan(), t(&WorkerThread::run, this) {
+    Worker(WorkerPool *pool, WorkerPool::Priority priority)
+        : m_pool(pool), m_priority(priority) {
     }
 
-    WorkerThread(const WorkerThread &) = delete;
-    WorkerThread &operator=(const WorkerThread &) = delete;
-    WorkerThread(WorkerThread &&) = delete;
-    WorkerThread &operator=(WorkerThread &&) = delete;
-    ~WorkerThread() {
-        task_chan.close();
+    Worker(const Worker &) = delete;
+    Worker &operator=(const Worker &) = delete;
+    Worker(Worker &&) = delete;
+    Worker &operator=(Worker &&) = delete;
+    ~Worker() {
         stop_current_task.request_stop();
-        t.join();
     }
 
     template <class Function, class... Args>
@@ -124,25 +329,21 @@ struct WorkerThread {
         std::future<ResultType> future = promise.get_future();
         stop_current_task = std::stop_source();
         std::stop_token token = stop_current_task.get_token();
-        task_chan.push([promise = std::make_shared<std::promise<ResultType>>(
-                            std::move(promise)),
-                        f = std::forward<Function>(f),
-                        args = std::make_tuple(std::forward<Args>(args)...,
-                                               std::move(token))]() mutable {
-            promise->set_value(std::apply(std::move(f), std::move(args)));
-        });
+        m_pool->submit(
+            m_priority,
+            [promise =
+                 std::make_shared<std::promise<ResultType>>(std::move(promise)),
+             f = std::forward<Function>(f),
+             args = std::make_tuple(std::forward<Args>(args)...,
+                                    std::move(token))]() mutable {
+                if constexpr (std::is_void_v<ResultType>) {
+                    std::apply(std::move(f), std::move(args));
+                    promise->set_value();
+                } else {
+                    promise->set_value(
+                        std::apply(std::move(f), std::move(args)));
+                }
+            });
         return {std::move(future), stop_current_task};
     }
-
-  private:
-    void run() {
-        while (true) {
-            auto maybe_task = task_chan.pop();
-            if (maybe_task.has_value()) {
-                maybe_task.value()();
-            } else {
-                break;
-            }
-        };
-    }
 };
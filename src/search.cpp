@@ -1,13 +1,23 @@
 #include "search.h"
+#include "JsonFields.h"
+#include "LazyDfa.h"
+#include "SearchProgress.h"
+#include "Trace.h"
+#include "Worker.h"
 
 #define PCRE2_CODE_UNIT_WIDTH 8
 #include <pcre2.h>
 #include <string.h>
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
 #include <map>
 #include <memory>
+#include <mutex>
 #include <optional>
+#include <random>
 #include <string>
 
 namespace {
@@ -30,31 +40,9 @@ void approx_tolower(std::string_view in, char *out) {
     approx_tolower(in.data(), in.data() + in.length(), out);
 }
 
-std::vector<std::pair<size_t, size_t>> chunks(std::string_view file_contents,
-                                              size_t beginning_offset,
-                                              size_t ending_offset,
-                                              size_t min_chunk_size) {
-    std::vector<std::pair<size_t, size_t>> out;
-    while (beginning_offset != ending_offset) {
-        size_t approx_cur_chunk_end =
-            std::min(beginning_offset + min_chunk_size, ending_offset);
-        if (approx_cur_chunk_end == ending_offset) {
-            out.push_back({beginning_offset, ending_offset});
-            break;
-        }
-        size_t cur_chunk_end =
-            file_contents.find_first_of('\n', approx_cur_chunk_end);
-        if (cur_chunk_end == std::string_view::npos) {
-            cur_chunk_end = ending_offset;
-        } else {
-            cur_chunk_end = std::min(cur_chunk_end + 1, ending_offset);
-        }
-
-        out.push_back({beginning_offset, cur_chunk_end});
-        beginning_offset = cur_chunk_end;
-    }
-    return out;
-}
+// small enough that a hit near the end doesn't keep every thread busy for
+// long, big enough that handing them out costs next to nothing
+constexpr size_t parallel_chunk_size = 1024 * 1024;
 
 std::pair<std::string, std::map<size_t, size_t>>
 flip_by_lines(std::string_view str) {
@@ -80,8 +68,70 @@ flip_by_lines(std::string_view str) {
     return out;
 }
 
+// rfind for a pattern that's already lower case. haystack gets lower cased
+// a window at a time from the end, so a hit near the end doesn't pay for
+// the rest of it.
+size_t caseless_rfind(std::string_view haystack,
+                      std::string_view lower_pattern) {
+    constexpr size_t window_size = 64 * 1024;
+    std::string window;
+    size_t window_end = haystack.size();
+    while (window_end > 0) {
+        size_t window_start = window_end - std::min(window_end, window_size);
+        // a match can start before window_end and finish after it
+        size_t overlap_end =
+            std::min(haystack.size(), window_end + lower_pattern.size() - 1);
+        window.resize(overlap_end - window_start);
+        tolower(haystack.substr(window_start, overlap_end - window_start),
+                window.data());
+        size_t pos = window.rfind(lower_pattern);
+        if (pos != std::string::npos) {
+            return window_start + pos;
+        }
+        window_end = window_start;
+    }
+    return std::string::npos;
+}
+
+// checked between chunks. if we're running as a background task, this is
+// also where queued interactive work gets to jump ahead of us.
+bool should_stop(std::stop_token const &stop) {
+    WorkerPool::preemption_point();
+    if (stop.stop_requested()) {
+        SearchProgress::stopped();
+        return true;
+    }
+    return false;
+}
+
 } // namespace
 
+std::vector<std::pair<size_t, size_t>> chunks(std::string_view file_contents,
+                                              size_t beginning_offset,
+                                              size_t ending_offset,
+                                              size_t min_chunk_size) {
+    std::vector<std::pair<size_t, size_t>> out;
+    while (beginning_offset != ending_offset) {
+        size_t approx_cur_chunk_end =
+            std::min(beginning_offset + min_chunk_size, ending_offset);
+        if (approx_cur_chunk_end == ending_offset) {
+            out.push_back({beginning_offset, ending_offset});
+            break;
+        }
+        size_t cur_chunk_end =
+            file_contents.find_first_of('\n', approx_cur_chunk_end);
+        if (cur_chunk_end == std::string_view::npos) {
+            cur_chunk_end = ending_offset;
+        } else {
+            cur_chunk_end = std::min(cur_chunk_end + 1, ending_offset);
+        }
+
+        out.push_back({beginning_offset, cur_chunk_end});
+        beginning_offset = cur_chunk_end;
+    }
+    return out;
+}
+
 std::optional<size_t> basic_search_first(std::string_view file_contents,
                                          std::string_view pattern,
                                          size_t beginning_offset,
@@ -125,7 +175,7 @@ std::optional<size_t> basic_search_first(std::string_view file_contents,
             if (ending_offset - beginning_offset < 4096 + pattern.length()) {
                 break;
             }
-            if (stop.stop_requested()) {
+            if (should_stop(stop)) {
                 return std::nullopt;
             }
             for (size_t iters = 0; iters < 4096; ++iters) {
@@ -143,6 +193,8 @@ std::optional<size_t> basic_search_first(std::string_view file_contents,
                 ++cur_approx_lower_file_ptr;
                 ++file_contents_ptr;
             }
+            SearchProgress::scanned(beginning_offset - 4096, beginning_offset,
+                                    beginning_offset);
             std::copy(cur_approx_lower_file_ptr,
                       cur_approx_lower_file_ptr + pattern.length(),
                       approx_lower_file_ptr);
@@ -170,15 +222,17 @@ std::optional<size_t> basic_search_first(std::string_view file_contents,
         for (auto [chunk_start, chunk_end] :
              chunks(file_contents, beginning_offset, ending_offset,
                     4 * 1024 * 1024)) {
-            if (stop.stop_requested()) {
+            if (should_stop(stop)) {
                 return std::nullopt;
             }
+            TRACE_SPAN("search", "chunk_scan", chunk_end - chunk_start);
             size_t pos =
                 file_contents.substr(chunk_start, chunk_end - chunk_start)
                     .find(pattern);
             if (pos != std::string::npos) {
                 return pos + chunk_start;
             }
+            SearchProgress::scanned(chunk_start, chunk_end, chunk_end);
         }
         return std::string::npos;
     }
@@ -189,103 +243,655 @@ std::optional<size_t> basic_search_last(std::string_view file_contents,
                                         size_t beginning_offset,
                                         size_t ending_offset, bool caseless,
                                         std::stop_token stop) {
-    assert(caseless == false);
-    for (auto [chunk_start, chunk_end] : chunks(
-             file_contents, beginning_offset, ending_offset, 4 * 1024 * 1024)) {
-        if (stop.stop_requested()) {
+    assert(!pattern.empty());
+
+    std::string lower_pattern;
+    if (caseless) {
+        lower_pattern.resize(pattern.length());
+        tolower(pattern, lower_pattern.data());
+    }
+    auto ch =
+        chunks(file_contents, beginning_offset, ending_offset, 4 * 1024 * 1024);
+    for (auto it = ch.rbegin(); it != ch.rend(); ++it) {
+        auto [chunk_start, chunk_end] = *it;
+        if (should_stop(stop)) {
             return std::nullopt;
         }
+        TRACE_SPAN("search", "chunk_scan", chunk_end - chunk_start);
         std::string_view sub_contents =
             file_contents.substr(chunk_start, chunk_end - chunk_start);
 
-        size_t result = sub_contents.rfind(pattern);
+        size_t result = caseless ? caseless_rfind(sub_contents, lower_pattern)
+                                 : sub_contents.rfind(pattern);
         if (result != std::string::npos) {
             return result + chunk_start;
         }
+        SearchProgress::scanned(chunk_start, chunk_end, chunk_start);
     }
     return std::string::npos;
 }
 
+std::optional<size_t> parallel_search_last(
+    WorkerPool &pool,
+    std::optional<size_t> (*backward_searcher)(std::string_view,
+                                               std::string_view, size_t,
+                                               size_t, bool, std::stop_token),
+    std::string_view file_contents, std::string_view pattern,
+    size_t beginning_offset, size_t ending_offset, bool caseless,
+    std::stop_token stop) {
+    auto ch = chunks(file_contents, beginning_offset, ending_offset,
+                     parallel_chunk_size);
+    if (ch.size() <= 1 || pool.num_threads() <= 1) {
+        return backward_searcher(file_contents, pattern, beginning_offset,
+                                 ending_offset, caseless, stop);
+    }
+
+    SearchProgress *progress = SearchProgress::current();
+    // i counts chunks back from the end, so parallel_for hands out the
+    // nearest ones first. anything further away than a chunk that's already
+    // had a hit can't matter any more and gets skipped.
+    std::vector<size_t> hits(ch.size(), std::string::npos);
+    std::atomic<size_t> nearest_hit = ch.size();
+    std::atomic<bool> stopped = false;
+    pool.parallel_for(
+        WorkerPool::Priority::INTERACTIVE, ch.size(), [&](size_t i) {
+            if (i > nearest_hit.load(std::memory_order_relaxed) ||
+                stopped.load(std::memory_order_relaxed)) {
+                return;
+            }
+            SearchProgress::Scope scope(progress);
+            auto [chunk_start, chunk_end] = ch[ch.size() - 1 - i];
+            std::optional<size_t> result =
+                backward_searcher(file_contents, pattern, chunk_start,
+                                  chunk_end, caseless, stop);
+            if (!result) {
+                stopped = true;
+                return;
+            }
+            if (*result == std::string::npos) {
+                return;
+            }
+            hits[i] = *result;
+            size_t nearest = nearest_hit.load(std::memory_order_relaxed);
+            while (i < nearest &&
+                   !nearest_hit.compare_exchange_weak(nearest, i)) {
+            }
+        });
+    if (stopped) {
+        return std::nullopt;
+    }
+    if (nearest_hit == ch.size()) {
+        return std::string::npos;
+    }
+    return hits[nearest_hit];
+}
+
+std::optional<NearestHits>
+search_nearest(WorkerPool &pool, SearchFunction const &forward_searcher,
+               SearchFunction const &backward_searcher,
+               std::string_view file_contents, std::string_view pattern,
+               size_t start, bool caseless, std::stop_token stop) {
+    struct Side {
+        SearchFunction const *searcher;
+        // nearest to start first
+        std::vector<std::pair<size_t, size_t>> chunks;
+        std::vector<size_t> hits;
+        std::vector<bool> done;
+        // how many of the nearest chunks came up empty
+        size_t num_empty = 0;
+        std::optional<size_t> answer;
+        std::atomic<size_t> nearest_hit;
+    };
+    Side sides[2];
+    Side &forward = sides[0];
+    Side &backward = sides[1];
+    forward.searcher = &forward_searcher;
+    forward.chunks = chunks(file_contents, start, file_contents.size(),
+                            parallel_chunk_size);
+    backward.searcher = &backward_searcher;
+    backward.chunks = chunks(file_contents, 0, start, parallel_chunk_size);
+    std::reverse(backward.chunks.begin(), backward.chunks.end());
+
+    std::mutex mut;
+    std::atomic<bool> settled = false;
+    std::atomic<bool> stopped = false;
+    // call with mut held
+    auto settle = [&](Side &side) {
+        for (; side.num_empty < side.chunks.size() &&
+               side.done[side.num_empty];
+             ++side.num_empty) {
+            if (side.hits[side.num_empty] != std::string::npos) {
+                side.answer = side.hits[side.num_empty];
+                settled = true;
+                return;
+            }
+        }
+        if (side.num_empty == side.chunks.size()) {
+            side.answer = std::string::npos;
+            settled = true;
+        }
+    };
+
+    // the two sides take turns, each at the next distance out
+    std::vector<std::pair<Side *, size_t>> order;
+    for (Side &side : sides) {
+        side.hits.assign(side.chunks.size(), std::string::npos);
+        side.done.assign(side.chunks.size(), false);
+        side.nearest_hit = side.chunks.size();
+        settle(side);
+    }
+    for (size_t i = 0;
+         i < std::max(forward.chunks.size(), backward.chunks.size()); ++i) {
+        for (Side &side : sides) {
+            if (i < side.chunks.size()) {
+                order.push_back({&side, i});
+            }
+        }
+    }
+
+    SearchProgress *progress = SearchProgress::current();
+    if (!settled) {
+        pool.parallel_for(
+            WorkerPool::Priority::INTERACTIVE, order.size(), [&](size_t i) {
+                auto [side, distance] = order[i];
+                if (settled.load(std::memory_order_relaxed) ||
+                    stopped.load(std::memory_order_relaxed) ||
+                    distance > side->nearest_hit.load(
+                                   std::memory_order_relaxed)) {
+                    return;
+                }
+                SearchProgress::Scope scope(progress);
+                auto [chunk_start, chunk_end] = side->chunks[distance];
+                std::optional<size_t> result =
+                    (*side->searcher)(file_contents, pattern, chunk_start,
+                                      chunk_end, caseless, stop);
+                if (!result) {
+                    stopped = true;
+                    return;
+                }
+                std::scoped_lock lock(mut);
+                side->hits[distance] = *result;
+                side->done[distance] = true;
+                if (*result != std::string::npos &&
+                    distance < side->nearest_hit) {
+                    side->nearest_hit = distance;
+                }
+                settle(*side);
+            });
+    }
+    if (stopped) {
+        return std::nullopt;
+    }
+
+    NearestHits out;
+    out.forward = forward.answer;
+    out.backward = backward.answer;
+    out.searched_end = forward.num_empty < forward.chunks.size()
+                           ? forward.chunks[forward.num_empty].first
+                           : file_contents.size();
+    out.searched_begin = backward.num_empty < backward.chunks.size()
+                             ? backward.chunks[backward.num_empty].second
+                             : 0;
+    return out;
+}
+
+void MatchCounter::plan(std::string_view file_contents) {
+    std::vector<std::pair<size_t, size_t>> in_order =
+        chunks(file_contents, 0, file_contents.size(), m_chunk_size);
+    size_t n = in_order.size();
+    size_t num_strata = std::min(m_num_strata, n);
+    // seeded with something fixed, so that a replay counts in the same
+    // order every time
+    std::mt19937_64 rng(n);
+    std::vector<std::vector<size_t>> strata(num_strata);
+    for (size_t h = 0; h < num_strata; ++h) {
+        for (size_t i = h * n / num_strata; i < (h + 1) * n / num_strata;
+             ++i) {
+            strata[h].push_back(i);
+        }
+        std::shuffle(strata[h].begin(), strata[h].end(), rng);
+        m_stratum_sizes.push_back(strata[h].size());
+    }
+    for (size_t round = 0; m_chunks.size() < n; ++round) {
+        for (size_t h = 0; h < num_strata; ++h) {
+            if (round < strata[h].size()) {
+                m_chunks.push_back(in_order[strata[h][round]]);
+                m_strata.push_back((uint32_t)h);
+            }
+        }
+    }
+    m_counts = std::make_unique<std::atomic<uint64_t>[]>(n);
+    for (size_t i = 0; i < n; ++i) {
+        m_counts[i].store(not_counted, std::memory_order_relaxed);
+    }
+    m_planned.store(true, std::memory_order_release);
+}
+
+std::optional<MatchCountEstimate> MatchCounter::estimate() const {
+    if (!m_planned.load(std::memory_order_acquire)) {
+        return std::nullopt;
+    }
+    size_t num_strata = m_stratum_sizes.size();
+    std::vector<double> sums(num_strata);
+    std::vector<double> sums_of_squares(num_strata);
+    std::vector<size_t> counted(num_strata);
+    double sum = 0;
+    double sum_of_squares = 0;
+    size_t num_counted = 0;
+    for (size_t i = 0; i < m_chunks.size(); ++i) {
+        uint64_t count = m_counts[i].load(std::memory_order_relaxed);
+        if (count == not_counted) {
+            continue;
+        }
+        double x = (double)count;
+        sums[m_strata[i]] += x;
+        sums_of_squares[m_strata[i]] += x * x;
+        ++counted[m_strata[i]];
+        sum += x;
+        sum_of_squares += x * x;
+        ++num_counted;
+    }
+
+    MatchCountEstimate out{0, 0, num_counted, m_chunks.size()};
+    if (num_counted == 0) {
+        return out;
+    }
+    // for strata with too few chunks counted to say for themselves. with
+    // only the one chunk to go on, it's as if matches turn up
+    // independently of each other, which makes the count's variance its
+    // mean.
+    double mean = sum / (double)num_counted;
+    double fallback_variance =
+        num_counted < 2
+            ? mean
+            : (sum_of_squares - (double)num_counted * mean * mean) /
+                  (double)(num_counted - 1);
+    double variance = 0;
+    for (size_t h = 0; h < num_strata; ++h) {
+        double size = (double)m_stratum_sizes[h];
+        double n = (double)counted[h];
+        if (counted[h] == m_stratum_sizes[h]) {
+            out.count += sums[h];
+            continue;
+        }
+        if (counted[h] == 0) {
+            out.count += size * mean;
+            variance += size * size * fallback_variance;
+            continue;
+        }
+        double stratum_mean = sums[h] / n;
+        double stratum_variance =
+            counted[h] < 2 ? fallback_variance
+                           : (sums_of_squares[h] - n * stratum_mean *
+                                                       stratum_mean) /
+                                 (n - 1);
+        out.count += size * stratum_mean;
+        // the chunks left to count are all that's uncertain, hence the
+        // finite population correction
+        variance += size * size * (1 - n / size) * stratum_variance / n;
+    }
+    out.margin = 1.96 * std::sqrt(std::max(0.0, variance));
+    return out;
+}
+
+namespace {
+
+// e.g. 1.2M
+std::string abbreviate(double count) {
+    char buf[32];
+    if (count < 1e3) {
+        snprintf(buf, sizeof(buf), "%.0f", count);
+    } else if (count < 1e6) {
+        snprintf(buf, sizeof(buf), "%.1fk", count / 1e3);
+    } else if (count < 1e9) {
+        snprintf(buf, sizeof(buf), "%.1fM", count / 1e6);
+    } else {
+        snprintf(buf, sizeof(buf), "%.1fB", count / 1e9);
+    }
+    return buf;
+}
+
+} // namespace
+
+std::string MatchCountEstimate::describe() const {
+    char buf[128];
+    if (exact()) {
+        snprintf(buf, sizeof(buf), "%.0f match%s", count,
+                 count == 1 ? "" : "es");
+        return buf;
+    }
+    int percent_counted = (int)(100 * chunks_counted / num_chunks);
+    if (chunks_counted == 0) {
+        return "Counting matches...";
+    } else if (count == 0) {
+        snprintf(buf, sizeof(buf), "No matches yet, %d%% counted",
+                 percent_counted);
+    } else if (margin < count / 100) {
+        snprintf(buf, sizeof(buf), "~%s matches (+/-<1%%), %d%% counted",
+                 abbreviate(count).c_str(), percent_counted);
+    } else {
+        snprintf(buf, sizeof(buf), "~%s matches (+/-%.0f%%), %d%% counted",
+                 abbreviate(count).c_str(), 100 * margin / count,
+                 percent_counted);
+    }
+    return buf;
+}
+
+bool count_matches(WorkerPool &pool, SearchFunction const &forward_searcher,
+                   MatchCounter &counter, std::string_view file_contents,
+                   std::string_view pattern, bool caseless,
+                   std::stop_token stop) {
+    counter.plan(file_contents);
+    std::atomic<bool> stopped = false;
+    // nobody's waiting on the last few percent, searches go first
+    pool.parallel_for(
+        WorkerPool::Priority::BACKGROUND, counter.m_chunks.size(),
+        [&](size_t i) {
+            WorkerPool::preemption_point();
+            if (stopped.load(std::memory_order_relaxed)) {
+                return;
+            }
+            auto [chunk_start, chunk_end] = counter.m_chunks[i];
+            std::optional<std::vector<size_t>> hits =
+                search_all(std::cref(forward_searcher), file_contents,
+                           pattern, chunk_start, chunk_end, caseless, stop);
+            if (!hits) {
+                stopped = true;
+                return;
+            }
+            counter.m_counts[i].store(hits->size(),
+                                      std::memory_order_relaxed);
+        });
+    return !stopped && !stop.stop_requested();
+}
+
+std::optional<MatchDensity>
+count_matches_by_bucket(WorkerPool &pool,
+                        SearchFunction const &forward_searcher,
+                        std::string_view file_contents,
+                        std::string_view pattern, size_t num_buckets,
+                        bool caseless, std::stop_token stop) {
+    size_t size = file_contents.size();
+    std::vector<std::atomic<uint64_t>> counts(num_buckets);
+    std::vector<std::atomic<size_t>> first_hits(num_buckets);
+    for (std::atomic<size_t> &first_hit : first_hits) {
+        first_hit.store(std::string::npos, std::memory_order_relaxed);
+    }
+    std::vector<std::pair<size_t, size_t>> ch =
+        chunks(file_contents, 0, size, parallel_chunk_size);
+    std::atomic<bool> stopped = false;
+    pool.parallel_for(
+        WorkerPool::Priority::BACKGROUND, ch.size(), [&](size_t i) {
+            WorkerPool::preemption_point();
+            if (stopped.load(std::memory_order_relaxed)) {
+                return;
+            }
+            auto [chunk_start, chunk_end] = ch[i];
+            // a chunk only covers a bucket or two, so it adds up its own
+            // and only touches the shared ones when it moves on
+            size_t bucket = std::string::npos;
+            uint64_t count = 0;
+            auto add = [&]() {
+                if (count > 0) {
+                    counts[bucket].fetch_add(count,
+                                             std::memory_order_relaxed);
+                }
+            };
+            size_t from = chunk_start;
+            while (true) {
+                std::optional<size_t> hit = forward_searcher(
+                    file_contents, pattern, from, chunk_end, caseless, stop);
+                if (!hit) {
+                    stopped = true;
+                    return;
+                }
+                if (*hit == std::string::npos) {
+                    break;
+                }
+                size_t hit_bucket = *hit * num_buckets / size;
+                if (hit_bucket != bucket) {
+                    add();
+                    bucket = hit_bucket;
+                    count = 0;
+                    // this chunk's first in the bucket, the chunk before
+                    // might have had an earlier one
+                    size_t first = first_hits[bucket].load(
+                        std::memory_order_relaxed);
+                    while (*hit < first &&
+                           !first_hits[bucket].compare_exchange_weak(
+                               first, *hit, std::memory_order_relaxed)) {
+                    }
+                }
+                ++count;
+                // stepped over the same as search_all()
+                from = std::min(*hit + pattern.size(), chunk_end);
+            }
+            add();
+        });
+    if (stopped) {
+        return std::nullopt;
+    }
+    MatchDensity out;
+    for (size_t bucket = 0; bucket < num_buckets; ++bucket) {
+        out.counts.push_back(counts[bucket].load(std::memory_order_relaxed));
+        out.first_hits.push_back(
+            first_hits[bucket].load(std::memory_order_relaxed));
+    }
+    return out;
+}
+
 namespace pcre2 {
 using Code =
     std::unique_ptr<pcre2_code,
                     decltype([](pcre2_code *re) { pcre2_code_free(re); })>;
-Code compile(std::string_view pattern) {
+using MatchData = std::unique_ptr<
+    pcre2_match_data,
+    decltype([](pcre2_match_data *data) { pcre2_match_data_free(data); })>;
+using MatchContext = std::unique_ptr<
+    pcre2_match_context,
+    decltype([](pcre2_match_context *ctx) { pcre2_match_context_free(ctx); })>;
+
+Code compile(std::string_view pattern, uint32_t options) {
+    TRACE_SPAN("search", "regex_compile", pattern.size());
     int errornumber;
     PCRE2_SIZE erroroffset;
     return Code{pcre2_compile((PCRE2_SPTR8)pattern.data(),
                               (PCRE2_SIZE)pattern.size(),
-                              0,            /* default options */
+                              options,
                               &errornumber, /* for error number */
                               &erroroffset, /* for error offset */
                               NULL)};       /* use default compile context */
 }
 
-std::optional<std::pair<size_t, size_t>> match(const Code &code,
-                                               std::string_view subject) {
-    pcre2_match_data *match_data =
-        pcre2_match_data_create_from_pattern(code.get(), NULL);
+// Runs a pattern over a subject a slice of start positions at a time, so a
+// stop request gets noticed within a slice's worth of work. Slices grow
+// while they're quick and shrink when they aren't, so plain scans still go
+// at full speed. That alone doesn't help
+// with catastrophic backtracking, which can take minutes at a single start
+// position, so every slice is first matched with a tight match_limit. A
+// slice that hits it gets matched again with a copy of the pattern
+// compiled with auto callouts, which check for a stop as they go.
+struct Matcher {
+    constexpr static size_t min_slice_size = 1024;
+    constexpr static size_t max_slice_size = 4 * 1024 * 1024;
+    // how long a slice should take, roughly how long a stop can go unseen
+    constexpr static std::chrono::microseconds slice_target{500};
+    // backtracking steps allowed at any one start position before it's
+    // deemed pathological, well under a millisecond
+    constexpr static uint32_t match_limit = 20'000;
+    // and what the callout pass is allowed, past these it gives up on the
+    // slice. KiB, and nested backtracking points.
+    constexpr static uint32_t heap_limit = 256 * 1024;
+    constexpr static uint32_t depth_limit = 1'000'000;
+    // callouts come thick and fast, only look at the token every so often
+    constexpr static unsigned callouts_per_check = 256;
 
-    int rc = pcre2_match(code.get(),                  /* the compiled pattern */
-                         (PCRE2_SPTR8)subject.data(), /* the subject string */
-                         subject.length(), /* the length of the subject */
-                         0,          /* start at offset 0 in the subject */
-                         0,          /* default options */
-                         match_data, /* block for storing the result */
-                         NULL);      /* use default match context */
+    std::string_view m_pattern;
+    uint32_t m_options;
+    std::stop_token m_stop;
+    Code m_code;
+    // compiled the first time a slice needs it
+    Code m_callout_code;
+    MatchData m_match_data;
+    MatchContext m_limited_context;
+    MatchContext m_callout_context;
+    unsigned m_callouts_until_check;
+    size_t m_slice_size;
+    // what it gave up on a slice with, see SearchProgress::m_regex_error.
+    // 0 if it hasn't.
+    int m_error = 0;
 
-    if (rc < 0) {
+    Matcher(std::string_view pattern, bool caseless, std::stop_token stop)
+        : m_pattern(pattern),
+          m_options(PCRE2_USE_OFFSET_LIMIT | (caseless ? PCRE2_CASELESS : 0)),
+          m_stop(std::move(stop)), m_code(compile(pattern, m_options)),
+          m_limited_context(pcre2_match_context_create(NULL)),
+          m_callout_context(pcre2_match_context_create(NULL)),
+          m_callouts_until_check(callouts_per_check),
+          m_slice_size(64 * 1024) {
+        if (m_code) {
+            m_match_data.reset(
+                pcre2_match_data_create_from_pattern(m_code.get(), NULL));
+        }
+        pcre2_set_match_limit(m_limited_context.get(), match_limit);
+        pcre2_set_heap_limit(m_limited_context.get(), heap_limit);
+        pcre2_set_depth_limit(m_limited_context.get(), depth_limit);
+        pcre2_set_heap_limit(m_callout_context.get(), heap_limit);
+        pcre2_set_depth_limit(m_callout_context.get(), depth_limit);
+        pcre2_set_callout(m_callout_context.get(), &Matcher::callout, this);
+    }
+    Matcher(Matcher const &) = delete;
+    Matcher &operator=(Matcher const &) = delete;
+
+    // The first match that starts at or after begin. Anchors and
+    // lookbehinds see the whole subject. nullopt if there isn't one, if the
+    // pattern didn't compile, if it got stopped part way, or if it gave up
+    // on a slice, which leaves m_error set.
+    std::optional<std::pair<size_t, size_t>> find(std::string_view subject,
+                                                  size_t begin) {
+        if (!m_code) {
+            return std::nullopt;
+        }
+        size_t slice_start = begin;
+        while (slice_start < subject.size()) {
+            if (m_stop.stop_requested()) {
+                return std::nullopt;
+            }
+            // only the start of the match is confined to the slice, so
+            // nothing gets missed at the edges
+            size_t slice_end =
+                std::min(slice_start + m_slice_size, subject.size());
+            pcre2_set_offset_limit(m_limited_context.get(), slice_end);
+            pcre2_set_offset_limit(m_callout_context.get(), slice_end);
+            auto slice_began = std::chrono::steady_clock::now();
+            std::optional<std::pair<size_t, size_t>> ret =
+                match(subject, slice_start);
+            if (ret || m_error != 0) {
+                return ret;
+            }
+            auto took = std::chrono::steady_clock::now() - slice_began;
+            if (took < slice_target / 4) {
+                m_slice_size = std::min(m_slice_size * 2, max_slice_size);
+            } else if (took > slice_target) {
+                m_slice_size = std::max(m_slice_size / 2, min_slice_size);
+            }
+            slice_start = slice_end;
+        }
         return std::nullopt;
     }
-    PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(match_data);
-    auto ret = std::make_pair(ovector[0], ovector[1]);
-    pcre2_match_data_free(match_data);
-    return ret;
-}
+
+  private:
+    std::optional<std::pair<size_t, size_t>> match(std::string_view subject,
+                                                   size_t start) {
+        SearchProgress::regex_called();
+        int rc = pcre2_match(m_code.get(), (PCRE2_SPTR8)subject.data(),
+                             subject.length(), start, 0, m_match_data.get(),
+                             m_limited_context.get());
+        if (rc == PCRE2_ERROR_MATCHLIMIT) {
+            if (!m_callout_code) {
+                m_callout_code =
+                    compile(m_pattern, m_options | PCRE2_AUTO_CALLOUT);
+            }
+            SearchProgress::regex_called();
+            rc = pcre2_match(m_callout_code.get(), (PCRE2_SPTR8)subject.data(),
+                             subject.length(), start, 0, m_match_data.get(),
+                             m_callout_context.get());
+        }
+        // the callout's own error only means it was stopped, anything but
+        // no match is it giving up, which mustn't pass for either
+        if (rc < 0) {
+            if (rc != PCRE2_ERROR_NOMATCH && rc != PCRE2_ERROR_CALLOUT) {
+                m_error = rc;
+                SearchProgress::gave_up(rc);
+            }
+            return std::nullopt;
+        }
+        PCRE2_SIZE *ovector = pcre2_get_ovector_pointer(m_match_data.get());
+        return std::make_pair(ovector[0], ovector[1]);
+    }
+
+    static int callout(pcre2_callout_block *, void *data) {
+        Matcher *matcher = static_cast<Matcher *>(data);
+        if (--matcher->m_callouts_until_check > 0) {
+            return 0;
+        }
+        matcher->m_callouts_until_check = callouts_per_check;
+        // anything negative abandons the match with that as the error
+        return matcher->m_stop.stop_requested() ? PCRE2_ERROR_CALLOUT : 0;
+    }
+};
 
 } // namespace pcre2
 
-std::optional<size_t> regex_search_first(std::string_view file_contents,
+std::optional<size_t> pcre2_search_first(std::string_view file_contents,
                                          std::string_view pattern,
                                          size_t beginning_offset,
                                          size_t ending_offset, bool caseless,
                                          std::stop_token stop) {
-    assert(caseless == false);
-    pcre2::Code re = pcre2::compile(pattern);
+    pcre2::Matcher matcher(pattern, caseless, stop);
 
     // split into line-aligned 4MB chunks
     for (auto [chunk_start, chunk_end] : chunks(
              file_contents, beginning_offset, ending_offset, 4 * 1024 * 1024)) {
-        if (stop.stop_requested()) {
+        if (should_stop(stop)) {
             return std::nullopt;
         }
-        std::optional<std::pair<size_t, size_t>> ret = pcre2::match(
-            re, file_contents.substr(chunk_start, chunk_end - chunk_start));
+        TRACE_SPAN("search", "chunk_scan", chunk_end - chunk_start);
+        std::optional<std::pair<size_t, size_t>> ret = matcher.find(
+            file_contents.substr(chunk_start, chunk_end - chunk_start), 0);
         if (ret) {
             return ret->first + chunk_start;
         }
+        if (matcher.m_error != 0) {
+            return std::nullopt;
+        }
+        SearchProgress::scanned(chunk_start, chunk_end, chunk_end);
+    }
+    // a stop in the last chunk would otherwise look like no match
+    if (should_stop(stop)) {
+        return std::nullopt;
     }
     return std::string_view::npos;
 }
 
-std::optional<size_t> regex_search_last(std::string_view file_contents,
+std::optional<size_t> pcre2_search_last(std::string_view file_contents,
                                         std::string_view pattern,
                                         size_t beginning_offset,
                                         size_t ending_offset, bool caseless,
                                         std::stop_token stop) {
-    assert(caseless == false);
-    pcre2::Code re = pcre2::compile(pattern);
+    pcre2::Matcher matcher(pattern, caseless, stop);
 
     // split into line-aligned 4MB chunks
     auto ch =
         chunks(file_contents, beginning_offset, ending_offset, 4 * 1024 * 1024);
     for (auto it = ch.rbegin(); it != ch.rend(); ++it) {
         auto [chunk_start, chunk_end] = *it;
-        if (stop.stop_requested()) {
+        if (should_stop(stop)) {
             return std::nullopt;
         }
-        std::optional<std::pair<size_t, size_t>> ret = pcre2::match(
-            re, file_contents.substr(chunk_start, chunk_end - chunk_start));
+        TRACE_SPAN("search", "chunk_scan", chunk_end - chunk_start);
+        std::optional<std::pair<size_t, size_t>> ret = matcher.find(
+            file_contents.substr(chunk_start, chunk_end - chunk_start), 0);
         if (ret) {
             // Found first matching chunk, now flip that chunk by lines and then
             // search on it
@@ -293,9 +899,15 @@ std::optional<size_t> regex_search_last(std::string_view file_contents,
                 file_contents.substr(chunk_start, chunk_end - chunk_start));
 
             std::optional<std::pair<size_t, size_t>> actual_ret =
-                pcre2::match(re, flipped_chunk);
-
-            assert(actual_ret);
+                matcher.find(flipped_chunk, 0);
+            if (!actual_ret) {
+                if (matcher.m_error != 0 || should_stop(stop)) {
+                    return std::nullopt;
+                }
+                // a match that spans lines can come apart when they're
+                // flipped, the one that was found will have to do
+                return ret->first + chunk_start;
+            }
 
             size_t line_offset_of_match =
                 flipped_chunk.find_last_of('\n', actual_ret->first);
@@ -308,6 +920,776 @@ std::optional<size_t> regex_search_last(std::string_view file_contents,
             return actual_ret->first - line_offset_of_match +
                    original_line_offset + chunk_start;
         }
+        if (matcher.m_error != 0) {
+            return std::nullopt;
+        }
+        SearchProgress::scanned(chunk_start, chunk_end, chunk_start);
+    }
+    if (should_stop(stop)) {
+        return std::nullopt;
     }
     return std::string_view::npos;
 }
+
+std::string regex_error_message(int error) {
+    PCRE2_UCHAR buffer[256];
+    if (pcre2_get_error_message(error, buffer, sizeof(buffer)) < 0) {
+        return "PCRE2 error " + std::to_string(error);
+    }
+    return (char *)buffer;
+}
+
+namespace dfa {
+
+// every scan checks for a stop this often, a DFA gets through one of these
+// in well under a millisecond
+constexpr size_t block_size = 256 * 1024;
+
+// What the DFA kernels need for a pattern: it forwards to find where a
+// match ends, backwards from there to find where it starts, and backwards
+// from the end of the range to find the last one.
+struct Regex {
+    std::string m_pattern;
+    bool m_caseless;
+    std::unique_ptr<RegexNode> m_root;
+    Nfa m_forward;
+    Nfa m_reverse_anchored;
+    Nfa m_reverse;
+    LazyDfa m_forward_dfa;
+    LazyDfa m_reverse_anchored_dfa;
+    LazyDfa m_reverse_dfa;
+
+    Regex(std::string_view pattern, bool caseless,
+          std::unique_ptr<RegexNode> root)
+        : m_pattern(pattern), m_caseless(caseless), m_root(std::move(root)),
+          m_forward(*m_root, false, true),
+          m_reverse_anchored(*m_root, true, false),
+          m_reverse(*m_root, true, true), m_forward_dfa(&m_forward, true),
+          m_reverse_anchored_dfa(&m_reverse_anchored, false),
+          m_reverse_dfa(&m_reverse, false) {
+    }
+    Regex(Regex const &) = delete;
+    Regex &operator=(Regex const &) = delete;
+
+    // Compiling, and more so the DFA states, carry over from one call to
+    // the next for the same pattern, which is what n and search_all look
+    // like. One per thread, the DFAs aren't thread safe. nullptr if the
+    // pattern needs PCRE2.
+    static Regex *get(std::string_view pattern, bool caseless) {
+        thread_local std::unique_ptr<Regex> t_regex;
+        // the last pattern that turned out to need PCRE2, so it doesn't get
+        // parsed every time either
+        thread_local std::optional<std::pair<std::string, bool>>
+            t_unsupported;
+        if (t_regex && t_regex->m_pattern == pattern &&
+            t_regex->m_caseless == caseless) {
+            return t_regex.get();
+        }
+        if (t_unsupported && t_unsupported->first == pattern &&
+            t_unsupported->second == caseless) {
+            return nullptr;
+        }
+        t_regex = compile(pattern, caseless);
+        if (t_regex) {
+            return t_regex.get();
+        }
+        t_unsupported = {std::string(pattern), caseless};
+        return nullptr;
+    }
+
+    // nullptr if the pattern needs PCRE2
+    static std::unique_ptr<Regex> compile(std::string_view pattern,
+                                          bool caseless) {
+        TRACE_SPAN("search", "dfa_compile", pattern.size());
+        std::unique_ptr<RegexNode> root =
+            RegexParser(pattern, caseless).parse();
+        if (!root) {
+            return nullptr;
+        }
+        auto regex =
+            std::make_unique<Regex>(pattern, caseless, std::move(root));
+        if (!regex->m_forward.ok() || !regex->m_reverse_anchored.ok() ||
+            !regex->m_reverse.ok()) {
+            return nullptr;
+        }
+        return regex;
+    }
+};
+
+// Where the leftmost-first match in [begin, end) ends, scanning with the
+// forward DFA, npos if there isn't one. Calls on_match(state) with each
+// matching state as it goes, the last one being what that match was.
+// nullopt if stopped, or if the DFA gave up, which also sets gave_up.
+template <typename OnMatch>
+std::optional<size_t> scan_to_match_end(LazyDfa &forward,
+                                        std::string_view file_contents,
+                                        size_t begin, size_t end,
+                                        std::stop_token const &stop,
+                                        bool &gave_up, OnMatch &&on_match) {
+    using State = LazyDfa::State;
+    if (begin >= end) {
+        return std::string_view::npos;
+    }
+    const char *data = file_contents.data();
+    forward.m_resets = 0;
+    State state = forward.start();
+    size_t match_end = std::string_view::npos;
+    if (state & LazyDfa::match_flag) {
+        // matches nothing at all, and maybe more than that
+        match_end = begin;
+        on_match(state);
+    }
+
+    size_t pos = begin;
+    while (pos < end && state < LazyDfa::gave_up) {
+        if (should_stop(stop)) {
+            return std::nullopt;
+        }
+        size_t block_begin = pos;
+        size_t block_end = std::min(pos + block_size, end);
+        TRACE_SPAN("search", "dfa_scan", block_end - block_begin);
+        while (pos < block_end) {
+            if (state & LazyDfa::start_flag) {
+                pos = (size_t)(forward.skip_forward(data + pos,
+                                                    data + block_end) -
+                               data);
+                if (pos == block_end) {
+                    break;
+                }
+            }
+            while (pos < block_end) {
+                state = forward.next(state, (uint8_t)data[pos++]);
+                if (state & LazyDfa::flags) {
+                    break;
+                }
+            }
+            if (state >= LazyDfa::gave_up) {
+                break;
+            }
+            if (state & LazyDfa::match_flag) {
+                match_end = pos;
+                on_match(state);
+            }
+        }
+        SearchProgress::scanned(block_begin, pos, pos);
+    }
+    if (state == LazyDfa::gave_up) {
+        gave_up = true;
+        return std::nullopt;
+    }
+    if (match_end == std::string_view::npos && should_stop(stop)) {
+        // a stop in the last block would otherwise look like no match
+        return std::nullopt;
+    }
+    return match_end;
+}
+
+// The furthest back a match that ends at match_end can start, which for
+// the end of a leftmost-first match is where it starts.
+std::optional<size_t> scan_to_match_start(LazyDfa &reverse_anchored,
+                                          std::string_view file_contents,
+                                          size_t begin, size_t match_end,
+                                          std::stop_token const &stop,
+                                          bool &gave_up) {
+    using State = LazyDfa::State;
+    const char *data = file_contents.data();
+    reverse_anchored.m_resets = 0;
+    State state = reverse_anchored.start();
+    size_t match_start = state & LazyDfa::match_flag
+                             ? match_end
+                             : std::string_view::npos;
+    for (size_t pos = match_end; pos > begin; --pos) {
+        if (pos % block_size == 0 && should_stop(stop)) {
+            return std::nullopt;
+        }
+        state = reverse_anchored.next(state, (uint8_t)data[pos - 1]);
+        if (state >= LazyDfa::gave_up) {
+            break;
+        }
+        if (state & LazyDfa::match_flag) {
+            match_start = pos - 1;
+        }
+    }
+    if (state == LazyDfa::gave_up) {
+        gave_up = true;
+        return std::nullopt;
+    }
+    assert(match_start != std::string_view::npos);
+    return match_start;
+}
+
+// Where the leftmost match in [begin, end) starts, npos if there isn't one.
+// nullopt if stopped, or if a DFA gave up, which also sets gave_up.
+std::optional<size_t> find_first(Regex &regex,
+                                 std::string_view file_contents, size_t begin,
+                                 size_t end, std::stop_token const &stop,
+                                 bool &gave_up) {
+    if (begin < end && (regex.m_forward_dfa.start() & LazyDfa::match_flag)) {
+        // matches nothing at all, so it matches right here
+        return begin;
+    }
+    std::optional<size_t> match_end =
+        scan_to_match_end(regex.m_forward_dfa, file_contents, begin, end,
+                          stop, gave_up, [](LazyDfa::State) {});
+    if (!match_end || *match_end == std::string_view::npos) {
+        return match_end;
+    }
+    return scan_to_match_start(regex.m_reverse_anchored_dfa, file_contents,
+                               begin, *match_end, stop, gave_up);
+}
+
+// The start of the line that the last match in [begin, end) starts on,
+// going by a DFA that scans backwards for any match at all. npos if there
+// isn't one.
+std::optional<size_t> find_last_line(LazyDfa &reverse,
+                                     std::string_view file_contents,
+                                     size_t begin, size_t end,
+                                     std::stop_token const &stop,
+                                     bool &gave_up) {
+    using State = LazyDfa::State;
+    const char *data = file_contents.data();
+    reverse.m_resets = 0;
+
+    // the start of the last match, scanning backwards that's the first
+    // place the DFA says a match starts
+    State state = reverse.start();
+    size_t found = std::string_view::npos;
+    size_t pos = end;
+    while (pos > begin && state < LazyDfa::gave_up &&
+           found == std::string_view::npos) {
+        if (should_stop(stop)) {
+            return std::nullopt;
+        }
+        size_t block_end = pos;
+        size_t block_begin = pos - std::min(block_size, pos - begin);
+        TRACE_SPAN("search", "dfa_scan", block_end - block_begin);
+        while (pos > block_begin) {
+            if (state & LazyDfa::start_flag) {
+                const char *hit =
+                    reverse.skip_backward(data + block_begin, data + pos);
+                if (!hit) {
+                    pos = block_begin;
+                    break;
+                }
+                pos = (size_t)(hit - data) + 1;
+            }
+            while (pos > block_begin) {
+                state = reverse.next(state, (uint8_t)data[--pos]);
+                if (state & LazyDfa::flags) {
+                    break;
+                }
+            }
+            if (state >= LazyDfa::gave_up) {
+                break;
+            }
+            if (state & LazyDfa::match_flag) {
+                found = pos;
+                break;
+            }
+        }
+        SearchProgress::scanned(pos, block_end, pos);
+    }
+    if (state == LazyDfa::gave_up) {
+        gave_up = true;
+        return std::nullopt;
+    }
+    if (found == std::string_view::npos) {
+        if (should_stop(stop)) {
+            return std::nullopt;
+        }
+        return std::string_view::npos;
+    }
+
+    size_t line_start = begin;
+    if (found > begin) {
+        size_t newline = file_contents.rfind('\n', found - 1);
+        if (newline != std::string_view::npos && newline + 1 > begin) {
+            line_start = newline + 1;
+        }
+    }
+    return line_start;
+}
+
+// Same as pcre2_search_last(): the first match on the last line in
+// [begin, end) that has one.
+std::optional<size_t> find_last(Regex &regex, std::string_view file_contents,
+                                size_t begin, size_t end,
+                                std::stop_token const &stop, bool &gave_up) {
+    std::optional<size_t> line_start = find_last_line(
+        regex.m_reverse_dfa, file_contents, begin, end, stop, gave_up);
+    if (!line_start || *line_start == std::string_view::npos) {
+        return line_start;
+    }
+    return find_first(regex, file_contents, *line_start, end, stop, gave_up);
+}
+
+// The pins compiled together into one NFA, with a MATCH state for each so
+// the DFA states can say which of them matched, and each on its own too,
+// for finding where their matches start.
+struct PinSet {
+    std::vector<PinnedPattern> m_pins;
+    std::vector<std::unique_ptr<Regex>> m_regexes;
+    Nfa m_forward;
+    Nfa m_reverse;
+    // keeps every pin's threads going, so it sees all of them match
+    LazyDfa m_all_dfa;
+    LazyDfa m_first_dfa;
+    LazyDfa m_reverse_dfa;
+
+    PinSet(std::vector<PinnedPattern> pins,
+           std::vector<std::unique_ptr<Regex>> regexes)
+        : m_pins(std::move(pins)), m_regexes(std::move(regexes)),
+          m_forward(roots(m_regexes), false, true),
+          m_reverse(roots(m_regexes), true, true),
+          m_all_dfa(&m_forward, false), m_first_dfa(&m_forward, true),
+          m_reverse_dfa(&m_reverse, false) {
+    }
+    PinSet(PinSet const &) = delete;
+    PinSet &operator=(PinSet const &) = delete;
+
+    // One per thread, like Regex::get(). nullptr if any of them can't be
+    // pinned.
+    static PinSet *get(std::vector<PinnedPattern> const &pins) {
+        thread_local std::unique_ptr<PinSet> t_set;
+        thread_local std::optional<std::vector<PinnedPattern>> t_unsupported;
+        if (t_set && t_set->m_pins == pins) {
+            return t_set.get();
+        }
+        if (t_unsupported == pins) {
+            return nullptr;
+        }
+        t_set.reset();
+        std::vector<std::unique_ptr<Regex>> regexes;
+        for (PinnedPattern const &pin : pins) {
+            if (FieldQuery::from_pattern(pin.pattern)) {
+                break;
+            }
+            std::unique_ptr<Regex> regex =
+                Regex::compile(pin.pattern, pin.caseless);
+            if (!regex) {
+                break;
+            }
+            regexes.push_back(std::move(regex));
+        }
+        if (!pins.empty() && regexes.size() == pins.size()) {
+            auto set = std::make_unique<PinSet>(pins, std::move(regexes));
+            if (set->m_forward.ok() && set->m_reverse.ok()) {
+                t_set = std::move(set);
+                return t_set.get();
+            }
+        }
+        t_unsupported = pins;
+        return nullptr;
+    }
+
+    // the pin that state of m_all_dfa or m_first_dfa is a match of, the
+    // first one if there's more than one
+    size_t pin_of(LazyDfa const &dfa, LazyDfa::State state) const {
+        for (uint32_t id : dfa.m_sets[state >> 8]) {
+            // the MATCH states are the first ones
+            if (id < m_pins.size()) {
+                return id;
+            }
+        }
+        assert(false);
+        return 0;
+    }
+
+    std::optional<std::vector<PinnedMatch>> matches(std::string_view text) {
+        using State = LazyDfa::State;
+        // which of them are in it at all, in one pass
+        uint64_t found = 0;
+        uint64_t all = m_pins.size() == 64 ? ~(uint64_t)0
+                                           : ((uint64_t)1 << m_pins.size()) - 1;
+        auto note = [&](State state) {
+            for (uint32_t id : m_all_dfa.m_sets[state >> 8]) {
+                if (id < m_pins.size()) {
+                    found |= (uint64_t)1 << id;
+                }
+            }
+        };
+        const char *data = text.data();
+        m_all_dfa.m_resets = 0;
+        State state = m_all_dfa.start();
+        if (state & LazyDfa::match_flag) {
+            note(state);
+        }
+        for (size_t pos = 0; pos < text.size() && found != all;) {
+            if (state & LazyDfa::start_flag) {
+                pos = (size_t)(m_all_dfa.skip_forward(data + pos,
+                                                      data + text.size()) -
+                               data);
+                if (pos == text.size()) {
+                    break;
+                }
+            }
+            state = m_all_dfa.next(state, (uint8_t)data[pos++]);
+            if (state >= LazyDfa::gave_up) {
+                break;
+            }
+            if (state & LazyDfa::match_flag) {
+                note(state);
+            }
+        }
+        if (state == LazyDfa::gave_up) {
+            return std::nullopt;
+        }
+
+        // and where exactly, for the ones that are
+        std::vector<PinnedMatch> out;
+        std::stop_token never;
+        for (size_t pin = 0; pin < m_pins.size(); ++pin) {
+            if (!(found & ((uint64_t)1 << pin))) {
+                continue;
+            }
+            Regex &regex = *m_regexes[pin];
+            bool gave_up = false;
+            for (size_t pos = 0; pos < text.size();) {
+                std::optional<size_t> end =
+                    scan_to_match_end(regex.m_forward_dfa, text, pos,
+                                      text.size(), never, gave_up,
+                                      [](State) {});
+                if (!end || *end == std::string_view::npos) {
+                    break;
+                }
+                std::optional<size_t> start =
+                    scan_to_match_start(regex.m_reverse_anchored_dfa, text,
+                                        pos, *end, never, gave_up);
+                if (!start) {
+                    break;
+                }
+                if (*end > *start) {
+                    out.push_back({*start, *end - *start, pin});
+                }
+                pos = std::max(*end, *start + 1);
+            }
+            if (gave_up) {
+                return std::nullopt;
+            }
+        }
+        return out;
+    }
+
+  private:
+    static std::vector<RegexNode const *>
+    roots(std::vector<std::unique_ptr<Regex>> const &regexes) {
+        std::vector<RegexNode const *> out;
+        for (auto const &regex : regexes) {
+            out.push_back(regex->m_root.get());
+        }
+        return out;
+    }
+};
+
+// Where the leftmost match of any of the pins in [begin, end) starts, npos
+// if there isn't one. The one that wins is the one whose MATCH was in the
+// last matching state, and its own reverse DFA finds where it started.
+std::optional<size_t> find_first(PinSet &set, std::string_view file_contents,
+                                 size_t begin, size_t end,
+                                 std::stop_token const &stop, bool &gave_up) {
+    if (begin < end && (set.m_first_dfa.start() & LazyDfa::match_flag)) {
+        return begin;
+    }
+    size_t pin = 0;
+    std::optional<size_t> match_end = scan_to_match_end(
+        set.m_first_dfa, file_contents, begin, end, stop, gave_up,
+        [&](LazyDfa::State state) {
+            pin = set.pin_of(set.m_first_dfa, state);
+        });
+    if (!match_end || *match_end == std::string_view::npos) {
+        return match_end;
+    }
+    return scan_to_match_start(set.m_regexes[pin]->m_reverse_anchored_dfa,
+                               file_contents, begin, *match_end, stop,
+                               gave_up);
+}
+
+std::optional<size_t> find_last(PinSet &set, std::string_view file_contents,
+                                size_t begin, size_t end,
+                                std::stop_token const &stop, bool &gave_up) {
+    std::optional<size_t> line_start = find_last_line(
+        set.m_reverse_dfa, file_contents, begin, end, stop, gave_up);
+    if (!line_start || *line_start == std::string_view::npos) {
+        return line_start;
+    }
+    return find_first(set, file_contents, *line_start, end, stop, gave_up);
+}
+
+std::atomic<RegexEngine> g_engine{RegexEngine::AUTO};
+
+} // namespace dfa
+
+std::optional<size_t> dfa_search_first(std::string_view file_contents,
+                                       std::string_view pattern,
+                                       size_t beginning_offset,
+                                       size_t ending_offset, bool caseless,
+                                       std::stop_token stop) {
+    dfa::Regex *regex = dfa::Regex::get(pattern, caseless);
+    bool gave_up = false;
+    if (regex) {
+        std::optional<size_t> ret =
+            dfa::find_first(*regex, file_contents, beginning_offset,
+                            ending_offset, stop, gave_up);
+        if (!gave_up) {
+            return ret;
+        }
+    }
+    return pcre2_search_first(file_contents, pattern, beginning_offset,
+                              ending_offset, caseless, stop);
+}
+
+std::optional<size_t> dfa_search_last(std::string_view file_contents,
+                                      std::string_view pattern,
+                                      size_t beginning_offset,
+                                      size_t ending_offset, bool caseless,
+                                      std::stop_token stop) {
+    dfa::Regex *regex = dfa::Regex::get(pattern, caseless);
+    bool gave_up = false;
+    if (regex) {
+        std::optional<size_t> ret =
+            dfa::find_last(*regex, file_contents, beginning_offset,
+                           ending_offset, stop, gave_up);
+        if (!gave_up) {
+            return ret;
+        }
+    }
+    return pcre2_search_last(file_contents, pattern, beginning_offset,
+                             ending_offset, caseless, stop);
+}
+
+bool can_pin(std::string_view pattern, bool caseless) {
+    return !FieldQuery::from_pattern(pattern) &&
+           dfa::Regex::compile(pattern, caseless) != nullptr;
+}
+
+std::optional<std::vector<PinnedMatch>>
+pinned_matches(std::string_view text, std::vector<PinnedPattern> const &pins) {
+    if (pins.empty()) {
+        return std::vector<PinnedMatch>{};
+    }
+    dfa::PinSet *set = dfa::PinSet::get(pins);
+    if (!set) {
+        return std::nullopt;
+    }
+    return set->matches(text);
+}
+
+std::optional<size_t>
+pinned_search_first(std::string_view file_contents,
+                    std::vector<PinnedPattern> const &pins,
+                    size_t beginning_offset, size_t ending_offset,
+                    std::stop_token stop) {
+    dfa::PinSet *set = dfa::PinSet::get(pins);
+    bool gave_up = false;
+    if (set) {
+        std::optional<size_t> ret =
+            dfa::find_first(*set, file_contents, beginning_offset,
+                            ending_offset, stop, gave_up);
+        if (!gave_up) {
+            return ret;
+        }
+    }
+    // one at a time then
+    size_t first = std::string::npos;
+    for (PinnedPattern const &pin : pins) {
+        std::optional<size_t> hit =
+            regex_search_first(file_contents, pin.pattern, beginning_offset,
+                               ending_offset, pin.caseless, stop);
+        if (!hit) {
+            return std::nullopt;
+        }
+        first = std::min(first, *hit);
+    }
+    return first;
+}
+
+std::optional<size_t>
+pinned_search_last(std::string_view file_contents,
+                   std::vector<PinnedPattern> const &pins,
+                   size_t beginning_offset, size_t ending_offset,
+                   std::stop_token stop) {
+    dfa::PinSet *set = dfa::PinSet::get(pins);
+    bool gave_up = false;
+    if (set) {
+        std::optional<size_t> ret =
+            dfa::find_last(*set, file_contents, beginning_offset,
+                           ending_offset, stop, gave_up);
+        if (!gave_up) {
+            return ret;
+        }
+    }
+    size_t last = std::string::npos;
+    for (PinnedPattern const &pin : pins) {
+        std::optional<size_t> hit =
+            regex_search_last(file_contents, pin.pattern, beginning_offset,
+                              ending_offset, pin.caseless, stop);
+        if (!hit) {
+            return std::nullopt;
+        }
+        if (*hit != std::string::npos &&
+            (last == std::string::npos || *hit > last)) {
+            last = *hit;
+        }
+    }
+    return last;
+}
+
+void set_regex_engine(RegexEngine engine) {
+    dfa::g_engine.store(engine, std::memory_order_relaxed);
+}
+
+void set_field_queries(bool enabled) {
+    FieldQuery::g_enabled.store(enabled, std::memory_order_relaxed);
+}
+
+std::optional<RegexEngine> parse_regex_engine(std::string_view name) {
+    if (name == "auto") {
+        return RegexEngine::AUTO;
+    } else if (name == "pcre2") {
+        return RegexEngine::PCRE2;
+    }
+    return std::nullopt;
+}
+
+namespace {
+
+// only the lines with the last key in them get scanned, they're few enough
+// that finding them is most of the work
+std::optional<size_t> find_field_first(FieldQuery const &query,
+                                       std::string_view file_contents,
+                                       size_t beginning_offset,
+                                       size_t ending_offset, bool caseless,
+                                       std::stop_token stop) {
+    std::string needle = query.needle();
+    for (auto [chunk_start, chunk_end] :
+         chunks(file_contents, beginning_offset, ending_offset,
+                4 * 1024 * 1024)) {
+        if (should_stop(stop)) {
+            return std::nullopt;
+        }
+        TRACE_SPAN("search", "field_scan", chunk_end - chunk_start);
+        std::string_view chunk = file_contents.substr(0, chunk_end);
+        for (size_t pos = chunk.find(needle, chunk_start);
+             pos != std::string_view::npos;) {
+            std::string_view line =
+                FieldQuery::line_around(file_contents, pos);
+            size_t line_start = (size_t)(line.data() - file_contents.data());
+            size_t hit = std::string::npos;
+            query.scan(line, [&](size_t key_offset, std::string_view value) {
+                if (line_start + key_offset < beginning_offset ||
+                    line_start + key_offset >= ending_offset ||
+                    !query.value_matches(value, caseless)) {
+                    return false;
+                }
+                hit = line_start + key_offset;
+                return true;
+            });
+            if (hit != std::string::npos) {
+                return hit;
+            }
+            pos = chunk.find(needle, line_start + line.size());
+        }
+        SearchProgress::scanned(chunk_start, chunk_end, chunk_end);
+    }
+    return std::string::npos;
+}
+
+std::optional<size_t> find_field_last(FieldQuery const &query,
+                                      std::string_view file_contents,
+                                      size_t beginning_offset,
+                                      size_t ending_offset, bool caseless,
+                                      std::stop_token stop) {
+    std::string needle = query.needle();
+    auto ch =
+        chunks(file_contents, beginning_offset, ending_offset, 4 * 1024 * 1024);
+    for (auto it = ch.rbegin(); it != ch.rend(); ++it) {
+        auto [chunk_start, chunk_end] = *it;
+        if (should_stop(stop)) {
+            return std::nullopt;
+        }
+        TRACE_SPAN("search", "field_scan", chunk_end - chunk_start);
+        for (size_t end = chunk_end; end > chunk_start;) {
+            size_t pos = file_contents.substr(chunk_start, end - chunk_start)
+                             .rfind(needle);
+            if (pos == std::string_view::npos) {
+                break;
+            }
+            std::string_view line = FieldQuery::line_around(
+                file_contents, chunk_start + pos);
+            size_t line_start = (size_t)(line.data() - file_contents.data());
+            size_t hit = std::string::npos;
+            query.scan(line, [&](size_t key_offset, std::string_view value) {
+                if (line_start + key_offset >= beginning_offset &&
+                    line_start + key_offset < ending_offset &&
+                    query.value_matches(value, caseless)) {
+                    hit = line_start + key_offset;
+                }
+                return false;
+            });
+            if (hit != std::string::npos) {
+                return hit;
+            }
+            end = line_start;
+        }
+        SearchProgress::scanned(chunk_start, chunk_end, chunk_start);
+    }
+    return std::string::npos;
+}
+
+} // namespace
+
+std::optional<size_t> field_search_first(std::string_view file_contents,
+                                         std::string_view pattern,
+                                         size_t beginning_offset,
+                                         size_t ending_offset, bool caseless,
+                                         std::stop_token stop) {
+    std::optional<FieldQuery> query = FieldQuery::parse(pattern);
+    assert(query);
+    return find_field_first(*query, file_contents, beginning_offset,
+                            ending_offset, caseless, std::move(stop));
+}
+
+std::optional<size_t> field_search_last(std::string_view file_contents,
+                                        std::string_view pattern,
+                                        size_t beginning_offset,
+                                        size_t ending_offset, bool caseless,
+                                        std::stop_token stop) {
+    std::optional<FieldQuery> query = FieldQuery::parse(pattern);
+    assert(query);
+    return find_field_last(*query, file_contents, beginning_offset,
+                           ending_offset, caseless, std::move(stop));
+}
+
+std::optional<size_t> regex_search_first(std::string_view file_contents,
+                                         std::string_view pattern,
+                                         size_t beginning_offset,
+                                         size_t ending_offset, bool caseless,
+                                         std::stop_token stop) {
+    if (std::optional<FieldQuery> query = FieldQuery::from_pattern(pattern)) {
+        return find_field_first(*query, file_contents, beginning_offset,
+                                ending_offset, caseless, std::move(stop));
+    }
+    if (dfa::g_engine.load(std::memory_order_relaxed) == RegexEngine::PCRE2) {
+        return pcre2_search_first(file_contents, pattern, beginning_offset,
+                                  ending_offset, caseless, std::move(stop));
+    }
+    return dfa_search_first(file_contents, pattern, beginning_offset,
+                            ending_offset, caseless, std::move(stop));
+}
+
+std::optional<size_t> regex_search_last(std::string_view file_contents,
+                                        std::string_view pattern,
+                                        size_t beginning_offset,
+                                        size_t ending_offset, bool caseless,
+                                        std::stop_token stop) {
+    if (std::optional<FieldQuery> query = FieldQuery::from_pattern(pattern)) {
+        return find_field_last(*query, file_contents, beginning_offset,
+                               ending_offset, caseless, std::move(stop));
+    }
+    if (dfa::g_engine.load(std::memory_order_relaxed) == RegexEngine::PCRE2) {
+        return pcre2_search_last(file_contents, pattern, beginning_offset,
+                                 ending_offset, caseless, std::move(stop));
+    }
+    return dfa_search_last(file_contents, pattern, beginning_offset,
+                           ending_offset, caseless, std::move(stop));
+}
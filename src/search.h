@@ -2,10 +2,13 @@
 
 #include <assert.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #include <algorithm>
+#include <atomic>
 #include <deque>
 #include <functional>
+#include <memory>
 #include <optional>
 #include <stdexcept>
 #include <stop_token>
@@ -13,6 +16,10 @@
 #include <string_view>
 #include <vector>
 
+#include "SearchProgress.h"
+
+struct WorkerPool;
+
 template <typename ForwardSearcher>
 std::optional<std::vector<size_t>>
 search_all(ForwardSearcher forward_searcher, std::string_view file_contents,
@@ -29,9 +36,11 @@ search_all(ForwardSearcher forward_searcher, std::string_view file_contents,
         if (*offset == std::string::npos) {
             break;
         }
+        SearchProgress::found();
         out.push_back(*offset);
-        // i think this is flawed
-        beginning_offset = *offset + pattern.size();
+        // i think this is flawed. a regex can match less than its own
+        // length, so at least don't run off the end.
+        beginning_offset = std::min(*offset + pattern.size(), ending_offset);
     }
     return out;
 }
@@ -53,6 +62,7 @@ search_forward_n(ForwardSearcher forward_searcher, size_t num_repeats,
         if (*result == std::string::npos) {
             break;
         }
+        SearchProgress::found();
         latest_hit = *result;
         beginning_offset = *result + 1;
     }
@@ -76,6 +86,7 @@ search_backward_n(BackwardSearcher backward_searcher, size_t num_repeats,
         if (*result == std::string::npos) {
             break;
         }
+        SearchProgress::found();
         latest_hit = *result;
         ending_offset = *result;
     }
@@ -94,6 +105,9 @@ std::optional<size_t> basic_search_last(std::string_view file_contents,
                                         size_t ending_offset, bool caseless,
                                         std::stop_token stop);
 
+// Patterns like .status=500 are field queries rather than regexes once
+// set_field_queries() turns them on, see FieldQuery in JsonFields.h, and
+// these hand them to the field_ kernels.
 std::optional<size_t> regex_search_first(std::string_view file_contents,
                                          std::string_view pattern,
                                          size_t beginning_offset,
@@ -105,3 +119,237 @@ std::optional<size_t> regex_search_last(std::string_view file_contents,
                                         size_t beginning_offset,
                                         size_t ending_offset, bool caseless,
                                         std::stop_token stop);
+
+// Runs backward_searcher over line aligned chunks of [beginning_offset,
+// ending_offset) on every thread in pool, nearest to ending_offset first,
+// and returns the hit from the nearest chunk that has one. That's what
+// backward_searcher would have found on its own, as long as matches don't
+// span lines. Call it from a job on pool, the calling thread joins in.
+std::optional<size_t> parallel_search_last(
+    WorkerPool &pool,
+    std::optional<size_t> (*backward_searcher)(std::string_view,
+                                               std::string_view, size_t,
+                                               size_t, bool, std::stop_token),
+    std::string_view file_contents, std::string_view pattern,
+    size_t beginning_offset, size_t ending_offset, bool caseless,
+    std::stop_token stop);
+
+// The kernels above, or anything that behaves like them.
+using SearchFunction = std::function<std::optional<size_t>(
+    std::string_view, std::string_view, size_t, size_t, bool,
+    std::stop_token)>;
+
+// What search_nearest() found either side of where it started.
+struct NearestHits {
+    // the first hit at or after start and the last one before it, npos if
+    // there isn't one. nullopt for a side that hadn't settled yet when the
+    // other one did.
+    std::optional<size_t> forward;
+    std::optional<size_t> backward;
+    // an unsettled side has no hits between here and start, so it can carry
+    // on from here with an ordinary search
+    size_t searched_begin;
+    size_t searched_end;
+};
+
+// Searches outwards from start in both directions at once, over line
+// aligned chunks taken in order of how far they are from start, on every
+// thread in pool. Returns as soon as either side has settled, so the
+// nearest hit doesn't wait on a scan to the far end in the other direction.
+// nullopt if stop was requested.
+std::optional<NearestHits>
+search_nearest(WorkerPool &pool, SearchFunction const &forward_searcher,
+               SearchFunction const &backward_searcher,
+               std::string_view file_contents, std::string_view pattern,
+               size_t start, bool caseless, std::stop_token stop);
+
+// Splits [beginning_offset, ending_offset) into chunks that end just after
+// a newline, each at least min_chunk_size long apart from the last.
+std::vector<std::pair<size_t, size_t>> chunks(std::string_view file_contents,
+                                              size_t beginning_offset,
+                                              size_t ending_offset,
+                                              size_t min_chunk_size);
+
+// What a MatchCounter makes of the chunks it's counted so far.
+struct MatchCountEstimate {
+    double count;
+    // either side of count, for about 95% confidence. 0 once it's exact.
+    double margin;
+    size_t chunks_counted;
+    size_t num_chunks;
+
+    bool exact() const {
+        return chunks_counted == num_chunks;
+    }
+    // e.g. "~1.2M matches (+/-5%), 3% counted", or "1234567 matches"
+    std::string describe() const;
+};
+
+// A count of a pattern's matches that's close long before it's done. The
+// chunks get counted in a random order that keeps them spread evenly over
+// the contents: it takes one from each stratum of neighbouring chunks in
+// turn, so a stretch that's thick with matches is never over or under
+// represented by more than a chunk. count_matches() fills it in on a job's
+// threads, estimate() can be called from anywhere in the meantime.
+struct MatchCounter {
+    size_t m_chunk_size;
+    size_t m_num_strata;
+    // everything below is set up by plan(), estimate() leaves it alone
+    // until m_planned. in the order they get counted.
+    std::vector<std::pair<size_t, size_t>> m_chunks;
+    std::vector<uint32_t> m_strata;
+    std::vector<size_t> m_stratum_sizes;
+    // the number of matches in each of m_chunks, or not_counted
+    std::unique_ptr<std::atomic<uint64_t>[]> m_counts;
+    std::atomic<bool> m_planned{false};
+    constexpr static uint64_t not_counted = UINT64_MAX;
+
+    MatchCounter(size_t chunk_size, size_t num_strata)
+        : m_chunk_size(chunk_size), m_num_strata(num_strata) {
+    }
+    MatchCounter(MatchCounter const &) = delete;
+    MatchCounter &operator=(MatchCounter const &) = delete;
+
+    // count_matches() calls it first thing
+    void plan(std::string_view file_contents);
+    // nullopt until count_matches() has got going
+    std::optional<MatchCountEstimate> estimate() const;
+};
+
+// Counts the matches in each of counter's chunks with forward_searcher, on
+// every thread in pool. Matches are counted as search_all() finds them.
+// false if stop was requested first.
+bool count_matches(WorkerPool &pool, SearchFunction const &forward_searcher,
+                   MatchCounter &counter, std::string_view file_contents,
+                   std::string_view pattern, bool caseless,
+                   std::stop_token stop);
+
+// How the matches are spread over num_buckets equal stretches of the
+// contents. Bucket b is the one that offset * num_buckets / size falls in.
+struct MatchDensity {
+    std::vector<uint64_t> counts;
+    // the first match in each bucket, npos if it's empty
+    std::vector<size_t> first_hits;
+};
+
+// Counts the matches in each bucket with forward_searcher, on every thread
+// in pool, without keeping any of their offsets. nullopt if stop was
+// requested.
+std::optional<MatchDensity>
+count_matches_by_bucket(WorkerPool &pool,
+                        SearchFunction const &forward_searcher,
+                        std::string_view file_contents,
+                        std::string_view pattern, size_t num_buckets,
+                        bool caseless, std::stop_token stop);
+
+// Lines that are JSON objects with the value a FieldQuery pattern asks for,
+// at the quote before its key. Only the lines with that key in them get
+// scanned, finding them is most of the work.
+std::optional<size_t> field_search_first(std::string_view file_contents,
+                                         std::string_view pattern,
+                                         size_t beginning_offset,
+                                         size_t ending_offset, bool caseless,
+                                         std::stop_token stop);
+
+std::optional<size_t> field_search_last(std::string_view file_contents,
+                                        std::string_view pattern,
+                                        size_t beginning_offset,
+                                        size_t ending_offset, bool caseless,
+                                        std::stop_token stop);
+
+// The regex kernels above use a lazy DFA, which never backtracks and looks
+// at each byte once. It only does the part of PCRE2's syntax that doesn't
+// need backtracking, and the dfa_ ones hand anything else to the pcre2_
+// ones, as they do when the DFA blows up on a pattern.
+std::optional<size_t> pcre2_search_first(std::string_view file_contents,
+                                         std::string_view pattern,
+                                         size_t beginning_offset,
+                                         size_t ending_offset, bool caseless,
+                                         std::stop_token stop);
+
+std::optional<size_t> pcre2_search_last(std::string_view file_contents,
+                                        std::string_view pattern,
+                                        size_t beginning_offset,
+                                        size_t ending_offset, bool caseless,
+                                        std::stop_token stop);
+
+// What PCRE2 says an error it gave up with means, for
+// SearchProgress::m_regex_error, e.g. "heap limit exceeded".
+std::string regex_error_message(int error);
+
+std::optional<size_t> dfa_search_first(std::string_view file_contents,
+                                       std::string_view pattern,
+                                       size_t beginning_offset,
+                                       size_t ending_offset, bool caseless,
+                                       std::stop_token stop);
+
+std::optional<size_t> dfa_search_last(std::string_view file_contents,
+                                      std::string_view pattern,
+                                      size_t beginning_offset,
+                                      size_t ending_offset, bool caseless,
+                                      std::stop_token stop);
+
+// A pattern that stays highlighted whatever's being searched for, in a
+// colour of its own.
+struct PinnedPattern {
+    std::string pattern;
+    bool caseless;
+
+    bool operator==(PinnedPattern const &) const = default;
+};
+
+struct PinnedMatch {
+    size_t offset;
+    size_t length;
+    // which of the pins it's a match of
+    size_t pin;
+};
+
+// More than this and there aren't enough colours to tell them apart.
+constexpr size_t max_pins = 6;
+
+// The pinned_ kernels only do what the lazy DFA does, so a pattern that
+// needs PCRE2 can't be pinned, and neither can a field query.
+bool can_pin(std::string_view pattern, bool caseless);
+
+// Every match of every one of pins in text, ordered by pin then offset,
+// without empty ones. All the pins go through one DFA together first,
+// which says which of them are in text at all, so it costs about the same
+// however many there are: only the ones that are there get looked at on
+// their own, to find where their matches start and end. nullopt if the
+// DFA gave up on it.
+std::optional<std::vector<PinnedMatch>>
+pinned_matches(std::string_view text, std::vector<PinnedPattern> const &pins);
+
+// The leftmost match of any of pins, the way regex_search_first() would
+// find it for all of them or'd together, in one pass. nullopt if stopped.
+std::optional<size_t>
+pinned_search_first(std::string_view file_contents,
+                    std::vector<PinnedPattern> const &pins,
+                    size_t beginning_offset, size_t ending_offset,
+                    std::stop_token stop);
+
+// The first match of any of pins on the last line that has one.
+std::optional<size_t>
+pinned_search_last(std::string_view file_contents,
+                   std::vector<PinnedPattern> const &pins,
+                   size_t beginning_offset, size_t ending_offset,
+                   std::stop_token stop);
+
+enum class RegexEngine {
+    AUTO,
+    PCRE2,
+};
+
+// PCRE2 makes regex_search_first() and regex_search_last() always use
+// PCRE2, for comparing the two. Process wide, set it before any searches
+// start.
+void set_regex_engine(RegexEngine engine);
+
+// "auto" or "pcre2", nullopt for anything else
+std::optional<RegexEngine> parse_regex_engine(std::string_view name);
+
+// Makes patterns like .status=500 field queries instead of regexes. Off by
+// default, as that's a regex too. Process wide, set it before any searches
+// start.
+void set_field_queries(bool enabled);